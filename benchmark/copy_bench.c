@@ -0,0 +1,107 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/ioctl.h>
+
+#include "block.h"
+#include "tfs.h"
+
+/* You need to change this macro to your TFS mount point*/
+#define TESTDIR "/tmp/mountdir"
+
+/* Size of the file copied; the largest file tfs holds */
+#define FILE_SIZE (MAX_FILE_BLKS*BLOCK_SIZE)
+#define ITERS 20
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Copy "/src" to dst through this process, as cp does */
+static void copy_rw(const char *dst, char *buf) {
+	int in = open(TESTDIR "/src", O_RDONLY);
+	int out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	ssize_t n;
+	if (in < 0 || out < 0) {
+		perror("open");
+		exit(1);
+	}
+	while ((n = read(in, buf, 1 << 16)) > 0) {
+		if (write(out, buf, n) != n) {
+			perror("write");
+			exit(1);
+		}
+	}
+	close(in);
+	close(out);
+}
+
+/* Copy "/src" to dst inside the daemon with TFS_IOC_COPY_RANGE */
+static void copy_ioctl(const char *dst, int flags) {
+	static struct tfs_copy_range range;
+	int out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (out < 0) {
+		perror("open");
+		exit(1);
+	}
+	memset(&range, 0, sizeof(range));
+	strcpy(range.src_path, "/src");
+	range.length = FILE_SIZE;
+	range.flags = flags;
+	if (ioctl(out, TFS_IOC_COPY_RANGE, &range) != FILE_SIZE) {
+		perror("ioctl");
+		exit(1);
+	}
+	close(out);
+}
+
+int main(int argc, char **argv) {
+
+	char *buf = malloc(FILE_SIZE);
+	if (!buf) {
+		perror("malloc");
+		return 1;
+	}
+	for (int i = 0; i < FILE_SIZE; ++i) {
+		buf[i] = rand();
+	}
+
+	int fd = open(TESTDIR "/src", O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0 || write(fd, buf, FILE_SIZE) != FILE_SIZE) {
+		perror("write");
+		return 1;
+	}
+	close(fd);
+
+	/* Each copy overwrites the last; truncating it first frees the blocks it had */
+	double t = now();
+	for (int i = 0; i < ITERS; ++i) {
+		copy_rw(TESTDIR "/dst", buf);
+	}
+	double rw = (now() - t) / ITERS;
+
+	t = now();
+	for (int i = 0; i < ITERS; ++i) {
+		copy_ioctl(TESTDIR "/dst", 0);
+	}
+	double copy = (now() - t) / ITERS;
+
+	t = now();
+	for (int i = 0; i < ITERS; ++i) {
+		copy_ioctl(TESTDIR "/dst", TFS_COPY_CLONE);
+	}
+	double clone = (now() - t) / ITERS;
+
+	printf("%d KB file: read/write %.2f ms, copy ioctl %.2f ms, clone ioctl %.2f ms\n",
+		FILE_SIZE / 1024, rw * 1000, copy * 1000, clone * 1000);
+
+	unlink(TESTDIR "/src");
+	unlink(TESTDIR "/dst");
+	free(buf);
+	return 0;
+}
@@ -0,0 +1,92 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "block.h"
+#include "crc32c.h"
+
+/* Scratch disk file; it is created and removed by the benchmark */
+#define DISKPATH "/tmp/csum_bench_disk"
+
+#define CRC_MB 256
+#define N_BLKS 4096
+#define ITERS 20
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Read every test block ITERS times, returning MB/s */
+static double read_blocks(int start_blk, char *buf) {
+	double t = now();
+	for (int it = 0; it < ITERS; ++it) {
+		for (int i = 0; i < N_BLKS; ++i) {
+			if (bio_read(start_blk + i, buf) < 0) {
+				printf("read of block %d failed\n", start_blk + i);
+				exit(1);
+			}
+		}
+	}
+	return (double)ITERS * N_BLKS * BLOCK_SIZE / (1 << 20) / (now() - t);
+}
+
+int main(int argc, char **argv) {
+
+	char *buf = malloc(1 << 20);
+	uint32_t *csums = calloc(CSUM_BLKS, BLOCK_SIZE);
+	if (!buf || !csums) {
+		perror("malloc");
+		return 1;
+	}
+	for (int i = 0; i < (1 << 20); ++i) {
+		buf[i] = rand();
+	}
+
+	/* CRC32C throughput over 1 MB buffers, hardware instruction against the lookup table */
+	volatile uint32_t sink = 0;
+	double t = now();
+	for (int i = 0; i < CRC_MB; ++i) {
+		sink ^= crc32c(0, buf, 1 << 20);
+	}
+	double hw = CRC_MB / (now() - t);
+	t = now();
+	for (int i = 0; i < CRC_MB / 8; ++i) {
+		sink ^= crc32c_sw(0, buf, 1 << 20);
+	}
+	double sw = CRC_MB / 8 / (now() - t);
+	printf("crc32c: %.0f MB/s (%s), table: %.0f MB/s\n", hw, crc32c_hw_available() ? "sse4.2" : "table", sw);
+
+	/* Block reads with and without verification: the checksum region sits at block 0, the blocks after it */
+	unlink(DISKPATH);
+	dev_init(DISKPATH);
+	int start_blk = CSUM_BLKS;
+	for (int i = 0; i < N_BLKS; ++i) {
+		char *data = buf + (i % 256) * BLOCK_SIZE;
+		if (bio_write(start_blk + i, data) < 0) {
+			printf("write failed\n");
+			return 1;
+		}
+		csums[start_blk + i] = crc32c(0, data, BLOCK_SIZE);
+	}
+	for (int i = 0; i < CSUM_BLKS; ++i) {
+		bio_write(i, (char *)csums + i * BLOCK_SIZE);
+	}
+
+	bio_csum_load(0, CSUM_BLKS, 0);
+	double plain = read_blocks(start_blk, buf);
+	bio_csum_load(0, CSUM_BLKS, 1);
+	double verified = read_blocks(start_blk, buf);
+	printf("bio_read: %.0f MB/s unverified, %.0f MB/s verified (%.1f%% slower)\n",
+		plain, verified, 100 * (plain - verified) / plain);
+
+	dev_close();
+	unlink(DISKPATH);
+	free(csums);
+	free(buf);
+	return 0;
+}
@@ -0,0 +1,118 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+#include "block.h"
+#include "tfs.h"
+
+/* You need to change this macro to your TFS mount point*/
+#define TESTDIR "/tmp/mountdir"
+
+/* Files written a block at a time in turn, so that each ends up in as many extents as it has blocks */
+#define FILES 8
+#define FILE_SIZE (MAX_FILE_BLKS*BLOCK_SIZE)
+#define ITERS 5
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void path(char *p, int i) {
+	sprintf(p, TESTDIR "/defrag/f%d", i);
+}
+
+/* Read every file start to end, dropping what the kernel caches of it first so the reads reach the disk file */
+static double read_all(char *buf) {
+	char p[64];
+	double t = now();
+	for (int iter = 0; iter < ITERS; ++iter) {
+		for (int i = 0; i < FILES; ++i) {
+			path(p, i);
+			int fd = open(p, O_RDONLY);
+			if (fd < 0) {
+				perror("open");
+				exit(1);
+			}
+			posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+			while (read(fd, buf, 1 << 16) > 0);
+			close(fd);
+		}
+	}
+	return (now() - t) / ITERS;
+}
+
+static void defrag(int flags, struct tfs_defrag *d) {
+	int fd = open(TESTDIR "/defrag", O_RDONLY | O_DIRECTORY);
+	memset(d, 0, sizeof(*d));
+	d->flags = flags;
+	if (fd < 0 || ioctl(fd, TFS_IOC_DEFRAG, d) < 0) {
+		perror("ioctl");
+		exit(1);
+	}
+	close(fd);
+}
+
+int main(int argc, char **argv) {
+
+	int fds[FILES];
+	char p[64];
+	struct tfs_defrag before, after;
+
+	char *buf = malloc(1 << 16);
+	if (!buf) {
+		perror("malloc");
+		return 1;
+	}
+	memset(buf, 'a', 1 << 16);
+
+	/* Interleave the files' appends, as writers logging side by side do */
+	mkdir(TESTDIR "/defrag", 0755);
+	for (int i = 0; i < FILES; ++i) {
+		path(p, i);
+		fds[i] = open(p, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		if (fds[i] < 0) {
+			perror("open");
+			return 1;
+		}
+	}
+	for (int b = 0; b < MAX_FILE_BLKS; ++b) {
+		for (int i = 0; i < FILES; ++i) {
+			if (write(fds[i], buf, BLOCK_SIZE) != BLOCK_SIZE) {
+				perror("write");
+				return 1;
+			}
+			fsync(fds[i]);
+		}
+	}
+	for (int i = 0; i < FILES; ++i) {
+		close(fds[i]);
+	}
+
+	defrag(TFS_DEFRAG_DRY_RUN, &before);
+	double slow = read_all(buf);
+
+	double t = now();
+	defrag(0, &after);
+	double took = now() - t;
+	double fast = read_all(buf);
+
+	printf("%d files of %d KB: %u extents in %u fragmented files, %.2f ms to read\n",
+		FILES, FILE_SIZE / 1024, before.extents_before, before.frag_before, slow * 1000);
+	printf("defrag moved %u blocks in %.2f ms: %u extents in %u fragmented files, %.2f ms to read\n",
+		after.blks_moved, took * 1000, after.extents_after, after.frag_after, fast * 1000);
+
+	for (int i = 0; i < FILES; ++i) {
+		path(p, i);
+		unlink(p);
+	}
+	rmdir(TESTDIR "/defrag");
+	free(buf);
+	return 0;
+}
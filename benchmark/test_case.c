@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -6,11 +7,20 @@
 #include <fcntl.h>
 #include <string.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <dirent.h>
+#include <linux/falloc.h>
 
 /* You need to change this macro to your TFS mount point*/
 #define TESTDIR "/tmp/6098EC24/mountdir"
 
+/* TEST 15 formats its own image with these, run from this directory */
+#define MKFS "../src/mkfs.tfs"
+#define FSCK "../src/fsck.tfs"
+#define FSCK_IMAGE "/tmp/tfs_fsck_image"
+#define D_BITMAP_BLOCK 8192
+#define LEAKED_BLOCK 1000
+
 #define N_FILES 100
 #define BLOCKSIZE 4096
 #define FSPATHLEN 256
@@ -210,6 +220,285 @@ int main(int argc, char **argv) {
 	close(fd);	
 
 
+	/* TEST 11: rename test */
+	if ((fd = creat(TESTDIR "/rename_a", FILEPERM)) < 0) {
+		perror("creat");
+		exit(1);
+	}
+	memset(buf, 'a', BLOCKSIZE);
+	write(fd, buf, BLOCKSIZE);
+	close(fd);
+	if ((fd = creat(TESTDIR "/rename_c", FILEPERM)) < 0) {
+		perror("creat");
+		exit(1);
+	}
+	close(fd);
+
+	if (rename(TESTDIR "/rename_a", TESTDIR "/rename_b") < 0
+	|| stat(TESTDIR "/rename_a", &st) == 0
+	|| stat(TESTDIR "/rename_b", &st) < 0 || st.st_size != BLOCKSIZE) {
+		perror("rename");
+		printf("TEST 11: Rename failure \n");
+		exit(1);
+	}
+
+	/* replacing an existing file leaves the moved one's data under its name */
+	if (rename(TESTDIR "/rename_b", TESTDIR "/rename_c") < 0
+	|| stat(TESTDIR "/rename_b", &st) == 0
+	|| (fd = open(TESTDIR "/rename_c", O_RDONLY)) < 0) {
+		perror("rename");
+		printf("TEST 11: Rename replace failure \n");
+		exit(1);
+	}
+	memset(buf, 0, BLOCKSIZE);
+	if (read(fd, buf, BLOCKSIZE) != BLOCKSIZE || buf[0] != 'a' || buf[BLOCKSIZE - 1] != 'a') {
+		printf("TEST 11: Rename replace failure \n");
+		exit(1);
+	}
+	close(fd);
+	unlink(TESTDIR "/rename_c");
+
+	/* a directory moved under another has its ".." point at the new parent; the path
+	 * daemon lists entries without inode numbers, so this is only checked with tfs_ll */
+	if (rename(TESTDIR "/files/dir1", TESTDIR "/files/dir0/moved") < 0
+	|| stat(TESTDIR "/files/dir0", &st) < 0) {
+		perror("rename");
+		printf("TEST 11: Directory rename failure \n");
+		exit(1);
+	}
+	{
+		DIR *dir = opendir(TESTDIR "/files/dir0/moved");
+		struct dirent *entry;
+		int found = 0;
+
+		while (dir && (entry = readdir(dir)) != NULL) {
+			if (strcmp(entry->d_name, ".."))
+				continue;
+			found = 1;
+			if (entry->d_ino != 0xffffffff && entry->d_ino != st.st_ino) {
+				printf("TEST 11: Directory rename \"..\" failure \n");
+				exit(1);
+			}
+		}
+		if (!found) {
+			printf("TEST 11: Directory rename \"..\" failure \n");
+			exit(1);
+		}
+		closedir(dir);
+	}
+
+	/* a directory can't be moved below itself */
+	if (rename(TESTDIR "/files/dir0", TESTDIR "/files/dir0/moved/dir0") == 0 || errno != EINVAL) {
+		printf("TEST 11: Directory rename into itself failure \n");
+		exit(1);
+	}
+	printf("TEST 11: Rename success \n");
+
+
+	/* TEST 12: truncate and utimens test */
+	if ((fd = open(TESTDIR "/trunc", O_RDWR | O_CREAT | O_TRUNC, FILEPERM)) < 0) {
+		perror("open");
+		exit(1);
+	}
+	memset(buf, 'x', BLOCKSIZE);
+	for (i = 0; i < 3; i++) {
+		if (write(fd, buf, BLOCKSIZE) != BLOCKSIZE) {
+			printf("TEST 12: Truncate failure \n");
+			exit(1);
+		}
+	}
+
+	/* shrinking keeps what is left; growing again reads zeros past the cut */
+	if (ftruncate(fd, 5000) < 0 || fstat(fd, &st) < 0 || st.st_size != 5000) {
+		perror("ftruncate");
+		printf("TEST 12: Truncate failure \n");
+		exit(1);
+	}
+	if (truncate(TESTDIR "/trunc", 3*BLOCKSIZE) < 0 || fstat(fd, &st) < 0 || st.st_size != 3*BLOCKSIZE) {
+		perror("truncate");
+		printf("TEST 12: Truncate failure \n");
+		exit(1);
+	}
+	if (pread(fd, buf, BLOCKSIZE, BLOCKSIZE) != BLOCKSIZE
+	|| buf[5000 - BLOCKSIZE - 1] != 'x' || buf[5000 - BLOCKSIZE] != 0 || buf[BLOCKSIZE - 1] != 0) {
+		printf("TEST 12: Truncate failure \n");
+		exit(1);
+	}
+	close(fd);
+
+	{
+		struct timespec times[2] = {
+			{ .tv_sec = 1000000000, .tv_nsec = 500 },
+			{ .tv_sec = 1200000000, .tv_nsec = 0 },
+		};
+
+		if (utimensat(AT_FDCWD, TESTDIR "/trunc", times, 0) < 0
+		|| stat(TESTDIR "/trunc", &st) < 0
+		|| st.st_atim.tv_sec != times[0].tv_sec || st.st_atim.tv_nsec != times[0].tv_nsec
+		|| st.st_mtim.tv_sec != times[1].tv_sec) {
+			perror("utimensat");
+			printf("TEST 12: Utimens failure \n");
+			exit(1);
+		}
+
+		/* UTIME_OMIT keeps the atime while mtime becomes now */
+		times[0].tv_nsec = UTIME_OMIT;
+		times[1].tv_nsec = UTIME_NOW;
+		if (utimensat(AT_FDCWD, TESTDIR "/trunc", times, 0) < 0
+		|| stat(TESTDIR "/trunc", &st) < 0
+		|| st.st_atim.tv_sec != 1000000000 || st.st_mtim.tv_sec <= 1200000000) {
+			perror("utimensat");
+			printf("TEST 12: Utimens failure \n");
+			exit(1);
+		}
+	}
+	unlink(TESTDIR "/trunc");
+	printf("TEST 12: Truncate and utimens success \n");
+
+
+	/* TEST 13: fallocate and punch hole test */
+	if ((fd = open(TESTDIR "/falloc", O_RDWR | O_CREAT | O_TRUNC, FILEPERM)) < 0) {
+		perror("open");
+		exit(1);
+	}
+
+	/* reserved blocks read as zeros and the file grows over them */
+	if (fallocate(fd, 0, 0, 8*BLOCKSIZE) < 0 || fstat(fd, &st) < 0 || st.st_size != 8*BLOCKSIZE) {
+		perror("fallocate");
+		printf("TEST 13: Fallocate failure \n");
+		exit(1);
+	}
+	if (pread(fd, buf, BLOCKSIZE, 4*BLOCKSIZE) != BLOCKSIZE || buf[0] != 0 || buf[BLOCKSIZE - 1] != 0) {
+		printf("TEST 13: Fallocate failure \n");
+		exit(1);
+	}
+	if (fallocate(fd, FALLOC_FL_KEEP_SIZE, 8*BLOCKSIZE, 2*BLOCKSIZE) < 0
+	|| fstat(fd, &st) < 0 || st.st_size != 8*BLOCKSIZE) {
+		perror("fallocate");
+		printf("TEST 13: Fallocate keep size failure \n");
+		exit(1);
+	}
+
+	/* a punched hole reads zeros and the blocks around it and the size are kept */
+	memset(buf, 'y', BLOCKSIZE);
+	for (i = 0; i < 8; i++) {
+		if (pwrite(fd, buf, BLOCKSIZE, i*BLOCKSIZE) != BLOCKSIZE) {
+			printf("TEST 13: Fallocate failure \n");
+			exit(1);
+		}
+	}
+	if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, BLOCKSIZE, 2*BLOCKSIZE) < 0
+	|| fstat(fd, &st) < 0 || st.st_size != 8*BLOCKSIZE) {
+		perror("fallocate");
+		printf("TEST 13: Punch hole failure \n");
+		exit(1);
+	}
+	for (i = 0; i < 4; i++) {
+		char expect = i == 1 || i == 2 ? 0 : 'y';
+		if (pread(fd, buf, BLOCKSIZE, i*BLOCKSIZE) != BLOCKSIZE || buf[0] != expect || buf[BLOCKSIZE - 1] != expect) {
+			printf("TEST 13: Punch hole failure \n");
+			exit(1);
+		}
+	}
+	close(fd);
+	unlink(TESTDIR "/falloc");
+	printf("TEST 13: Fallocate and punch hole success \n");
+
+
+	/* TEST 14: snapshot test */
+	if ((ret = mkdir(TESTDIR "/.snapshots/test", DIRPERM)) < 0) {
+		perror("mkdir");
+		printf("TEST 14: Snapshot create failure \n");
+		exit(1);
+	}
+
+	/* the live file changes after the snapshot; the snapshot's copy doesn't */
+	if ((fd = open(TESTDIR "/largefile", O_WRONLY)) < 0) {
+		perror("open");
+		exit(1);
+	}
+	memset(buf, 'Z', BLOCKSIZE);
+	if (pwrite(fd, buf, BLOCKSIZE, 100*BLOCKSIZE) != BLOCKSIZE) {
+		printf("TEST 14: Snapshot failure \n");
+		exit(1);
+	}
+	close(fd);
+	if ((fd = open(TESTDIR "/.snapshots/test/largefile", O_RDONLY)) < 0) {
+		perror("open");
+		printf("TEST 14: Snapshot failure \n");
+		exit(1);
+	}
+	if (pread(fd, buf, BLOCKSIZE, 100*BLOCKSIZE) != BLOCKSIZE || buf[0] != 0x61 + 100 % 26) {
+		printf("TEST 14: Snapshot failure \n");
+		exit(1);
+	}
+	close(fd);
+
+	/* nothing in a snapshot can be changed */
+	if ((fd = open(TESTDIR "/.snapshots/test/largefile", O_WRONLY)) < 0
+	|| write(fd, buf, BLOCKSIZE) >= 0 || errno != EROFS) {
+		printf("TEST 14: Snapshot read-only failure \n");
+		exit(1);
+	}
+	close(fd);
+	if (creat(TESTDIR "/.snapshots/test/new", FILEPERM) >= 0 || errno != EROFS
+	|| unlink(TESTDIR "/.snapshots/test/largefile") == 0 || errno != EROFS) {
+		printf("TEST 14: Snapshot read-only failure \n");
+		exit(1);
+	}
+
+	if ((ret = rmdir(TESTDIR "/.snapshots/test")) < 0) {
+		perror("rmdir");
+		printf("TEST 14: Snapshot drop failure \n");
+		exit(1);
+	}
+	if (opendir(TESTDIR "/.snapshots/test") != NULL) {
+		printf("TEST 14: Snapshot drop failure \n");
+		exit(1);
+	}
+	printf("TEST 14: Snapshot success \n");
+
+
+	/* TEST 15: fsck leaked block test, on an image of its own since fsck needs one that isn't mounted */
+	if ((ret = system(MKFS " -q -f " FSCK_IMAGE)) != 0) {
+		printf("TEST 15: Formatting %s failure \n", FSCK_IMAGE);
+		exit(1);
+	}
+	{
+		unsigned char c;
+
+		/* mark a free data block used, so no file maps it */
+		if ((fd = open(FSCK_IMAGE, O_RDWR)) < 0
+		|| pread(fd, &c, 1, D_BITMAP_BLOCK + LEAKED_BLOCK / 8) != 1
+		|| (c & (1 << (LEAKED_BLOCK & 7)))) {
+			printf("TEST 15: Fsck setup failure \n");
+			exit(1);
+		}
+		c |= 1 << (LEAKED_BLOCK & 7);
+		pwrite(fd, &c, 1, D_BITMAP_BLOCK + LEAKED_BLOCK / 8);
+		close(fd);
+	}
+
+	/* found and left (4), repaired (1), then clean (0) */
+	ret = system(FSCK " -n " FSCK_IMAGE " > /dev/null");
+	if (!WIFEXITED(ret) || WEXITSTATUS(ret) != 4) {
+		printf("TEST 15: Fsck detect failure \n");
+		exit(1);
+	}
+	ret = system(FSCK " -y " FSCK_IMAGE " > /dev/null");
+	if (!WIFEXITED(ret) || WEXITSTATUS(ret) != 1) {
+		printf("TEST 15: Fsck repair failure \n");
+		exit(1);
+	}
+	ret = system(FSCK " " FSCK_IMAGE " > /dev/null");
+	if (!WIFEXITED(ret) || WEXITSTATUS(ret) != 0) {
+		printf("TEST 15: Fsck repair failure \n");
+		exit(1);
+	}
+	unlink(FSCK_IMAGE);
+	printf("TEST 15: Fsck leaked block success \n");
+
+
 	printf("Benchmark completed \n");
 	return 0;
 }
@@ -9,6 +9,8 @@
  *
  */
 
+#define _GNU_SOURCE
+
 #include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
@@ -18,9 +20,17 @@
 #include <sys/stat.h>
 
 #include "block.h"
+#include "crc32c.h"
 
 int diskfile = -1;
 
+// in-memory copy of the checksum region: the CRC32C of every block's contents, 0 for blocks that
+// aren't checked. Writes to the region refresh it; reads of a checked block are verified against it.
+uint32_t *csum_table = NULL;
+int csum_start_blk = -1;
+int csum_nblks = 0;
+int csum_verify = 0;
+
 //Creates a file which is your new emulated disk
 void dev_init(const char* diskfile_path) {
     if (diskfile >= 0) {
@@ -53,6 +63,82 @@ int dev_open(const char* diskfile_path) {
 void dev_close() {
     if (diskfile >= 0) {
 		close(diskfile);
+		diskfile = -1;
+    }
+    free(csum_table);
+    csum_table = NULL;
+    csum_start_blk = -1;
+}
+
+static int csum_in_region(const int block_num) {
+    return block_num >= csum_start_blk && block_num < csum_start_blk + csum_nblks;
+}
+
+//Check each block read into iov against its checksum; every iov_len is a multiple of BLOCK_SIZE
+static int csum_check(const int block_num, const struct iovec *iov, int iovcnt) {
+    int blk = block_num;
+    for (int i = 0; i < iovcnt; ++i) {
+		for (size_t off = 0; off < iov[i].iov_len; off += BLOCK_SIZE, ++blk) {
+			if (blk >= DISK_BLKS || !csum_table[blk] || csum_in_region(blk)) {
+				continue;
+			}
+			if (crc32c(0, (char *)iov[i].iov_base + off, BLOCK_SIZE) != csum_table[blk]) {
+				fprintf(stderr, "block %d: checksum mismatch\n", blk);
+				return -1;
+			}
+		}
+    }
+    return 0;
+}
+
+//Keep the in-memory checksum table in step with writes to the checksum region
+static void csum_absorb(const int block_num, const struct iovec *iov, int iovcnt) {
+    int blk = block_num;
+    for (int i = 0; i < iovcnt; ++i) {
+		for (size_t off = 0; off < iov[i].iov_len; off += BLOCK_SIZE, ++blk) {
+			if (csum_in_region(blk)) {
+				memcpy((char *)csum_table + (size_t)(blk - csum_start_blk)*BLOCK_SIZE, (char *)iov[i].iov_base + off, BLOCK_SIZE);
+			}
+		}
+    }
+}
+
+//Load the checksum region, after which writes to it are tracked and, with verify, reads are checked
+int bio_csum_load(const int start_blk, const int nblks, const int verify) {
+    uint32_t *table = malloc((size_t)nblks*BLOCK_SIZE);
+    if (!table) {
+		return -1;
+    }
+    if (pread(diskfile, table, (size_t)nblks*BLOCK_SIZE, (off_t)start_blk*BLOCK_SIZE) < 0) {
+		perror("checksum load failed");
+		free(table);
+		return -1;
+    }
+    free(csum_table);
+    csum_table = table;
+    csum_start_blk = start_blk;
+    csum_nblks = nblks;
+    csum_verify = verify;
+    return 0;
+}
+
+//The checksum region block holding block_num's checksum, or -1 if checksums aren't loaded
+int bio_csum_blk(const int block_num) {
+    if (!csum_table || block_num < 0 || block_num >= DISK_BLKS || csum_in_region(block_num)) {
+		return -1;
+    }
+    return csum_start_blk + block_num/CSUM_PER_BLK;
+}
+
+//Copy a checksum region block as of the last write to it
+void bio_csum_read(const int csum_blk, void *buf) {
+    memcpy(buf, (char *)csum_table + (size_t)(csum_blk - csum_start_blk)*BLOCK_SIZE, BLOCK_SIZE);
+}
+
+//Stop checking a block until its checksum region block is next written
+void bio_csum_drop(const int block_num) {
+    if (bio_csum_blk(block_num) >= 0) {
+		csum_table[block_num] = 0;
     }
 }
 
@@ -65,6 +151,12 @@ int bio_read(const int block_num, void *buf) {
 		if (retstat < 0)
 			perror("block_read failed");
     }
+    else if (csum_verify && csum_table) {
+		struct iovec iov = { buf, BLOCK_SIZE };
+		if (csum_check(block_num, &iov, 1) < 0) {
+			return -1;
+		}
+    }
 
     return retstat;
 }
@@ -76,6 +168,57 @@ int bio_write(const int block_num, const void *buf) {
     if (retstat < 0) {
 		    perror("block_write failed");
     }
+    else if (csum_table && csum_in_region(block_num)) {
+		struct iovec iov = { (void *)buf, BLOCK_SIZE };
+		csum_absorb(block_num, &iov, 1);
+    }
     return retstat;
 }
 
+
+//Read consecutive blocks starting at block_num into a list of block buffers in one call
+int bio_readv(const int block_num, const struct iovec *iov, int iovcnt) {
+    int retstat = 0;
+    retstat = preadv(diskfile, iov, iovcnt, (off_t)block_num*BLOCK_SIZE);
+    if (retstat < 0) {
+		    perror("block_readv failed");
+    }
+    else if (csum_verify && csum_table && csum_check(block_num, iov, iovcnt) < 0) {
+		return -1;
+    }
+    return retstat;
+}
+
+//Write consecutive blocks starting at block_num from a list of block buffers in one call
+int bio_writev(const int block_num, const struct iovec *iov, int iovcnt) {
+    int retstat = 0;
+    retstat = pwritev(diskfile, iov, iovcnt, (off_t)block_num*BLOCK_SIZE);
+    if (retstat < 0) {
+		    perror("block_writev failed");
+    }
+    else if (csum_table && block_num < csum_start_blk + csum_nblks) {
+		csum_absorb(block_num, iov, iovcnt);
+    }
+    return retstat;
+}
+
+//Flush written blocks to stable storage
+int dev_sync() {
+    int retstat = 0;
+    retstat = fdatasync(diskfile);
+    if (retstat < 0) {
+		    perror("disk_sync failed");
+    }
+    return retstat;
+}
+
+//Write out consecutive blocks starting at block_num and wait for them, without flushing the rest of the disk
+int bio_sync(const int block_num, const int count) {
+    int retstat = 0;
+    retstat = sync_file_range(diskfile, (off_t)block_num*BLOCK_SIZE, (off_t)count*BLOCK_SIZE,
+			SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    if (retstat < 0) {
+		    perror("block_sync failed");
+    }
+    return retstat;
+}
@@ -12,16 +12,32 @@
 #ifndef _BLOCK_H_
 #define _BLOCK_H_
 
+#include <sys/uio.h>
+
 
 //Disk size set to 32MB
 #define DISK_SIZE	32*1024*1024
 //Block size set to 4KB
 #define BLOCK_SIZE 4096
+//Blocks on the disk
+#define DISK_BLKS (DISK_SIZE/BLOCK_SIZE)
+//CRC32C checksums held by one checksum region block, and the region size covering every block of the disk
+#define CSUM_PER_BLK (BLOCK_SIZE/4)
+#define CSUM_BLKS ((DISK_BLKS + CSUM_PER_BLK - 1)/CSUM_PER_BLK)
 
 void dev_init(const char* diskfile_path);
 int dev_open(const char* diskfile_path);
 void dev_close();
 int bio_read(const int block_num, void *buf);
 int bio_write(const int block_num, const void *buf);
+int bio_readv(const int block_num, const struct iovec *iov, int iovcnt);
+int bio_writev(const int block_num, const struct iovec *iov, int iovcnt);
+int bio_sync(const int block_num, const int count);
+int dev_sync();
+
+int bio_csum_load(const int start_blk, const int nblks, const int verify);
+int bio_csum_blk(const int block_num);
+void bio_csum_read(const int csum_blk, void *buf);
+void bio_csum_drop(const int block_num);
 
 #endif
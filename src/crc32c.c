@@ -0,0 +1,97 @@
+/*
+ *  Copyright (C) 2019 CS416 Spring 2019
+ *
+ *	Tiny File System
+ *
+ *	File:	crc32c.c
+ *
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "crc32c.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define CRC32C_X86 1
+#endif
+
+// reflected Castagnoli polynomial
+#define CRC32C_POLY 0x82F63B78
+
+static uint32_t crc32c_table[256];
+static int crc32c_hw = 0;
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_init() {
+    for (uint32_t i = 0; i < 256; ++i) {
+		uint32_t crc = i;
+		for (int k = 0; k < 8; ++k) {
+			crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+		}
+		crc32c_table[i] = crc;
+    }
+#ifdef CRC32C_X86
+    __builtin_cpu_init();
+    crc32c_hw = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len) {
+    const unsigned char *p = buf;
+
+    pthread_once(&crc32c_once, crc32c_init);
+    crc = ~crc;
+    while (len--) {
+		crc = crc32c_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+#ifdef CRC32C_X86
+//Eight bytes per instruction once the pointer is aligned
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const void *buf, size_t len) {
+    const unsigned char *p = buf;
+
+    crc = ~crc;
+    while (len && ((uintptr_t)p & 7)) {
+		crc = _mm_crc32_u8(crc, *p++);
+		--len;
+    }
+#ifdef __x86_64__
+    uint64_t crc64 = crc;
+    while (len >= 8) {
+		crc64 = _mm_crc32_u64(crc64, *(const uint64_t *)p);
+		p += 8;
+		len -= 8;
+    }
+    crc = (uint32_t)crc64;
+#endif
+    while (len >= 4) {
+		crc = _mm_crc32_u32(crc, *(const uint32_t *)p);
+		p += 4;
+		len -= 4;
+    }
+    while (len--) {
+		crc = _mm_crc32_u8(crc, *p++);
+    }
+    return ~crc;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+    pthread_once(&crc32c_once, crc32c_init);
+#ifdef CRC32C_X86
+    if (crc32c_hw) {
+		return crc32c_sse42(crc, buf, len);
+    }
+#endif
+    return crc32c_sw(crc, buf, len);
+}
+
+int crc32c_hw_available() {
+    pthread_once(&crc32c_once, crc32c_init);
+    return crc32c_hw;
+}
@@ -0,0 +1,26 @@
+/*
+ *  Copyright (C) 2019 CS416 Spring 2019
+ *
+ *	Tiny File System
+ *
+ *	File:	crc32c.h
+ *
+ */
+
+#ifndef _CRC32C_H_
+#define _CRC32C_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+//CRC32C (Castagnoli) of len bytes, continuing from crc (0 to start).
+//Uses the SSE4.2 crc32 instruction when the CPU has it, a lookup table otherwise.
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+//The lookup table version, for comparison
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len);
+
+//1 if crc32c() uses the hardware instruction
+int crc32c_hw_available();
+
+#endif
@@ -0,0 +1,844 @@
+/*
+ *  Copyright (C) 2019 CS416 Spring 2019
+ *
+ *	Tiny File System
+ *
+ *	File:	fsck.c
+ *
+ *	Offline checker for a TFS disk file. The image is mapped into memory and
+ *	committed journal transactions are replayed into the mapping first. A pool
+ *	of threads then scans the inode table, counting the owners of every data
+ *	block, walks the directory tree from the root, counting the entries naming
+ *	every inode, and finally compares the counts with both bitmaps, the
+ *	reference count region and the superblock, one block group per task.
+ *	With -y the differences are repaired in place; otherwise the mapping is
+ *	private and the file isn't written.
+ *
+ *	usage: fsck.tfs [-n | -y] [-j threads] DISKFILE
+ *	exit status: 0 clean, 1 problems fixed, 4 problems left, 8 couldn't check
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "block.h"
+#include "crc32c.h"
+#include "journal.h"
+#include "tfs.h"
+
+#define FSCK_OK 0
+#define FSCK_FIXED 1
+#define FSCK_UNFIXED 4
+#define FSCK_FAILED 8
+
+#define MAX_THREADS 64
+
+#define I_PER_BLK (BLOCK_SIZE/INODE_SIZE)
+#define I_BLKS ((MAX_INUM + I_PER_BLK - 1)/I_PER_BLK)
+#define DIRENTS_PER_BLK (BLOCK_SIZE/sizeof(struct dirent))
+
+struct fsck_config {
+    int repair;						/* -y: write fixes back to the image */
+    int threads;					/* -j: size of the thread pool */
+};
+
+struct fsck_config fsck_config = { .repair = 0, .threads = 0 };
+
+// the mapped image, and the regions of it the checks read through
+char *image = NULL;
+size_t image_size = 0;
+struct superblock *sb = NULL;
+bitmap_t i_bitmap = NULL;
+bitmap_t d_bitmap = NULL;
+uint16_t *d_refs = NULL;
+uint32_t *csums = NULL;
+
+// filled by the inode scan: file block pointers and pointer arrays naming each data block,
+// and whether one of them is a pointer array or directory block, which may have only one owner
+uint32_t owners[MAX_DNUM];
+unsigned char meta[MAX_DNUM];
+// inodes that are valid but unusable, checked as if free
+unsigned char bad[MAX_INUM];
+
+// filled by the directory walk: entries naming each inode, and the directory holding a directory's entry
+uint32_t names[MAX_INUM];
+int parent[MAX_INUM];
+
+// filled by the group checks: inodes to add to the orphan list, so the next mount reclaims them
+uint16_t lost[MAX_INUM];
+int lost_cnt = 0;
+
+// blocks changed by a repair, whose checksums are recomputed before the image is synced
+unsigned char dirty[DISK_BLKS];
+
+// directory walk queue; each directory is queued once, when its first entry is found
+int dir_queue[MAX_INUM];
+int dir_head = 0;
+int dir_tail = 0;
+int dir_busy = 0;
+pthread_mutex_t dir_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t dir_cond = PTHREAD_COND_INITIALIZER;
+
+// next inode table block or block group a worker takes
+int next_task = 0;
+
+pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+int fixed = 0;
+int unfixed = 0;
+
+
+static void *blk(int blkno) {
+    return image + (size_t)blkno*BLOCK_SIZE;
+}
+
+static struct inode *inode_at(int ino) {
+    return (struct inode *)blk(sb->i_start_blk + ino/I_PER_BLK) + ino%I_PER_BLK;
+}
+
+static void inode_dirty(int ino) {
+    dirty[sb->i_start_blk + ino/I_PER_BLK] = 1;
+}
+
+// Bitmap updates from different block groups may touch the same byte
+static void bitmap_set(bitmap_t b, int i) {
+    __atomic_fetch_or(&b[i / 8], 1 << (i & 7), __ATOMIC_RELAXED);
+}
+
+static void bitmap_unset(bitmap_t b, int i) {
+    __atomic_fetch_and(&b[i / 8], ~(1 << (i & 7)), __ATOMIC_RELAXED);
+}
+
+// Print a problem. One the caller repairs when fsck_config.repair is set counts as fixed, any other as left.
+static void problem(int fixable, const char *format, ...) {
+
+    va_list ap;
+    pthread_mutex_lock(&report_lock);
+    va_start(ap, format);
+    vprintf(format, ap);
+    va_end(ap);
+    if(fixable && fsck_config.repair) {
+        printf(", fixed\n");
+        ++fixed;
+    } else {
+        printf("\n");
+        ++unfixed;
+    }
+    pthread_mutex_unlock(&report_lock);
+}
+
+// Check a metadata block against its checksum; 0 means it has none
+static void csum_check(int blkno, const char *what) {
+
+    if(blkno >= (int)sb->csum_start_blk && blkno < (int)(sb->csum_start_blk + sb->csum_blks)) return;
+    if(!csums[blkno] || crc32c(0, blk(blkno), BLOCK_SIZE) == csums[blkno]) return;
+
+    problem(1, "block %d (%s): checksum mismatch", blkno, what);
+    if(fsck_config.repair) dirty[blkno] = 1;
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void run_pool(void *(*worker)(void *)) {
+
+    pthread_t threads[MAX_THREADS];
+
+    next_task = 0;
+    for(int t = 0; t < fsck_config.threads; ++t) pthread_create(&threads[t], NULL, worker, NULL);
+    for(int t = 0; t < fsck_config.threads; ++t) pthread_join(threads[t], NULL);
+}
+
+
+/*
+ * superblock and journal
+ */
+
+// The layout must be the one this build of tfs formats, since the in-memory tables are sized by it
+static int check_superblock() {
+
+    if(sb->magic_num != MAGIC_NUM) {
+        fprintf(stderr, "fsck.tfs: bad magic number 0x%x, not a TFS image\n", sb->magic_num);
+        return -1;
+    }
+    if(sb->version != TFS_VERSION) {
+        fprintf(stderr, "fsck.tfs: layout version %u, this checker reads version %d\n", sb->version, TFS_VERSION);
+        return -1;
+    }
+    if(sb->max_inum != MAX_INUM
+    || sb->max_dnum != MAX_DNUM
+    || sb->j_blks != JOURNAL_BLKS
+    || sb->csum_blks != CSUM_BLKS
+    || sb->ref_blks != REF_BLKS
+    || sb->groups < 1
+    || sb->groups > BLOCK_GROUPS
+    || sb->i_start_blk + I_BLKS > sb->j_start_blk
+    || sb->j_start_blk + sb->j_blks > sb->csum_start_blk
+    || sb->csum_start_blk + sb->csum_blks > sb->ref_start_blk
+    || sb->ref_start_blk + sb->ref_blks > sb->d_start_blk
+    || sb->d_start_blk + MAX_DNUM > DISK_BLKS
+    || sb->i_bitmap_blk >= sb->i_start_blk
+    || sb->d_bitmap_blk >= sb->i_start_blk
+    || sb->snap_ino >= MAX_INUM
+    ) {
+        fprintf(stderr, "fsck.tfs: superblock layout doesn't match this build of tfs\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Check the superblock, bitmaps and reference counts against their checksums, and the block group descriptors
+static void check_metadata() {
+
+    csum_check(0, "superblock");
+    csum_check(sb->i_bitmap_blk, "inode bitmap");
+    csum_check(sb->d_bitmap_blk, "data block bitmap");
+    for(uint32_t i = 0; i < sb->ref_blks; ++i) csum_check(sb->ref_start_blk + i, "reference counts");
+
+    // block groups split inodes and data blocks evenly, as mkfs lays them out
+    struct superblock layout;
+    mkfs_layout(&layout, sb->groups);
+    for(uint32_t g = 0; g < sb->groups; ++g) {
+        struct group_desc *gd = &sb->group[g];
+        struct group_desc *expect = &layout.group[g];
+        if(gd->first_ino == expect->first_ino && gd->inodes == expect->inodes
+        && gd->first_blk == expect->first_blk && gd->blks == expect->blks) continue;
+
+        problem(1, "group %u: descriptor doesn't match the layout", g);
+        if(fsck_config.repair) *gd = *expect;
+    }
+}
+
+// Replay committed transactions a crash left in the journal, as mounting would. Without -y they only reach the private mapping.
+static int replay_journal() {
+
+    struct journal_header *header = blk(sb->j_start_blk);
+    uint32_t j_start_blk = sb->j_start_blk;
+    uint32_t j_nblks = sb->j_blks;
+    int replayed = 0;
+
+    if(header->magic != JOURNAL_MAGIC) {
+        problem(0, "journal: bad header");
+        return -1;
+    }
+
+    for(;;) {
+        uint32_t head = header->head;
+        struct journal_desc *desc = blk(j_start_blk + head);
+
+        // a transaction never straddles the end of the region, so look for it at the start
+        if(head + 2 > j_nblks || desc->magic != JOURNAL_DESC_MAGIC || desc->seq != header->seq) {
+            head = 1;
+            desc = blk(j_start_blk + head);
+            if(desc->magic != JOURNAL_DESC_MAGIC || desc->seq != header->seq) break;
+        }
+        if(desc->count == 0 || desc->count > JOURNAL_TX_BLKS || head + desc->count + 2 > j_nblks) break;
+
+        // the logged blocks sit back to back, so their checksum is one pass over them
+        char *data = blk(j_start_blk + head + 1);
+        struct journal_commit *commit = blk(j_start_blk + head + 1 + desc->count);
+        if(commit->magic != JOURNAL_COMMIT_MAGIC
+        || commit->seq != desc->seq
+        || commit->count != desc->count
+        || commit->checksum != crc32c(0, data, (size_t)desc->count*BLOCK_SIZE)
+        ) {
+            break;
+        }
+
+        for(uint32_t i = 0; i < desc->count; ++i) {
+            if(desc->blocks[i] < 0 || desc->blocks[i] >= DISK_BLKS) continue;
+            memcpy(blk(desc->blocks[i]), data + (size_t)i*BLOCK_SIZE, BLOCK_SIZE);
+        }
+        header->head = head + desc->count + 2;
+        header->seq++;
+        ++replayed;
+    }
+
+    if(replayed) {
+        printf("journal: %d committed transaction(s) replayed%s\n", replayed, fsck_config.repair ? "" : " in memory only");
+    }
+    return 0;
+}
+
+
+/*
+ * inode table scan
+ */
+
+// Count one owner of a data block named by the pointer at *ptr, which lives in block holder
+static void claim(int ino, int *ptr, int holder, int is_meta) {
+
+    if(*ptr < 0) return;
+    if(*ptr >= MAX_DNUM) {
+        problem(1, "inode %d: block pointer %d out of range", ino, *ptr);
+        if(fsck_config.repair) {
+            *ptr = -1;
+            dirty[holder] = 1;
+        }
+        return;
+    }
+    __atomic_fetch_add(&owners[*ptr], 1, __ATOMIC_RELAXED);
+    if(is_meta) meta[*ptr] = 1;
+}
+
+// An inode that can't be followed is checked as if free; repairing clears it, freeing what it held
+static void clear_inode(int ino) {
+
+    bad[ino] = 1;
+    if(fsck_config.repair) {
+        memset(inode_at(ino), 0, sizeof(struct inode));
+        inode_dirty(ino);
+    }
+}
+
+static void check_inode(int ino) {
+
+    struct inode *inode = inode_at(ino);
+    int holder = sb->i_start_blk + ino/I_PER_BLK;
+
+    if(!inode->valid) return;
+
+
+    // Step 1: Check the fixed fields
+    if(inode->type != file && inode->type != directory) {
+        problem(1, "inode %d: unknown type %u, clearing", ino, inode->type);
+        clear_inode(ino);
+        return;
+    }
+    if(inode->ino != ino) {
+        problem(1, "inode %d: records inode number %u", ino, inode->ino);
+        if(fsck_config.repair) {
+            inode->ino = ino;
+            inode->vstat.st_ino = ino;
+            dirty[holder] = 1;
+        }
+    }
+
+
+    // Step 2: Inline data holds no blocks, but must fit in the inode
+    if(inode->flags & INODE_INLINE) {
+        if(inode->size > INLINE_MAX || (inode->type == directory && inode->size < INLINE_DIR_HDR)) {
+            problem(1, "inode %d: inline size %u out of range, clearing", ino, inode->size);
+            clear_inode(ino);
+        }
+        return;
+    }
+    if(inode->size > (uint32_t)MAX_FILE_BLKS*BLOCK_SIZE) {
+        problem(0, "inode %d: size %u larger than the block map", ino, inode->size);
+    }
+
+
+    // Step 3: Count the owners of every block the map names; a directory's blocks hold its entries
+    for(int k = 0; k < 16; ++k) claim(ino, &inode->direct_ptr[k], holder, inode->type == directory);
+    for(int i = 0; i < 8; ++i) {
+        claim(ino, &inode->indirect_ptr[i], holder, 1);
+        if(inode->indirect_ptr[i] < 0 || inode->indirect_ptr[i] >= MAX_DNUM) continue;
+
+        int array = sb->d_start_blk + inode->indirect_ptr[i];
+        csum_check(array, "pointer array");
+        int *ptr_blk = blk(array);
+        for(int j = 0; j < PTRS_PER_BLK; ++j) claim(ino, &ptr_blk[j], array, inode->type == directory);
+    }
+}
+
+static void *scan_worker(void *arg) {
+
+    for(;;) {
+        int i_blkno = __atomic_fetch_add(&next_task, 1, __ATOMIC_RELAXED);
+        if(i_blkno >= I_BLKS) break;
+
+        csum_check(sb->i_start_blk + i_blkno, "inode table");
+        for(int ino = i_blkno*I_PER_BLK; ino < (i_blkno + 1)*I_PER_BLK && ino < MAX_INUM; ++ino) check_inode(ino);
+    }
+    return NULL;
+}
+
+
+/*
+ * directory walk
+ */
+
+static void dir_push(int ino) {
+
+    pthread_mutex_lock(&dir_lock);
+    dir_queue[dir_tail++] = ino;
+    pthread_cond_signal(&dir_cond);
+    pthread_mutex_unlock(&dir_lock);
+}
+
+static int entry_ok(int ino) {
+    return ino < MAX_INUM && inode_at(ino)->valid && !bad[ino];
+}
+
+// Check one entry of directory ino other than "." and "..". Returns 1 if the entry should be removed.
+static int check_entry(int ino, int target, const char *name) {
+
+    if(!entry_ok(target)) {
+        problem(1, "directory %d: entry \"%s\" names free inode %d, removing", ino, name, target);
+        return 1;
+    }
+    if(target == 0) {
+        problem(1, "directory %d: entry \"%s\" names the root, removing", ino, name);
+        return 1;
+    }
+
+    // there are no hard links, so an inode has one name; the first entry the walk finds is the one kept
+    if(__atomic_fetch_add(&names[target], 1, __ATOMIC_RELAXED)) {
+        __atomic_fetch_sub(&names[target], 1, __ATOMIC_RELAXED);
+        problem(1, "directory %d: entry \"%s\" is a second name of inode %d, removing", ino, name, target);
+        return 1;
+    }
+    if(inode_at(target)->type != directory) return 0;
+    parent[target] = ino;
+    dir_push(target);
+    return 0;
+}
+
+static void walk_inline_dir(int ino, struct inode *dir) {
+
+    uint16_t dotdot;
+    memcpy(&dotdot, dir->inline_data, INLINE_DIR_HDR);
+    if(dotdot != parent[ino]) {
+        problem(1, "directory %d: \"..\" names %u instead of %d", ino, dotdot, parent[ino]);
+        if(fsck_config.repair) {
+            dotdot = parent[ino];
+            memcpy(dir->inline_data, &dotdot, INLINE_DIR_HDR);
+            inode_dirty(ino);
+        }
+    }
+
+    for(uint32_t off = INLINE_DIR_HDR; off < dir->size; ) {
+        struct inline_dirent *entry = (struct inline_dirent *)(dir->inline_data + off);
+        uint32_t len = sizeof(struct inline_dirent) + entry->name_len;
+        char name[256] = {0};
+
+        // a torn entry ends the directory
+        if(off + sizeof(struct inline_dirent) > dir->size || off + len > dir->size || !entry->name_len) {
+            problem(1, "directory %d: inline entry at offset %u overruns the directory, truncating", ino, off);
+            if(fsck_config.repair) {
+                memset(dir->inline_data + off, 0, INLINE_MAX - off);
+                dir->size = off;
+                dir->vstat.st_size = off;
+                inode_dirty(ino);
+            }
+            break;
+        }
+        memcpy(name, entry->name, entry->name_len);
+
+        if(check_entry(ino, entry->ino, name) && fsck_config.repair) {
+            memmove(dir->inline_data + off, dir->inline_data + off + len, dir->size - off - len);
+            memset(dir->inline_data + dir->size - len, 0, len);
+            dir->size -= len;
+            dir->vstat.st_size = dir->size;
+            inode_dirty(ino);
+            continue;
+        }
+        off += len;
+    }
+}
+
+// Walk one dirent block; each block's entries are packed from its start, up to the first invalid one
+static void walk_dir_blk(int ino, int blkno) {
+
+    int abs_blkno = sb->d_start_blk + blkno;
+    struct dirent *dirent_blk = blk(abs_blkno);
+    int cnt = 0;
+
+    csum_check(abs_blkno, "directory");
+    while(cnt < (int)DIRENTS_PER_BLK && dirent_blk[cnt].valid) ++cnt;
+
+    for(int k = 0; k < cnt; ) {
+        struct dirent *dirent = &dirent_blk[k];
+        char name[sizeof(dirent->name) + 1] = {0};
+        memcpy(name, dirent->name, sizeof(dirent->name));
+
+        if(!strcmp(name, ".") || !strcmp(name, "..")) {
+            int expect = name[1] ? parent[ino] : ino;
+            if(dirent->ino != expect) {
+                problem(1, "directory %d: \"%s\" names %u instead of %d", ino, name, dirent->ino, expect);
+                if(fsck_config.repair) {
+                    dirent->ino = expect;
+                    dirty[abs_blkno] = 1;
+                }
+            }
+            ++k;
+            continue;
+        }
+
+        // a removed entry is replaced by the block's last one, keeping the block packed
+        if(check_entry(ino, dirent->ino, name) && fsck_config.repair) {
+            memcpy(dirent, &dirent_blk[cnt - 1], sizeof(struct dirent));
+            memset(&dirent_blk[cnt - 1], 0, sizeof(struct dirent));
+            --cnt;
+            dirty[abs_blkno] = 1;
+            continue;
+        }
+        ++k;
+    }
+}
+
+// Walk a directory's entries in the order dir_iterate() does
+static void walk_dir(int ino) {
+
+    struct inode *dir = inode_at(ino);
+
+    if(dir->flags & INODE_INLINE) {
+        walk_inline_dir(ino, dir);
+        return;
+    }
+
+    for(int k = 0; k < 16; ++k) {
+        if(dir->direct_ptr[k] < 0) break;
+        if(dir->direct_ptr[k] < MAX_DNUM) walk_dir_blk(ino, dir->direct_ptr[k]);
+    }
+    for(int i = 0; i < 8; ++i) {
+        if(dir->indirect_ptr[i] < 0) break;
+        if(dir->indirect_ptr[i] >= MAX_DNUM) continue;
+
+        int *ptr_blk = blk(sb->d_start_blk + dir->indirect_ptr[i]);
+        for(int j = 0; j < PTRS_PER_BLK; ++j) {
+            if(ptr_blk[j] < 0) break;
+            if(ptr_blk[j] < MAX_DNUM) walk_dir_blk(ino, ptr_blk[j]);
+        }
+    }
+}
+
+static void *walk_worker(void *arg) {
+
+    pthread_mutex_lock(&dir_lock);
+    for(;;) {
+        while(dir_head == dir_tail && dir_busy) pthread_cond_wait(&dir_cond, &dir_lock);
+        if(dir_head == dir_tail) break;
+
+        int ino = dir_queue[dir_head++];
+        ++dir_busy;
+        pthread_mutex_unlock(&dir_lock);
+
+        walk_dir(ino);
+
+        pthread_mutex_lock(&dir_lock);
+        // the last busy worker finding the queue empty ends the walk
+        if(--dir_busy == 0 && dir_head == dir_tail) pthread_cond_broadcast(&dir_cond);
+    }
+    pthread_mutex_unlock(&dir_lock);
+    return NULL;
+}
+
+
+/*
+ * block group checks
+ */
+
+static void check_group_inodes(struct group_desc *gd, const unsigned char *orphaned) {
+
+    for(uint32_t ino = gd->first_ino; ino < gd->first_ino + gd->inodes; ++ino) {
+        struct inode *inode = inode_at(ino);
+        int valid = inode->valid && !bad[ino];
+        int used = get_bitmap(i_bitmap, ino);
+
+        if(valid && !used) {
+            problem(1, "inode %u: in use but free in the inode bitmap", ino);
+            if(fsck_config.repair) bitmap_set(i_bitmap, ino);
+        }
+        if(!valid && used) {
+            problem(1, "inode %u: free but marked in the inode bitmap", ino);
+            if(fsck_config.repair) bitmap_unset(i_bitmap, ino);
+        }
+
+        // an inode no directory names that isn't waiting to be reclaimed goes on the orphan list
+        if(valid && ino != 0 && !names[ino] && !orphaned[ino]) {
+            problem(1, "inode %u: %s of %u bytes in no directory, queueing for reclaim",
+                    ino, inode->type == directory ? "directory" : "file", inode->size);
+            pthread_mutex_lock(&report_lock);
+            lost[lost_cnt++] = ino;
+            pthread_mutex_unlock(&report_lock);
+        }
+    }
+}
+
+static void check_group_blocks(struct group_desc *gd) {
+
+    for(uint32_t b = gd->first_blk; b < gd->first_blk + gd->blks; ++b) {
+        uint32_t own = owners[b];
+        int used = get_bitmap(d_bitmap, b);
+
+        if(!own) {
+            if(used) {
+                problem(1, "block %u: leaked, marked in the data bitmap but in no block map", b);
+                if(fsck_config.repair) {
+                    bitmap_unset(d_bitmap, b);
+                    // it may come back as file data, which isn't checked
+                    csums[sb->d_start_blk + b] = 0;
+                }
+            }
+            if(d_refs[b]) {
+                problem(1, "block %u: free with reference count %u", b, d_refs[b]);
+                if(fsck_config.repair) d_refs[b] = 0;
+            }
+            continue;
+        }
+
+        if(!used) {
+            problem(1, "block %u: in use but free in the data bitmap", b);
+            if(fsck_config.repair) bitmap_set(d_bitmap, b);
+        }
+
+        // pointer arrays and directory blocks are written in place, so no reference count makes sharing them safe
+        if(meta[b] && own > 1) {
+            problem(0, "block %u: pointer array or directory block with %u owners", b, own);
+            continue;
+        }
+
+        // file data may be shared by snapshots and clones, one reference count beyond the first owner each;
+        // a double allocation left by a crash becomes a copy-on-write share once the count covers it
+        if(own - 1 != d_refs[b]) {
+            if(own - 1 > UINT16_MAX) {
+                problem(0, "block %u: %u owners, more than a reference count holds", b, own);
+                continue;
+            }
+            problem(1, "block %u: %u owners but reference count %u%s", b, own, d_refs[b],
+                    own - 1 > d_refs[b] ? " (doubly allocated)" : "");
+            if(fsck_config.repair) d_refs[b] = own - 1;
+        }
+    }
+}
+
+static unsigned char orphaned[MAX_INUM];
+
+static void *group_worker(void *arg) {
+
+    for(;;) {
+        int g = __atomic_fetch_add(&next_task, 1, __ATOMIC_RELAXED);
+        if(g >= (int)sb->groups) break;
+
+        check_group_inodes(&sb->group[g], orphaned);
+        check_group_blocks(&sb->group[g]);
+    }
+    return NULL;
+}
+
+// Check the orphan list against the walk, then add the inodes the walk didn't reach
+static void check_orphans() {
+
+    uint32_t cnt = sb->orphan_cnt;
+    uint32_t kept = 0;
+
+    if(cnt > MAX_INUM) {
+        problem(1, "orphan list: count %u out of range", cnt);
+        cnt = MAX_INUM;
+    }
+    for(uint32_t i = 0; i < cnt; ++i) {
+        uint16_t ino = sb->orphans[i];
+        if(!entry_ok(ino) || ino == 0 || orphaned[ino] == 2 || names[ino]) {
+            problem(1, "orphan list: inode %u is free, linked or listed twice", ino);
+            continue;
+        }
+        orphaned[ino] = 2;
+        sb->orphans[kept++] = ino;
+    }
+    if(!fsck_config.repair) return;
+
+    for(int i = 0; i < lost_cnt; ++i) sb->orphans[kept++] = lost[i];
+    sb->orphan_cnt = kept;
+}
+
+// The free counters and hints are only trusted after a clean unmount; a repair leaves them exact
+static void check_counters() {
+
+    uint32_t free_inodes = 0;
+    uint32_t free_blks = 0;
+    int clean = sb->state == SB_CLEAN;
+
+    for(int ino = 0; ino < MAX_INUM; ++ino) free_inodes += !get_bitmap(i_bitmap, ino);
+    for(int b = 0; b < MAX_DNUM; ++b) free_blks += !get_bitmap(d_bitmap, b);
+
+    if(clean && (sb->free_inodes != free_inodes || sb->free_blks != free_blks)) {
+        problem(1, "superblock: free counters %u inodes, %u blocks, bitmaps say %u, %u",
+                sb->free_inodes, sb->free_blks, free_inodes, free_blks);
+    }
+
+    for(uint32_t g = 0; g < sb->groups; ++g) {
+        struct group_desc *gd = &sb->group[g];
+        uint32_t ino_hint = gd->first_ino;
+        uint32_t blk_hint = gd->first_blk;
+        while(ino_hint < gd->first_ino + gd->inodes && get_bitmap(i_bitmap, ino_hint)) ++ino_hint;
+        while(blk_hint < gd->first_blk + gd->blks && get_bitmap(d_bitmap, blk_hint)) ++blk_hint;
+
+        // a hint may trail the first free inode or block, but never pass it
+        if(clean && (gd->ino_hint < gd->first_ino || gd->ino_hint > ino_hint
+                || gd->blk_hint < gd->first_blk || gd->blk_hint > blk_hint)) {
+            problem(1, "group %u: allocation hints %u, %u past free inode %u, block %u",
+                    g, gd->ino_hint, gd->blk_hint, ino_hint, blk_hint);
+        }
+        if(fsck_config.repair) {
+            gd->ino_hint = ino_hint;
+            gd->blk_hint = blk_hint;
+        }
+    }
+
+    if(fsck_config.repair) {
+        sb->free_inodes = free_inodes;
+        sb->free_blks = free_blks;
+        if(!unfixed) sb->state = SB_CLEAN;
+    } else if(!clean) {
+        printf("superblock: not cleanly unmounted; mounting recounts free space\n");
+    }
+}
+
+
+/*
+ * main
+ */
+
+static void usage() {
+    fprintf(stderr, "usage: fsck.tfs [-n | -y] [-j threads] DISKFILE\n");
+    exit(FSCK_FAILED);
+}
+
+int main(int argc, char **argv) {
+
+    int opt;
+    while((opt = getopt(argc, argv, "nyj:")) != -1) {
+        switch(opt) {
+        case 'n': fsck_config.repair = 0; break;
+        case 'y': fsck_config.repair = 1; break;
+        case 'j': fsck_config.threads = atoi(optarg); break;
+        default: usage();
+        }
+    }
+    if(optind != argc - 1) usage();
+    if(fsck_config.threads <= 0) fsck_config.threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if(fsck_config.threads <= 0) fsck_config.threads = 1;
+    if(fsck_config.threads > MAX_THREADS) fsck_config.threads = MAX_THREADS;
+    const char *path = argv[optind];
+    double start = now();
+
+
+    // Step 1: Map the image; without -y the mapping is private, so replay and checks never reach the file
+    int fd = open(path, fsck_config.repair ? O_RDWR : O_RDONLY);
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "fsck.tfs: %s: %s\n", path, strerror(errno));
+        return FSCK_FAILED;
+    }
+    if(st.st_size < DISK_SIZE) {
+        fprintf(stderr, "fsck.tfs: %s: %lld bytes, smaller than a TFS image\n", path, (long long)st.st_size);
+        close(fd);
+        return FSCK_FAILED;
+    }
+    image_size = DISK_SIZE;
+    image = mmap(NULL, image_size, PROT_READ | PROT_WRITE, fsck_config.repair ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(image == MAP_FAILED) {
+        fprintf(stderr, "fsck.tfs: %s: %s\n", path, strerror(errno));
+        return FSCK_FAILED;
+    }
+    sb = blk(0);
+
+
+    // Step 2: Check the layout and bring the metadata up to date with the journal, which may have rewritten the superblock
+    if(check_superblock() < 0) {
+        munmap(image, image_size);
+        return FSCK_FAILED;
+    }
+    if(replay_journal() < 0) {
+        munmap(image, image_size);
+        return FSCK_UNFIXED;
+    }
+    if(check_superblock() < 0) {
+        munmap(image, image_size);
+        return FSCK_FAILED;
+    }
+    i_bitmap = blk(sb->i_bitmap_blk);
+    d_bitmap = blk(sb->d_bitmap_blk);
+    d_refs = blk(sb->ref_start_blk);
+    csums = blk(sb->csum_start_blk);
+    check_metadata();
+    madvise(image, (size_t)sb->d_start_blk*BLOCK_SIZE, MADV_WILLNEED);
+
+
+    // Step 3: Scan the inode table, counting the owners of every data block
+    run_pool(scan_worker);
+    if(!entry_ok(0) || inode_at(0)->type != directory) {
+        fprintf(stderr, "fsck.tfs: root directory is missing\n");
+        munmap(image, image_size);
+        return FSCK_UNFIXED;
+    }
+
+
+    // Step 4: Walk the directory tree from the root, which is its own parent
+    parent[0] = 0;
+    names[0] = 1;
+    dir_queue[dir_tail++] = 0;
+
+    // a snapshot a crash left part way hangs off the superblock until the next mount drops it
+    uint32_t pending = sb->snap_pending;
+    if(pending && (pending >= MAX_INUM || !entry_ok(pending) || inode_at(pending)->type != directory)) {
+        problem(1, "superblock: unfinished snapshot %u is not a directory, forgetting it", pending);
+        if(fsck_config.repair) sb->snap_pending = 0;
+    }
+    else if(pending) {
+        parent[pending] = sb->snap_ino;
+        names[pending] = 1;
+        dir_queue[dir_tail++] = pending;
+    }
+    run_pool(walk_worker);
+
+
+    // Step 5: Compare the counts with the bitmaps and reference counts, one block group per task
+    uint32_t cnt = sb->orphan_cnt < MAX_INUM ? sb->orphan_cnt : MAX_INUM;
+    for(uint32_t i = 0; i < cnt; ++i) {
+        if(sb->orphans[i] < MAX_INUM) orphaned[sb->orphans[i]] = 1;
+    }
+    run_pool(group_worker);
+    check_orphans();
+    check_counters();
+
+
+    // Step 6: Recompute the checksums of the blocks the repairs changed, including the superblock, bitmaps
+    // and reference counts, which they update wholesale; a block without one stays unchecked. Then write them out
+    if(fsck_config.repair) {
+        dirty[0] = dirty[sb->i_bitmap_blk] = dirty[sb->d_bitmap_blk] = 1;
+        for(uint32_t i = 0; i < sb->ref_blks; ++i) dirty[sb->ref_start_blk + i] = 1;
+        for(int b = 0; b < DISK_BLKS; ++b) {
+            if(!dirty[b] || (b >= (int)sb->csum_start_blk && b < (int)(sb->csum_start_blk + sb->csum_blks))) continue;
+            if(csums[b]) csums[b] = crc32c(0, blk(b), BLOCK_SIZE);
+        }
+        if(msync(image, image_size, MS_SYNC) < 0) {
+            fprintf(stderr, "fsck.tfs: %s: %s\n", path, strerror(errno));
+            munmap(image, image_size);
+            return FSCK_FAILED;
+        }
+    }
+
+
+    int dirs = 0, files = 0, used_blks = 0;
+    for(int ino = 0; ino < MAX_INUM; ++ino) {
+        if(!entry_ok(ino)) continue;
+        if(inode_at(ino)->type == directory) ++dirs;
+        else ++files;
+    }
+    for(int b = 0; b < MAX_DNUM; ++b) used_blks += owners[b] > 0;
+
+    printf("%s: %d files, %d directories, %d/%d blocks; %d problem(s) fixed, %d left (%.3f s, %d threads)\n",
+           path, files, dirs, used_blks, (int)MAX_DNUM, fixed, unfixed, now() - start, fsck_config.threads);
+
+    munmap(image, image_size);
+    if(unfixed) return FSCK_UNFIXED;
+    if(fixed) return FSCK_FIXED;
+    return FSCK_OK;
+}
@@ -0,0 +1,635 @@
+/*
+ *  Copyright (C) 2019 CS416 Spring 2019
+ *
+ *	Tiny File System
+ *
+ *	File:	journal.c
+ *
+ *	Write-ahead journal for metadata blocks. Metadata writes are staged in a
+ *	running transaction shared by all operations; a group commit appends the
+ *	transaction to the journal region in one sequential write, then writes
+ *	each block to its home location once. Each metadata block's CRC32C is
+ *	staged alongside it in its checksum region block, so the two reach disk,
+ *	and replay, together.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/uio.h>
+
+#include "block.h"
+#include "crc32c.h"
+#include "journal.h"
+
+struct jblock {
+	int		block_num;
+	char	data[BLOCK_SIZE];
+};
+
+int j_start_blk = -1;
+int j_nblks = 0;
+struct journal_header j_header;
+
+// running transaction
+struct jblock *j_tx = NULL;
+int j_tx_cnt = 0;
+// handles open on the running transaction, each holding JOURNAL_HANDLE_BLKS blocks of room in it
+int j_handles = 0;
+
+// operations hold the barrier shared, a commit holds it exclusive so it never splits an operation
+pthread_rwlock_t j_barrier;
+// guards the running transaction
+pthread_mutex_t j_lock = PTHREAD_MUTEX_INITIALIZER;
+// held exclusive while a commit writes home blocks, so a read never sees a block and its checksum from different commits
+pthread_rwlock_t j_ckpt = PTHREAD_RWLOCK_INITIALIZER;
+pthread_cond_t j_cond = PTHREAD_COND_INITIALIZER;
+pthread_t j_thread;
+int j_running = 0;
+int j_stop = 0;
+// called before each commit, with no operation in progress, to write out data the transaction points at
+void (*j_precommit)() = NULL;
+void (*j_postcommit)() = NULL;
+
+//CRC32C over the logged blocks, stored in the commit block to detect a torn transaction
+static uint32_t journal_checksum(const struct iovec *iov, int iovcnt) {
+    uint32_t crc = 0;
+    for (int i = 0; i < iovcnt; ++i) {
+		crc = crc32c(crc, iov[i].iov_base, iov[i].iov_len);
+    }
+    return crc;
+}
+
+static int journal_write_header() {
+    char *blk = calloc(1, BLOCK_SIZE);
+    if (!blk) {
+		return -1;
+    }
+    memcpy(blk, &j_header, sizeof(j_header));
+    int retstat = bio_write(j_start_blk, blk);
+    free(blk);
+    return retstat < 0 ? -1 : 0;
+}
+
+//Find a block in the running transaction, caller holds j_lock
+static struct jblock *journal_find(const int block_num) {
+    for (int i = 0; i < j_tx_cnt; ++i) {
+		if (j_tx[i].block_num == block_num) {
+			return &j_tx[i];
+		}
+    }
+    return NULL;
+}
+
+static int jblock_cmp(const void *a, const void *b) {
+    return ((const struct jblock *)a)->block_num - ((const struct jblock *)b)->block_num;
+}
+
+//Write the running transaction to the journal, then checkpoint it to its home blocks.
+//Caller holds the barrier exclusively.
+static int journal_flush() {
+    int n = j_tx_cnt;
+    if (n == 0) {
+		return 0;
+    }
+
+    struct journal_desc *desc = calloc(1, BLOCK_SIZE);
+    struct journal_commit *commit = calloc(1, BLOCK_SIZE);
+    struct iovec *iov = malloc((n + 2)*sizeof(struct iovec));
+    if (!desc || !commit || !iov) {
+		free(desc);
+		free(commit);
+		free(iov);
+		return -1;
+    }
+
+    // checkpoint writes go out in block order, so sort the transaction up front
+    qsort(j_tx, n, sizeof(struct jblock), jblock_cmp);
+
+    desc->magic = JOURNAL_DESC_MAGIC;
+    desc->seq = j_header.seq;
+    desc->count = n;
+    iov[0].iov_base = desc;
+    iov[0].iov_len = BLOCK_SIZE;
+    for (int i = 0; i < n; ++i) {
+		desc->blocks[i] = j_tx[i].block_num;
+		iov[i+1].iov_base = j_tx[i].data;
+		iov[i+1].iov_len = BLOCK_SIZE;
+    }
+    commit->magic = JOURNAL_COMMIT_MAGIC;
+    commit->seq = j_header.seq;
+    commit->count = n;
+    commit->checksum = journal_checksum(&iov[1], n);
+    iov[n+1].iov_base = commit;
+    iov[n+1].iov_len = BLOCK_SIZE;
+
+    // wrap to the start of the region when the transaction doesn't fit before its end
+    if (j_header.head + n + 2 > j_nblks) {
+		j_header.head = 1;
+    }
+
+    // Step 1: Append descriptor, blocks and commit record in one sequential write
+    int retstat = bio_writev(j_start_blk + j_header.head, iov, n + 2);
+    if (retstat < 0 || dev_sync() < 0) {
+		free(desc);
+		free(commit);
+		free(iov);
+		return -1;
+    }
+
+    // Step 2: Checkpoint each block to its home location, one write per run of adjacent blocks
+    pthread_rwlock_wrlock(&j_ckpt);
+    for (int i = 0; i < n; ) {
+		int run = 1;
+		while (i + run < n
+		&& run < IOV_MAX
+		&& j_tx[i + run].block_num == j_tx[i].block_num + run) {
+			++run;
+		}
+		for (int j = 0; j < run; ++j) {
+			iov[j].iov_base = j_tx[i + j].data;
+			iov[j].iov_len = BLOCK_SIZE;
+		}
+		if (bio_writev(j_tx[i].block_num, iov, run) < 0) {
+			retstat = -1;
+		}
+		i += run;
+    }
+    pthread_rwlock_unlock(&j_ckpt);
+    if (retstat < 0 || dev_sync() < 0) {
+		free(desc);
+		free(commit);
+		free(iov);
+		return -1;
+    }
+
+    // Step 3: Mark the transaction checkpointed so replay skips it
+    j_header.head += n + 2;
+    j_header.seq++;
+    j_tx_cnt = 0;
+    if (journal_write_header() < 0 || dev_sync() < 0) {
+		retstat = -1;
+    }
+
+    free(desc);
+    free(commit);
+    free(iov);
+    return retstat < 0 ? -1 : 0;
+}
+
+//Replay committed transactions that weren't checkpointed before a crash
+static int journal_replay() {
+    struct journal_desc *desc = malloc(BLOCK_SIZE);
+    struct journal_commit *commit = malloc(BLOCK_SIZE);
+    char *data = malloc(JOURNAL_TX_BLKS*BLOCK_SIZE);
+    struct iovec *iov = malloc(JOURNAL_TX_BLKS*sizeof(struct iovec));
+    int replayed = 0;
+    if (!desc || !commit || !data || !iov) {
+		free(desc);
+		free(commit);
+		free(data);
+		free(iov);
+		return -1;
+    }
+
+    for (;;) {
+		uint32_t head = j_header.head;
+
+		// a transaction never straddles the end of the region, so look for it at the start
+		if (head + 2 > (uint32_t)j_nblks || bio_read(j_start_blk + head, desc) <= 0
+			|| desc->magic != JOURNAL_DESC_MAGIC || desc->seq != j_header.seq) {
+			head = 1;
+			if (bio_read(j_start_blk + head, desc) <= 0 || desc->magic != JOURNAL_DESC_MAGIC || desc->seq != j_header.seq) {
+				break;
+			}
+		}
+		if (desc->count == 0 || desc->count > JOURNAL_TX_BLKS || head + desc->count + 2 > j_nblks) {
+			break;
+		}
+
+		for (uint32_t i = 0; i < desc->count; ++i) {
+			bio_read(j_start_blk + head + 1 + i, data + i*BLOCK_SIZE);
+			iov[i].iov_base = data + i*BLOCK_SIZE;
+			iov[i].iov_len = BLOCK_SIZE;
+		}
+		bio_read(j_start_blk + head + 1 + desc->count, commit);
+
+		// a missing or mismatched commit record means the transaction was torn; discard it
+		if (commit->magic != JOURNAL_COMMIT_MAGIC
+		|| commit->seq != desc->seq
+		|| commit->count != desc->count
+		|| commit->checksum != journal_checksum(iov, desc->count)) {
+			break;
+		}
+
+		for (uint32_t i = 0; i < desc->count; ++i) {
+			bio_write(desc->blocks[i], data + i*BLOCK_SIZE);
+		}
+
+		j_header.head = head + desc->count + 2;
+		j_header.seq++;
+		++replayed;
+    }
+
+    free(desc);
+    free(commit);
+    free(data);
+    free(iov);
+
+    if (replayed) {
+		fprintf(stderr, "journal: replayed %d transaction(s)\n", replayed);
+		if (dev_sync() < 0 || journal_write_header() < 0 || dev_sync() < 0) {
+			return -1;
+		}
+    }
+    return 0;
+}
+
+static void *journal_worker(void *arg) {
+    struct timespec deadline;
+
+    pthread_mutex_lock(&j_lock);
+    while (!j_stop) {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += JOURNAL_COMMIT_INTERVAL;
+		pthread_cond_timedwait(&j_cond, &j_lock, &deadline);
+		if (j_stop || j_tx_cnt == 0) {
+			continue;
+		}
+		pthread_mutex_unlock(&j_lock);
+		journal_commit();
+		pthread_mutex_lock(&j_lock);
+    }
+    pthread_mutex_unlock(&j_lock);
+    return NULL;
+}
+
+//Initialize an empty journal region, used by mkfs
+int journal_format(int start_blk, int nblks) {
+    j_start_blk = start_blk;
+    j_nblks = nblks;
+    j_header = (struct journal_header) {
+		.magic = JOURNAL_MAGIC,
+		.seq = 1,
+		.head = 1,
+    };
+    return journal_write_header();
+}
+
+//Replay the journal and start group commits, used by mount
+int journal_load(int start_blk, int nblks) {
+    char *blk = malloc(BLOCK_SIZE);
+    if (!blk) {
+		return -1;
+    }
+    j_start_blk = start_blk;
+    j_nblks = nblks;
+    if (bio_read(j_start_blk, blk) <= 0) {
+		free(blk);
+		return -1;
+    }
+    memcpy(&j_header, blk, sizeof(j_header));
+    free(blk);
+    //A transaction ending at the end of the region leaves the head there; the next one starts at 1
+    if (j_header.magic != JOURNAL_MAGIC || j_header.head == 0 || j_header.head > (uint32_t)j_nblks) {
+		fprintf(stderr, "journal: bad journal header\n");
+		return -1;
+    }
+
+    if (journal_replay() < 0) {
+		return -1;
+    }
+
+    j_tx = malloc(JOURNAL_TX_BLKS*sizeof(struct jblock));
+    if (!j_tx) {
+		return -1;
+    }
+    j_tx_cnt = 0;
+
+    // prefer the committer so a steady stream of operations can't starve it
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&j_barrier, &attr);
+    pthread_rwlockattr_destroy(&attr);
+
+    j_stop = 0;
+    if (pthread_create(&j_thread, NULL, journal_worker, NULL)) {
+		free(j_tx);
+		j_tx = NULL;
+		return -1;
+    }
+    j_running = 1;
+    return 0;
+}
+
+//Commit whatever is still running and stop the commit thread, used by unmount
+void journal_shutdown() {
+    if (!j_running) {
+		return;
+    }
+    pthread_mutex_lock(&j_lock);
+    j_stop = 1;
+    pthread_cond_signal(&j_cond);
+    pthread_mutex_unlock(&j_lock);
+    pthread_join(j_thread, NULL);
+
+    journal_commit();
+
+    j_running = 0;
+    pthread_rwlock_destroy(&j_barrier);
+    free(j_tx);
+    j_tx = NULL;
+}
+
+//Register a function that writes out file data before metadata pointing at it commits
+void journal_set_precommit(void (*fn)()) {
+    j_precommit = fn;
+}
+
+//Register a function run once a commit is durable, before any new operation starts
+void journal_set_postcommit(void (*fn)()) {
+    j_postcommit = fn;
+}
+
+//Open a handle: every metadata write until journal_end() lands in the same transaction.
+//A handle is only let in while the transaction has room for a worst-case operation from it and from every
+//handle already open; otherwise the transaction is committed first, once the open handles end.
+void journal_begin() {
+    if (!j_running) {
+		return;
+    }
+    for (;;) {
+		pthread_rwlock_rdlock(&j_barrier);
+		pthread_mutex_lock(&j_lock);
+		if (j_tx_cnt + (j_handles + 1)*JOURNAL_HANDLE_BLKS <= JOURNAL_TX_BLKS) {
+			++j_handles;
+			pthread_mutex_unlock(&j_lock);
+			return;
+		}
+		pthread_mutex_unlock(&j_lock);
+		pthread_rwlock_unlock(&j_barrier);
+
+		// with the disk failing, let the handle in; its writes fail once the transaction is full
+		if (journal_commit() < 0) {
+			pthread_rwlock_rdlock(&j_barrier);
+			pthread_mutex_lock(&j_lock);
+			++j_handles;
+			pthread_mutex_unlock(&j_lock);
+			return;
+		}
+    }
+}
+
+void journal_end() {
+    if (!j_running) {
+		return;
+    }
+    pthread_mutex_lock(&j_lock);
+    --j_handles;
+    pthread_mutex_unlock(&j_lock);
+    pthread_rwlock_unlock(&j_barrier);
+
+    // hand a large transaction to the commit thread instead of waiting for the timer
+    pthread_mutex_lock(&j_lock);
+    if (j_tx_cnt >= JOURNAL_TX_THRESHOLD) {
+		pthread_cond_signal(&j_cond);
+    }
+    pthread_mutex_unlock(&j_lock);
+}
+
+//Commit the running transaction, caller holds the barrier exclusive
+static int journal_commit_locked() {
+    if (j_precommit) {
+		j_precommit();
+    }
+    pthread_mutex_lock(&j_lock);
+    int retstat = journal_flush();
+    pthread_mutex_unlock(&j_lock);
+    if (retstat == 0 && j_postcommit) {
+		j_postcommit();
+    }
+    return retstat;
+}
+
+//Commit the running transaction now, must not be called with a handle open
+int journal_commit() {
+    if (!j_running) {
+		return dev_sync();
+    }
+    pthread_rwlock_wrlock(&j_barrier);
+    int retstat = journal_commit_locked();
+    pthread_rwlock_unlock(&j_barrier);
+    return retstat;
+}
+
+//Run an operation alone: wait for open handles to end and keep new ones out until journal_unlock().
+//Its changes may span several transactions, see journal_reserve().
+void journal_lock() {
+    if (j_running) {
+		pthread_rwlock_wrlock(&j_barrier);
+    }
+}
+
+void journal_unlock() {
+    if (j_running) {
+		pthread_rwlock_unlock(&j_barrier);
+    }
+}
+
+//Make room for nblks more blocks in the running transaction, committing it first if they don't fit.
+//Only for an operation holding journal_lock(), which must be consistent at each call.
+int journal_reserve(int nblks) {
+    if (!j_running) {
+		return 0;
+    }
+    pthread_mutex_lock(&j_lock);
+    int room = j_tx_cnt + nblks <= JOURNAL_TX_BLKS;
+    pthread_mutex_unlock(&j_lock);
+    if (room) {
+		return 0;
+    }
+    return journal_commit_locked();
+}
+
+//Sequence number of the running transaction, for callers that later need it committed
+uint32_t journal_tid() {
+    if (!j_running) {
+		return 0;
+    }
+    pthread_mutex_lock(&j_lock);
+    uint32_t tid = j_header.seq;
+    pthread_mutex_unlock(&j_lock);
+    return tid;
+}
+
+//Commit transaction tid unless it has already committed; used by fsync.
+//Returns 1 if a commit was done, 0 if tid was already durable, -1 on failure.
+int journal_commit_tid(uint32_t tid) {
+    if (j_running) {
+		pthread_mutex_lock(&j_lock);
+		int committed = tid < j_header.seq;
+		pthread_mutex_unlock(&j_lock);
+		if (committed) {
+			return 0;
+		}
+    }
+    return journal_commit() < 0 ? -1 : 1;
+}
+
+//Read a metadata block, preferring its copy in the running transaction
+int journal_read(const int block_num, void *buf) {
+    if (j_running) {
+		pthread_mutex_lock(&j_lock);
+		struct jblock *jb = journal_find(block_num);
+		if (jb) {
+			memcpy(buf, jb->data, BLOCK_SIZE);
+			pthread_mutex_unlock(&j_lock);
+			return BLOCK_SIZE;
+		}
+		pthread_mutex_unlock(&j_lock);
+    }
+    pthread_rwlock_rdlock(&j_ckpt);
+    int retstat = bio_read(block_num, buf);
+    pthread_rwlock_unlock(&j_ckpt);
+    return retstat;
+}
+
+//Set a block's checksum in the running transaction's copy of its checksum region block,
+//adding that block to the transaction. Caller holds j_lock and has made room for it.
+static void journal_stage_csum(const int block_num, uint32_t crc) {
+    int csum_blk = bio_csum_blk(block_num);
+    if (csum_blk < 0) {
+		return;
+    }
+    struct jblock *jb = journal_find(csum_blk);
+    if (!jb) {
+		jb = &j_tx[j_tx_cnt++];
+		jb->block_num = csum_blk;
+		bio_csum_read(csum_blk, jb->data);
+    }
+    ((uint32_t *)jb->data)[block_num % CSUM_PER_BLK] = crc;
+}
+
+//Set a block's checksum in its checksum region block at home, and in the running transaction's copy
+//if it has one so the commit doesn't undo it. Only this entry changes at home: the others in a staged
+//copy belong to blocks that haven't been written home yet. Caller holds j_lock.
+static int journal_csum_through(const int block_num, uint32_t crc) {
+    int csum_blk = bio_csum_blk(block_num);
+    if (csum_blk < 0) {
+		return 0;
+    }
+    struct jblock *jb = journal_find(csum_blk);
+    if (jb) {
+		((uint32_t *)jb->data)[block_num % CSUM_PER_BLK] = crc;
+    }
+
+    uint32_t *csums = malloc(BLOCK_SIZE);
+    if (!csums) {
+		return -1;
+    }
+    bio_csum_read(csum_blk, csums);
+    csums[block_num % CSUM_PER_BLK] = crc;
+    int retstat = bio_write(csum_blk, csums);
+    free(csums);
+    return retstat < 0 ? -1 : 0;
+}
+
+//Stage a metadata block, and its checksum, in the running transaction
+int journal_write(const int block_num, const void *buf) {
+    if (!j_running) {
+		return bio_write(block_num, buf);
+    }
+
+    uint32_t crc = crc32c(0, buf, BLOCK_SIZE);
+
+    pthread_mutex_lock(&j_lock);
+    struct jblock *jb = journal_find(block_num);
+    if (!jb) {
+		// a new block needs a slot for its checksum region block too, unless that is already staged
+		int csum_blk = bio_csum_blk(block_num);
+		int need = csum_blk >= 0 && !journal_find(csum_blk) ? 2 : 1;
+
+		// journal_begin() and journal_reserve() keep room for what an operation stages, so this is a bug;
+		// fail the write rather than let part of the operation reach disk outside the transaction
+		if (j_tx_cnt + need > JOURNAL_TX_BLKS) {
+			pthread_mutex_unlock(&j_lock);
+			return -1;
+		}
+		jb = &j_tx[j_tx_cnt++];
+		jb->block_num = block_num;
+    }
+    memcpy(jb->data, buf, BLOCK_SIZE);
+    journal_stage_csum(block_num, crc);
+    pthread_mutex_unlock(&j_lock);
+    return BLOCK_SIZE;
+}
+
+//Stage len bytes at offset into a metadata block, reading the rest of it and writing it back as one step,
+//so two threads changing different parts of a block, such as two inodes in one inode table block, don't
+//undo each other's change
+int journal_patch(const int block_num, int offset, const void *buf, int len) {
+    char *blk = malloc(BLOCK_SIZE);
+    if (!blk) {
+		return -1;
+    }
+    if (!j_running) {
+		int retstat = bio_read(block_num, blk);
+		if (retstat >= 0) {
+			memcpy(blk + offset, buf, len);
+			retstat = bio_write(block_num, blk);
+		}
+		free(blk);
+		return retstat;
+    }
+
+    pthread_mutex_lock(&j_lock);
+    struct jblock *jb = journal_find(block_num);
+    if (jb) {
+		memcpy(blk, jb->data, BLOCK_SIZE);
+    } else {
+		pthread_rwlock_rdlock(&j_ckpt);
+		int retstat = bio_read(block_num, blk);
+		pthread_rwlock_unlock(&j_ckpt);
+		int csum_blk = bio_csum_blk(block_num);
+		int need = csum_blk >= 0 && !journal_find(csum_blk) ? 2 : 1;
+		if (retstat < 0 || j_tx_cnt + need > JOURNAL_TX_BLKS) {
+			pthread_mutex_unlock(&j_lock);
+			free(blk);
+			return -1;
+		}
+		jb = &j_tx[j_tx_cnt++];
+		jb->block_num = block_num;
+    }
+    memcpy(blk + offset, buf, len);
+    memcpy(jb->data, blk, BLOCK_SIZE);
+    journal_stage_csum(block_num, crc32c(0, blk, BLOCK_SIZE));
+    pthread_mutex_unlock(&j_lock);
+    free(blk);
+    return BLOCK_SIZE;
+}
+
+//A block no longer holds metadata: drop its checksum so it can be reused for unchecked file data.
+//Its old contents stay valid until then, so with no room in the transaction the change goes straight home.
+void journal_forget(const int block_num) {
+    int csum_blk = bio_csum_blk(block_num);
+    if (!j_running || csum_blk < 0) {
+		return;
+    }
+
+    pthread_mutex_lock(&j_lock);
+    // written in place before the commit, its new contents mustn't be checked against the old checksum
+    bio_csum_drop(block_num);
+    if (journal_find(csum_blk) || j_tx_cnt < JOURNAL_TX_BLKS) {
+		journal_stage_csum(block_num, 0);
+    } else if (journal_csum_through(block_num, 0) < 0) {
+		fprintf(stderr, "journal: failed to clear checksum of block %d\n", block_num);
+    }
+    pthread_mutex_unlock(&j_lock);
+}
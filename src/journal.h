@@ -0,0 +1,71 @@
+/*
+ *  Copyright (C) 2019 CS416 Spring 2019
+ *
+ *	Tiny File System
+ *
+ *	File:	journal.h
+ *
+ */
+
+#ifndef _JOURNAL_H_
+#define _JOURNAL_H_
+
+#include <stdint.h>
+
+#define JOURNAL_MAGIC 0x4A524E4C
+#define JOURNAL_DESC_MAGIC 0x4A445343
+#define JOURNAL_COMMIT_MAGIC 0x4A434D54
+
+//Journal region size in blocks, including the header block
+#define JOURNAL_BLKS 256
+//Maximum number of metadata blocks in one transaction
+#define JOURNAL_TX_BLKS 128
+//Most blocks one handle may stage: the superblock, both bitmaps, a file's 8 pointer arrays, 4 inode table
+//blocks, 4 directory blocks, the 4 reference count blocks and the 8 checksum region blocks covering them
+#define JOURNAL_HANDLE_BLKS 32
+//Running transaction size at which the commit thread is woken early
+#define JOURNAL_TX_THRESHOLD (JOURNAL_TX_BLKS*3/4)
+//Seconds between group commits
+#define JOURNAL_COMMIT_INTERVAL 5
+
+struct journal_header {
+	uint32_t	magic;				/* journal magic number */
+	uint32_t	seq;				/* sequence number of the next transaction */
+	uint32_t	head;				/* offset of the next transaction in the region */
+};
+
+struct journal_desc {
+	uint32_t	magic;				/* descriptor magic number */
+	uint32_t	seq;				/* transaction sequence number */
+	uint32_t	count;				/* number of logged blocks following the descriptor */
+	int			blocks[JOURNAL_TX_BLKS];	/* home block number of each logged block */
+};
+
+struct journal_commit {
+	uint32_t	magic;				/* commit magic number */
+	uint32_t	seq;				/* transaction sequence number */
+	uint32_t	count;				/* number of logged blocks */
+	uint32_t	checksum;			/* checksum of the descriptor's logged blocks */
+};
+
+int journal_format(int start_blk, int nblks);
+int journal_load(int start_blk, int nblks);
+void journal_shutdown();
+
+void journal_begin();
+void journal_end();
+int journal_commit();
+void journal_lock();
+void journal_unlock();
+int journal_reserve(int nblks);
+void journal_set_precommit(void (*fn)());
+void journal_set_postcommit(void (*fn)());
+uint32_t journal_tid();
+int journal_commit_tid(uint32_t tid);
+
+int journal_read(const int block_num, void *buf);
+int journal_write(const int block_num, const void *buf);
+int journal_patch(const int block_num, int offset, const void *buf, int len);
+void journal_forget(const int block_num);
+
+#endif
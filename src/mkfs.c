@@ -0,0 +1,202 @@
+/*
+ *  Copyright (C) 2019 CS416 Spring 2019
+ *
+ *	Tiny File System
+ *
+ *	File:	mkfs.c
+ *
+ *	Formats TFS disk files without mounting them. The file is truncated and
+ *	extended to the disk size, so every region that starts out zero is a
+ *	hole and is never written: only the superblock, both bitmaps, the first
+ *	inode table block, holding the root and the snapshot directory, and the
+ *	journal header are, in two vectored writes.
+ *
+ *	usage: mkfs.tfs [-f] [-q] [-g groups] DISKFILE...
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "block.h"
+#include "journal.h"
+#include "tfs.h"
+
+struct mkfs_config {
+    int force;						/* -f: overwrite a file that isn't empty */
+    int quiet;						/* -q: only report errors */
+    int groups;						/* -g: number of block groups */
+};
+
+struct mkfs_config mkfs_config = { .force = 0, .quiet = 0, .groups = BLOCK_GROUPS };
+
+// the blocks written: block 0 up to the first inode table block, which mkfs_layout() puts at 3, and the journal header
+char meta[4][BLOCK_SIZE];
+char j_blk[BLOCK_SIZE];
+
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// An empty inline directory, as node_create() makes one
+static void mkfs_dir(struct inode *inode, uint16_t ino, uint16_t parent_ino, uint32_t flags, const struct timespec *now) {
+
+    *inode = (struct inode) {
+        .ino = ino,
+        .valid = 1,
+        .size = INLINE_DIR_HDR,
+        .type = directory,
+        .link = 2,
+        .flags = INODE_INLINE | flags,
+        .vstat = {
+                .st_ino = ino,
+                .st_mode = S_IFDIR | 0755,
+                .st_nlink = 2,
+                .st_blksize = BLOCK_SIZE,
+                .st_blocks = 0,
+                .st_size = INLINE_DIR_HDR,
+        }
+    };
+    inode->vstat.st_atim = inode->vstat.st_mtim = inode->vstat.st_ctim = *now;
+    memcpy(inode->inline_data, &parent_ino, INLINE_DIR_HDR);
+}
+
+// Build the blocks of a new file system in meta and j_blk; they are the same for every image
+static void mkfs_build() {
+
+    struct superblock *sb = (struct superblock *)meta[0];
+    struct timespec now;
+
+    memset(meta, 0, sizeof(meta));
+    memset(j_blk, 0, sizeof(j_blk));
+    mkfs_layout(sb, mkfs_config.groups);
+    clock_gettime(CLOCK_REALTIME, &now);
+
+
+    // Step 1: The root, its own parent, and the snapshot directory in it, which inline_add() would append
+    struct inode *i_blk = (struct inode *)meta[sb->i_start_blk];
+    struct inode *root = &i_blk[0];
+    mkfs_dir(root, 0, 0, 0, &now);
+    mkfs_dir(&i_blk[sb->snap_ino], sb->snap_ino, 0, INODE_SNAPSHOT, &now);
+
+    struct inline_dirent *entry = (void *)(root->inline_data + root->size);
+    entry->ino = sb->snap_ino;
+    entry->name_len = strlen(SNAP_DIR_NAME);
+    memcpy(entry->name, SNAP_DIR_NAME, entry->name_len);
+    root->size += sizeof(struct inline_dirent) + entry->name_len;
+    root->vstat.st_size = root->size;
+
+    set_bitmap((bitmap_t)meta[sb->i_bitmap_blk], 0);
+    set_bitmap((bitmap_t)meta[sb->i_bitmap_blk], sb->snap_ino);
+
+
+    // Step 2: An empty journal, as journal_format() writes it
+    struct journal_header *header = (struct journal_header *)j_blk;
+    header->magic = JOURNAL_MAGIC;
+    header->seq = 1;
+    header->head = 1;
+}
+
+static int mkfs_image(const char *path) {
+
+    struct superblock *sb = (struct superblock *)meta[0];
+    struct stat st;
+
+
+    // Step 1: Refuse to overwrite anything but an empty file unless forced
+    if(!mkfs_config.force && stat(path, &st) == 0 && st.st_size > 0) {
+        fprintf(stderr, "mkfs.tfs: %s: not empty, use -f to overwrite it\n", path);
+        return -1;
+    }
+
+
+    // Step 2: Truncate the file to nothing, then extend it: the old contents, including any journal
+    // transactions mounting would replay, are gone, and the new ones are zero without being written
+    int fd = open(path, O_CREAT | O_RDWR | O_TRUNC, S_IRUSR | S_IWUSR);
+    if(fd < 0) {
+        fprintf(stderr, "mkfs.tfs: %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if(ftruncate(fd, DISK_SIZE) < 0) {
+        fprintf(stderr, "mkfs.tfs: %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+
+    // Step 3: Write the superblock, bitmaps and first inode table block in one vectored write, then the journal
+    // header. The checksum region stays zero: blocks mkfs writes are unchecked until their first journaled write
+    struct iovec iov[4];
+    int nblks = sb->i_start_blk + 1;
+    for(int i = 0; i < nblks; ++i) {
+        iov[i].iov_base = meta[i];
+        iov[i].iov_len = BLOCK_SIZE;
+    }
+    if(pwritev(fd, iov, nblks, 0) != (ssize_t)nblks*BLOCK_SIZE
+    || pwrite(fd, j_blk, BLOCK_SIZE, (off_t)sb->j_start_blk*BLOCK_SIZE) != BLOCK_SIZE
+    || fsync(fd) < 0
+    ) {
+        fprintf(stderr, "mkfs.tfs: %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+
+    close(fd);
+    return 0;
+}
+
+static void usage() {
+    fprintf(stderr, "usage: mkfs.tfs [-f] [-q] [-g groups] DISKFILE...\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+
+    int opt;
+    while((opt = getopt(argc, argv, "fqg:")) != -1) {
+        switch(opt) {
+        case 'f': mkfs_config.force = 1; break;
+        case 'q': mkfs_config.quiet = 1; break;
+        case 'g': mkfs_config.groups = atoi(optarg); break;
+        default: usage();
+        }
+    }
+    if(optind == argc) usage();
+    if(mkfs_config.groups < 1 || mkfs_config.groups > BLOCK_GROUPS) {
+        fprintf(stderr, "mkfs.tfs: block groups must be between 1 and %d\n", BLOCK_GROUPS);
+        return EXIT_FAILURE;
+    }
+
+    mkfs_build();
+
+    int failed = 0;
+    double start = now();
+    for(int i = optind; i < argc; ++i) {
+        double t = now();
+        if(mkfs_image(argv[i]) < 0) {
+            ++failed;
+            continue;
+        }
+        if(!mkfs_config.quiet) {
+            printf("%s: %d MB, %d inodes, %d data blocks of %d bytes in %d groups, formatted in %.2f ms\n",
+                   argv[i], (DISK_SIZE) >> 20, MAX_INUM, (int)MAX_DNUM, BLOCK_SIZE, mkfs_config.groups, (now() - t)*1000);
+        }
+    }
+    if(!mkfs_config.quiet && argc - optind > 1) {
+        printf("%d image(s) formatted in %.2f ms\n", argc - optind - failed, (now() - start)*1000);
+    }
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
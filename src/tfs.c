@@ -18,90 +18,302 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <errno.h>
 #include <sys/time.h>
 #include <libgen.h>
 #include <limits.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <linux/falloc.h>
 
 #include "block.h"
+#include "crc32c.h"
+#include "journal.h"
 #include "tfs.h"
 
 char diskfile_path[PATH_MAX];
 
 // Declare your in-memory data structures here
 struct superblock superblock;
-unsigned char i_bitmap[MAX_INUM/8] = {0};
-unsigned char d_bitmap[MAX_DNUM/8] = {0};
+unsigned char i_bitmap[BLOCK_SIZE] = {0};
+unsigned char d_bitmap[BLOCK_SIZE] = {0};
+// data blocks freed in the running journal transaction; they can't be reused for
+// unjournaled file data until that transaction commits
+unsigned char d_pending[BLOCK_SIZE] = {0};
+// references to each data block beyond its first, for blocks shared between files; only the last
+// reference frees the block, and a shared block is copied before it is written
+uint16_t d_refs[REF_BLKS*REF_PER_BLK] = {0};
+
+// with -o dedup, file data blocks written since mount chained by the CRC32C of their contents:
+// dd_head[] and dd_next[] hold block number + 1, 0 ending the chain
+int dd_head[DEDUP_BUCKETS] = {0};
+int dd_next[MAX_DNUM] = {0};
+uint32_t dd_hash[MAX_DNUM] = {0};
+unsigned char dd_indexed[BLOCK_SIZE] = {0};
+
+// guards both bitmaps, the reference counts, the dedup index and the superblock's orphan list, which the
+// reclaim thread shares with FUSE operations
+pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t reclaim_cond = PTHREAD_COND_INITIALIZER;
+pthread_t reclaim_thread;
+int reclaim_running = 0;
+int reclaim_stop = 0;
+
+// guards inode_states, which FUSE operations update and fsync drains
+struct inode_state inode_states[MAX_INUM];
+pthread_mutex_t state_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// set once the bitmaps, reference counts and free counters have been read from disk, see alloc_acquire()
+int alloc_loaded = 0;
+// set if the superblock said the last unmount was clean, so its free counters and group hints can be used as is
+int mounted_clean = 0;
+
+struct tfs_config tfs_config = {
+    .writeback_cache = 0,
+    .atime = ATIME_RELATIME,
+    .csum = 1,
+    .compress = 0,
+    .dedup = 0,
+};
 
-int i_per_blk = (double)BLOCK_SIZE/sizeof(struct dirent);
-int dirents_per_blk = (double)BLOCK_SIZE/sizeof(struct dirent);
+// kernel cache invalidation for changes the kernel doesn't see, see tfs_ll.c
+void (*notify_inval_inode)(uint16_t ino) = NULL;
 
-/* 
- * Get available inode number from bitmap
+// buffered blocks across all inodes and where the search for one to write back resumes, guarded by state_lock
+int wb_pages = 0;
+int wb_clock = 0;
+
+// decompressed clusters of compressed files, guarded by ccache_lock, which is taken last
+struct ccache_entry ccache[CCACHE_CLUSTERS];
+uint64_t ccache_tick = 0;
+pthread_mutex_t ccache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// serializes renames, so one moving a directory can't race another into making a loop; taken before a journal handle
+pthread_mutex_t rename_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * One per inode, held across an operation so FUSE can serve requests on several threads. Writes lock a file
+ * exclusively and reads shared; directories are locked exclusively to add or remove entries and shared to look
+ * one up or list them. Inode locks are taken before a journal handle and a directory before its entries;
+ * node_rename() locks the two parents ancestor first. Initialized in tfs_mount().
  */
-int get_avail_ino() {
+pthread_rwlock_t inode_locks[MAX_INUM];
 
-    int avail_ino = -1;
+void inode_lock(uint16_t ino, int exclusive) {
+    if(exclusive) pthread_rwlock_wrlock(&inode_locks[ino]);
+    else pthread_rwlock_rdlock(&inode_locks[ino]);
+}
+
+void inode_unlock(uint16_t ino) {
+    pthread_rwlock_unlock(&inode_locks[ino]);
+}
+
+int i_per_blk = (double)BLOCK_SIZE/sizeof(struct inode);
+int dirents_per_blk = (double)BLOCK_SIZE/sizeof(struct dirent);
 
+/*
+ * Read both bitmaps and the reference counts from disk. After an unclean unmount the free counters and group
+ * hints on disk may be behind the bitmaps, so the bitmaps are scanned to count them again. The caller holds
+ * alloc_lock.
+ */
+static int alloc_load() {
 
-	// Step 1: Read inode bitmap from disk
-    int *bitmap_blk = calloc(1, BLOCK_SIZE);
-    if(!bitmap_blk) {
+    unsigned char *blk = malloc(BLOCK_SIZE);
+    if(!blk) {
         ERROR("Failed to allocate memory");
         return -1;
     }
-    if(bio_read(superblock.i_bitmap_blk, bitmap_blk) < 0) {
-        free(bitmap_blk);
+
+
+    // Step 1: Read i_bitmap and d_bitmap
+    if(bio_read(superblock.i_bitmap_blk, blk) < 0) {
+        free(blk);
+        return -1;
+    }
+    memcpy(i_bitmap, blk, sizeof(i_bitmap));
+
+    if(bio_read(superblock.d_bitmap_blk, blk) < 0) {
+        free(blk);
         return -1;
     }
-    memcpy(i_bitmap, bitmap_blk, sizeof(i_bitmap));
-    free(bitmap_blk);
+    memcpy(d_bitmap, blk, sizeof(d_bitmap));
+
+
+    // Step 2: Count what is free and start each group's search at its first inode and block, unless the last
+    // unmount wrote them out correct
+    if(!mounted_clean) {
+        superblock.free_inodes = 0;
+        superblock.free_blks = 0;
+        for(int i = 0; i < MAX_INUM; ++i) superblock.free_inodes += !get_bitmap(i_bitmap, i);
+        for(int i = 0; i < MAX_DNUM; ++i) superblock.free_blks += !get_bitmap(d_bitmap, i);
+        for(uint32_t g = 0; g < superblock.groups; ++g) {
+            superblock.group[g].ino_hint = superblock.group[g].first_ino;
+            superblock.group[g].blk_hint = superblock.group[g].first_blk;
+        }
+    }
+
+
+    // Step 3: Read the reference counts of shared data blocks
+    for(uint32_t i = 0; i < superblock.ref_blks; ++i) {
+        if(bio_read(superblock.ref_start_blk + i, blk) < 0) {
+            free(blk);
+            return -1;
+        }
+        memcpy((char *)d_refs + i*BLOCK_SIZE, blk, BLOCK_SIZE);
+    }
+
+
+    free(blk);
+    return 0;
+}
+
+// Take alloc_lock, first reading the state it guards if this mount hasn't yet. Nothing can go on without
+// the bitmaps, so failing to read them ends the daemon, as it would have at mount.
+static void alloc_acquire() {
+
+    pthread_mutex_lock(&alloc_lock);
+    if(alloc_loaded) return;
+    if(alloc_load() < 0) {
+        ERROR("Failed to read bitmaps");
+        exit(EXIT_FAILURE);
+    }
+    alloc_loaded = 1;
+}
+
+// -o warmup: read the allocator state in the background instead of on the first operation that needs it
+static void *alloc_warmup(void *arg) {
+
+    alloc_acquire();
+    pthread_mutex_unlock(&alloc_lock);
+    return NULL;
+}
+
+/*
+ * Block groups: the inodes and data blocks are split evenly into superblock.groups groups, each owning a slice
+ * of both bitmaps. A new inode goes in its parent directory's group and a file's data near its inode.
+ */
+int ino_group(uint16_t ino) {
+    for(uint32_t g = 1; g < superblock.groups; ++g) {
+        if(ino < superblock.group[g].first_ino) return g - 1;
+    }
+    return superblock.groups - 1;
+}
+
+// Group for a new inode in parent_ino: its parent's, except that a directory made in the root goes in the group
+// with the most free inodes, so separate trees spread over the disk
+int new_ino_group(uint16_t parent_ino, enum type type) {
+
+    if(type != directory || parent_ino != 0) return ino_group(parent_ino);
+
+    int best = 0;
+    int best_free = -1;
+    alloc_acquire();
+    for(uint32_t g = 0; g < superblock.groups; ++g) {
+        int nfree = 0;
+        for(uint32_t i = 0; i < superblock.group[g].inodes; ++i) nfree += !get_bitmap(i_bitmap, superblock.group[g].first_ino + i);
+        if(nfree > best_free) {
+            best = g;
+            best_free = nfree;
+        }
+    }
+    pthread_mutex_unlock(&alloc_lock);
+    return best;
+}
+
+int blk_group(int blkno) {
+    for(uint32_t g = 1; g < superblock.groups; ++g) {
+        if((uint32_t)blkno < superblock.group[g].first_blk) return g - 1;
+    }
+    return superblock.groups - 1;
+}
+
+// Data block to start looking for a free one from for inode: the first of its group
+int blk_goal(const struct inode *inode) {
+    return superblock.group[ino_group(inode->ino)].first_blk;
+}
+
+// Keep the group hints a lower bound on what is free, so searches can skip the full start of a group: move them
+// past what is in use after an allocation, and back to anything freed below them. The caller holds alloc_lock.
+static void hints_advance(struct group_desc *gd) {
+    while(gd->ino_hint < gd->first_ino + gd->inodes && get_bitmap(i_bitmap, gd->ino_hint)) ++gd->ino_hint;
+    while(gd->blk_hint < gd->first_blk + gd->blks && get_bitmap(d_bitmap, gd->blk_hint)) ++gd->blk_hint;
+}
+
+static void hint_give(uint32_t *hint, int n) {
+    if((uint32_t)n < *hint) *hint = n;
+}
+
+static void blk_hints_give(int blkno) {
+    hint_give(&superblock.group[blk_group(blkno)].blk_hint, blkno);
+}
+
+/* 
+ * Get available inode number from bitmap, in group if it has one free, otherwise in the groups after it
+ */
+int get_avail_ino(int group) {
+
+    int avail_ino = -1;
+
+
+	// Step 1: Lock the in-memory inode bitmap (kept in sync with disk since tfs_init)
+    alloc_acquire();
+
 	
-	// Step 2: Traverse inode bitmap to find an available slot
-    for(int i = 0; i < MAX_DNUM; ++i) {
+	// Step 2: Traverse inode bitmap to find an available slot, starting at the group's slice past its hint
+    int first = superblock.group[group].ino_hint;
+    for(int n = 0; n < MAX_INUM; ++n) {
+        int i = (first + n)%MAX_INUM;
         if(!get_bitmap(i_bitmap, i)) {
             avail_ino = i;
             break;
         }
     }
 
+    // if no available inode has been found
+    if(avail_ino < 0) {
+        pthread_mutex_unlock(&alloc_lock);
+        ERROR("No available inode");
+        return -1;
+    }
+
 
-	// Step 3: Update inode bitmap and write to disk
+	// Step 3: Update inode bitmap and write to disk, taking the bit back if that fails
     set_bitmap(i_bitmap, avail_ino);
-    if(bio_write(superblock.i_bitmap_blk, i_bitmap) < 0) {
+    if(journal_write(superblock.i_bitmap_blk, i_bitmap) < 0) {
+        unset_bitmap(i_bitmap, avail_ino);
+        pthread_mutex_unlock(&alloc_lock);
         ERROR("Failed to write to disk");
         return -1;
     }
+    --superblock.free_inodes;
+    hints_advance(&superblock.group[ino_group(avail_ino)]);
 
 
+    pthread_mutex_unlock(&alloc_lock);
     return avail_ino;
 }
 
 /* 
- * Get available data block number from bitmap
+ * Get available data block number from bitmap, the first free one at or after goal, wrapping around
  */
-int get_avail_blkno() {
+int get_avail_blkno(int goal) {
 
     int avail_blkno = -1;
 
 
-	// Step 1: Read data block bitmap from disk
-    int *bitmap_blk = calloc(1, BLOCK_SIZE);
-    if(!bitmap_blk) {
-        ERROR("Failed to allocate memory");
-        return -1;
-    }
-    if(bio_read(superblock.d_bitmap_blk, bitmap_blk) < 0) {
-        free(bitmap_blk);
-        return -1;
-    }
-    memcpy(d_bitmap, bitmap_blk, sizeof(d_bitmap));
-    free(bitmap_blk);
+	// Step 1: Lock the in-memory data block bitmap (kept in sync with disk since tfs_init)
+    alloc_acquire();
 
 
-	// Step 2: Traverse data block bitmap to find an available slot
-    for(int i = 0; i < MAX_DNUM; ++i) {
-        if(!get_bitmap(d_bitmap, i)) {
+	// Step 2: Traverse data block bitmap to find an available slot, starting at goal or its group's hint
+    if(goal < 0 || goal >= MAX_DNUM) goal = 0;
+    if((uint32_t)goal < superblock.group[blk_group(goal)].blk_hint) goal = superblock.group[blk_group(goal)].blk_hint;
+    if(goal >= MAX_DNUM) goal = 0;
+    for(int n = 0; n < MAX_DNUM; ++n) {
+        int i = (goal + n)%MAX_DNUM;
+        if(!get_bitmap(d_bitmap, i) && !get_bitmap(d_pending, i)) {
             avail_blkno = i;
             break;
         }
@@ -109,19 +321,88 @@ int get_avail_blkno() {
 
     // if no available data block has been found
     if(avail_blkno < 0) {
+        pthread_mutex_unlock(&alloc_lock);
         ERROR("No available data block");
         return -1;
     }
 
 
-	// Step 3: Update data block bitmap and write to disk
+	// Step 3: Update data block bitmap and write to disk, taking the bit back if that fails
     set_bitmap(d_bitmap, avail_blkno);
-    if(bio_write(superblock.d_bitmap_blk, d_bitmap) < 0) return -1;
+    if(journal_write(superblock.d_bitmap_blk, d_bitmap) < 0) {
+        unset_bitmap(d_bitmap, avail_blkno);
+        pthread_mutex_unlock(&alloc_lock);
+        return -1;
+    }
+    --superblock.free_blks;
+    hints_advance(&superblock.group[blk_group(avail_blkno)]);
 
 
+    pthread_mutex_unlock(&alloc_lock);
 	return avail_blkno;
 }
 
+/*
+ * Allocate up to count data blocks that are adjacent on disk: the first free run that long at or after goal,
+ * wrapping around, or the longest one if there is none. Returns the first block and sets *got to how many were
+ * allocated, or -1 if none are free.
+ */
+int get_avail_blkno_run(int goal, int count, int *got) {
+
+    int best = -1;
+    int best_len = 0;
+
+
+	// Step 1: Lock the in-memory data block bitmap
+    alloc_acquire();
+
+
+	// Step 2: Traverse data block bitmap from goal, or its group's hint, for a run of free blocks, stopping at
+    // the first long enough
+    if(goal < 0 || goal >= MAX_DNUM) goal = 0;
+    if((uint32_t)goal < superblock.group[blk_group(goal)].blk_hint) goal = superblock.group[blk_group(goal)].blk_hint;
+    if(goal >= MAX_DNUM) goal = 0;
+    for(int n = 0; n < MAX_DNUM && best_len < count; ) {
+        int i = (goal + n)%MAX_DNUM;
+        if(get_bitmap(d_bitmap, i) || get_bitmap(d_pending, i)) {
+            ++n;
+            continue;
+        }
+        int len = 1;
+        while(i + len < MAX_DNUM && n + len < MAX_DNUM && len < count
+              && !get_bitmap(d_bitmap, i + len) && !get_bitmap(d_pending, i + len)) ++len;
+        if(len > best_len) {
+            best = i;
+            best_len = len;
+        }
+        n += len;
+    }
+
+    // if no available data block has been found
+    if(best < 0) {
+        pthread_mutex_unlock(&alloc_lock);
+        ERROR("No available data block");
+        return -1;
+    }
+
+
+	// Step 3: Update data block bitmap and write to disk
+    for(int i = 0; i < best_len; ++i) set_bitmap(d_bitmap, best + i);
+    if(journal_write(superblock.d_bitmap_blk, d_bitmap) < 0) {
+        for(int i = 0; i < best_len; ++i) unset_bitmap(d_bitmap, best + i);
+        pthread_mutex_unlock(&alloc_lock);
+        return -1;
+    }
+    superblock.free_blks -= best_len;
+    hints_advance(&superblock.group[blk_group(best)]);
+    hints_advance(&superblock.group[blk_group(best + best_len - 1)]);
+
+
+    pthread_mutex_unlock(&alloc_lock);
+    *got = best_len;
+    return best;
+}
+
 /* 
  * inode operations
  */
@@ -143,7 +424,7 @@ int readi(uint16_t ino, struct inode *inode) {
 
 
     // Step 3: Read the block from disk and then copy into inode structure
-    if(bio_read((superblock.i_start_blk + i_blkno), i_blk) < 0) {
+    if(journal_read((superblock.i_start_blk + i_blkno), i_blk) < 0) {
         free(i_blk);
         return -1;
     }
@@ -156,13 +437,6 @@ int readi(uint16_t ino, struct inode *inode) {
 
 int writei(uint16_t ino, struct inode *inode) {
 
-    struct inode *i_blk = malloc(BLOCK_SIZE);
-    if(!i_blk) {
-        ERROR("Failed to allocate memory");
-        return -1;
-    }
-
-
 	// Step 1: Get the block number where this inode resides on disk
     int i_blkno = ino/i_per_blk;
 
@@ -171,711 +445,4433 @@ int writei(uint16_t ino, struct inode *inode) {
     int indx = ino%i_per_blk;
 
 
-	// Step 3: Write inode to disk
+	// Step 3: Write inode to disk, reading and writing back the rest of its block in one step
+    // so a concurrent writei() of another inode in the block, from the reclaim thread, isn't lost
+    if(journal_patch(superblock.i_start_blk + i_blkno, indx*sizeof(struct inode), inode, sizeof(struct inode)) < 0) return -1;
 
-    // read block from disk to i_blk
-    if(bio_read((superblock.i_start_blk + i_blkno), i_blk) < 0) {
-        free(i_blk);
-        return -1;
-    }
 
-    // copy inode into block
-    memcpy(&i_blk[indx], inode, sizeof(struct inode));
+	return 0;
+}
 
-    // write to disk
-    if(bio_write((superblock.i_start_blk + i_blkno), i_blk) < 0) {
-        free(i_blk);
-        return -1;
-    }
+// Set the timestamps named by flags (TOUCH_ATIME, TOUCH_MTIME, TOUCH_CTIME) to the current time
+void inode_touch(struct inode *inode, int flags) {
 
+    struct timespec now;
 
-    free(i_blk);
-	return 0;
+    clock_gettime(CLOCK_REALTIME, &now);
+    if(flags & TOUCH_ATIME) inode->vstat.st_atim = now;
+    if(flags & TOUCH_MTIME) inode->vstat.st_mtim = now;
+    if(flags & TOUCH_CTIME) inode->vstat.st_ctim = now;
 }
 
 
-/* 
- * directory operations
+/*
+ * decompressed cluster cache operations
  */
-int dir_find(uint16_t ino, const char *fname, size_t name_len, struct dirent *dirent) {
+// Copy len bytes at off out of a cached cluster, marking it recently used. Returns 1 if the cluster is cached.
+static int ccache_read(uint16_t ino, int cluster, int off, char *buf, size_t len) {
+
+    int found = 0;
+
+    pthread_mutex_lock(&ccache_lock);
+    for(int i = 0; i < CCACHE_CLUSTERS; ++i) {
+        struct ccache_entry *e = &ccache[i];
+        if(!e->data || e->ino != ino || e->cluster != cluster) continue;
+        memcpy(buf, e->data + off, len);
+        e->last_use = ++ccache_tick;
+        found = 1;
+        break;
+    }
+    pthread_mutex_unlock(&ccache_lock);
+    return found;
+}
 
-    int DISK_ERROR = 0;
-    int FOUND = 0;
-    int STOP = 0;
+// Cache a cluster's decompressed contents, replacing its old copy or the least recently used one
+static void ccache_put(uint16_t ino, int cluster, const char *data) {
 
-    char delim [2] = "/";
-    char *fname_CPY1 = strdup(fname);
-    char *fname_CPY2 = strdup(fname);
-    struct inode inode = {0};
-    struct dirent *dirent_blk = malloc(BLOCK_SIZE);
-    int *ptr_blk = calloc(1, BLOCK_SIZE);
+    struct ccache_entry *victim = NULL;
 
-    // Step 1: Call readi() to get the inode using ino (inode number of current directory)
-    // Step 2: Get data block of current directory from inode
-    if(!fname_CPY1
-    || !fname_CPY2
-    || !dirent_blk
-    || !ptr_blk
-   ) {
-        if(fname_CPY1)  free(fname_CPY1);
-        if(fname_CPY2)  free(fname_CPY2);
-        if(dirent_blk)  free(dirent_blk);
-        if(ptr_blk)     free(ptr_blk);
-        ERROR("Failed to allocate memory");
-        return -1;
+    pthread_mutex_lock(&ccache_lock);
+    for(int i = 0; i < CCACHE_CLUSTERS; ++i) {
+        struct ccache_entry *e = &ccache[i];
+        if(e->data && e->ino == ino && e->cluster == cluster) {
+            victim = e;
+            break;
+        }
+        if(!victim || (victim->data && (!e->data || e->last_use < victim->last_use))) victim = e;
     }
-    // get parent directory
-    char *f_basename = basename(fname_CPY2);
 
+    if(!victim->data && !(victim->data = malloc(CLUSTER_SIZE))) {
+        pthread_mutex_unlock(&ccache_lock);
+        return;
+    }
+    memcpy(victim->data, data, CLUSTER_SIZE);
+    victim->ino = ino;
+    victim->cluster = cluster;
+    victim->last_use = ++ccache_tick;
+    pthread_mutex_unlock(&ccache_lock);
+}
 
-    // Step 3: Read directory's data block and check each directory entry.
-    // If the name matches, then copy directory entry to dirent structure
-    if(fname[0] == '/'
-    && readi(0, &inode) < 0
-    ) {
-        free(fname_CPY1);
-        free(fname_CPY2);
-        free(dirent_blk);
-        free(ptr_blk);
-        return -1;
-    } else if(readi(ino, &inode) < 0) {
-        free(fname_CPY1);
-        free(fname_CPY2);
-        free(dirent_blk);
-        free(ptr_blk);
-        return -1;
+// Drop an inode's cached clusters from from_cluster on
+static void ccache_drop(uint16_t ino, int from_cluster) {
+
+    pthread_mutex_lock(&ccache_lock);
+    for(int i = 0; i < CCACHE_CLUSTERS; ++i) {
+        struct ccache_entry *e = &ccache[i];
+        if(!e->data || e->ino != ino || e->cluster < from_cluster) continue;
+        free(e->data);
+        e->data = NULL;
     }
+    pthread_mutex_unlock(&ccache_lock);
+}
 
-    for(char *path = strtok(fname_CPY1, delim); path != NULL; path = strtok(NULL, delim)) {
 
-        // reset found to 0
-        FOUND = 0;
+/*
+ * inode state operations
+ */
+void inode_dirty(uint16_t ino, int datasync) {
 
-        // search inode for directory/subdirectory
-        memcpy(ptr_blk, inode.direct_ptr, sizeof(inode.direct_ptr));
-        for(int i = -1; i < 8; ) {
-            for(int j = 0; j < 16; ++j) {
+    // remember the transaction the caller's metadata writes landed in
+    uint32_t tid = journal_tid();
 
-                // if unused section of direct array has been reached
-                if(ptr_blk[j] < 0) {
-                    STOP = 1;
-                    break;
-                }
+    pthread_mutex_lock(&state_lock);
+    inode_states[ino].sync_tid = tid;
+    if(datasync) inode_states[ino].datasync_tid = tid;
+    pthread_mutex_unlock(&state_lock);
+}
 
-                // read block from the direct array entry
-                if(bio_read((superblock.d_start_blk + ptr_blk[j]), dirent_blk) < 0) {
-                    DISK_ERROR = 1;
-                    break;
-                }
+static int blkno_cmp(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
 
-                // search block for the directory/subdirectory entry
-                for(int k = 0; k < dirents_per_blk; ++k) {
+// sort the dirty list and drop repeats, caller holds state_lock
+static int dirty_compact(struct inode_state *state) {
 
-                    // if we reached unused section of directory entry block
-                    if(!dirent_blk[k].valid) break;
+    int n = 0;
+    qsort(state->dirty_blks, state->ndirty, sizeof(int), blkno_cmp);
+    for(int i = 0; i < state->ndirty; ++i) {
+        if(!n || state->dirty_blks[n-1] != state->dirty_blks[i]) state->dirty_blks[n++] = state->dirty_blks[i];
+    }
+    state->ndirty = n;
+    return n;
+}
 
-                    // if the directory entry matches the directory/subdirectory name
-                    if(!strcmp(path, dirent_blk[k].name)) {
+// add a data block to the dirty list, caller holds state_lock
+static int dirty_add(struct inode_state *state, int blkno) {
 
-                        // if the basename has been found
-                        if(!strcmp(path, f_basename)) memcpy(dirent, &dirent_blk[k], sizeof(struct dirent));
+    // sequential writes usually hit the block written last
+    if(state->ndirty && state->dirty_blks[state->ndirty-1] == blkno) return 0;
 
-                        // read inode
-                        readi(dirent_blk[k].ino, &inode);
+    if(state->ndirty == state->cap) {
 
-                        // set found to 1 and exit loop
-                        FOUND = 1;
-                        break;
-                    }
-                }
+        // squeeze out repeats before growing past what the largest file can dirty
+        if(state->cap >= MAX_FILE_BLKS) dirty_compact(state);
 
-                // if directory/subdirectory has been found
-                if(FOUND) break;
+        if(state->ndirty == state->cap) {
+            int cap = state->cap ? state->cap*2 : 16;
+            int *blks = realloc(state->dirty_blks, cap*sizeof(int));
+            if(!blks) {
+                ERROR("Failed to allocate memory");
+                return -1;
             }
+            state->dirty_blks = blks;
+            state->cap = cap;
+        }
+    }
+    state->dirty_blks[state->ndirty++] = blkno;
+    return 0;
+}
 
-            // if the directory/subdirectory has been found or if a disk error occurred
-            if(FOUND || STOP || DISK_ERROR) break;
-
-            // if we haven't checked all indirect array entries
-            if((++i) < 8) {
+int inode_dirty_blk(uint16_t ino, int blkno) {
 
-                // if the unused pointer section of the indirect pointer array has been reached
-                if(inode.indirect_ptr[i] < 0) break;
+    pthread_mutex_lock(&state_lock);
+    int retstat = dirty_add(&inode_states[ino], blkno);
+    pthread_mutex_unlock(&state_lock);
+    return retstat;
+}
 
-                // read array block from the indirect array entry
-                if(bio_read((superblock.d_start_blk + inode.indirect_ptr[i]), ptr_blk)) {
-                    DISK_ERROR = 1;
-                    break;
-                }
-            }
-        }
+void inode_forget(uint16_t ino) {
 
-        // if directory/subdirectory has not been found
-        if(!FOUND) break;
+    pthread_mutex_lock(&state_lock);
+    free(inode_states[ino].dirty_blks);
+    ccache_drop(ino, 0);
+    // buffered data of a file being freed is never written
+    if(inode_states[ino].wb_data) {
+        free(inode_states[ino].wb_data);
+        --wb_pages;
     }
+    memset(&inode_states[ino], 0, sizeof(struct inode_state));
+    pthread_mutex_unlock(&state_lock);
+}
 
+// the low-level daemon's kernel took a reference to the inode with a lookup or create
+void inode_ref(uint16_t ino) {
 
-    free(fname_CPY1);
-    free(fname_CPY2);
-    free(dirent_blk);
-    free(ptr_blk);
-    if(DISK_ERROR) {
-        ERROR("Failed to find directory");
-        return -1;
-    }
-    if(!FOUND) {
-        ERROR("Directory doesn't exist");
-        return -1;
-    }
-	return 0;
+    pthread_mutex_lock(&state_lock);
+    ++inode_states[ino].nlookup;
+    pthread_mutex_unlock(&state_lock);
 }
 
-int dir_add(struct inode dir_inode, uint16_t f_ino, const char *fname, size_t name_len) {
+// the kernel dropped nlookup references; an unlinked inode it no longer knows can now be reclaimed
+void inode_unref(uint16_t ino, uint64_t nlookup) {
 
-    int DISK_ERROR = 0;
-    int DIRECTORY_ADDED = 0;
+    pthread_mutex_lock(&state_lock);
+    struct inode_state *state = &inode_states[ino];
+    state->nlookup = state->nlookup > nlookup ? state->nlookup - nlookup : 0;
+    int released = !state->nlookup;
+    pthread_mutex_unlock(&state_lock);
 
-    char *fname_CPY1 = strdup(fname);
-    char *fname_CPY2 = strdup(fname);
-    struct dirent dirent = {0};
-    struct dirent *dirent_blk = malloc(BLOCK_SIZE);
-    int *ptr_blk = calloc(1, BLOCK_SIZE);
-    if(!fname_CPY1
-    || !fname_CPY2
-    || !dirent_blk
-    || !ptr_blk
-    ) {
-        if(fname_CPY1)  free(fname_CPY1);
-        if(fname_CPY2)  free(fname_CPY2);
-        if(dirent_blk)  free(dirent_blk);
-        if(ptr_blk)     free(ptr_blk);
-        ERROR("Failed to allocate memory.");
+    if(released) pthread_cond_signal(&reclaim_cond);
+}
+
+void inode_data_changed(uint16_t ino) {
+
+    pthread_mutex_lock(&state_lock);
+    ++inode_states[ino].data_gen;
+    pthread_mutex_unlock(&state_lock);
+}
+
+// Returns 1 if the file's contents haven't changed since it was last opened, so the pages the
+// kernel cached then are still good, and remembers the contents as of this open
+int inode_keep_cache(uint16_t ino) {
+
+    struct inode_state *state = &inode_states[ino];
+
+    pthread_mutex_lock(&state_lock);
+    int keep = state->cache_gen == state->data_gen + 1;
+    state->cache_gen = state->data_gen + 1;
+    pthread_mutex_unlock(&state_lock);
+    return keep;
+}
+
+
+/*
+ * write buffer operations
+ */
+// write back an inode's buffered block, caller holds state_lock
+static int wb_flush_locked(uint16_t ino) {
+
+    struct inode_state *state = &inode_states[ino];
+
+    if(!state->wb_data) return 0;
+
+    if(bio_write(superblock.d_start_blk + state->wb_blkno, state->wb_data) < 0) return -1;
+    if(dirty_add(state, state->wb_blkno) < 0) return -1;
+
+    free(state->wb_data);
+    state->wb_data = NULL;
+    state->wb_new = 0;
+    --wb_pages;
+    return 0;
+}
+
+int wb_flush(uint16_t ino) {
+
+    pthread_mutex_lock(&state_lock);
+    int retstat = wb_flush_locked(ino);
+    pthread_mutex_unlock(&state_lock);
+    return retstat;
+}
+
+// write back every buffered block, or only those in newly allocated data blocks,
+// so a commit never makes a file point at a block still holding another file's data
+static int wb_flush_all(int new_only) {
+
+    int DISK_ERROR = 0;
+
+    pthread_mutex_lock(&state_lock);
+    for(int ino = 0; ino < MAX_INUM && wb_pages; ++ino) {
+        if(!inode_states[ino].wb_data || (new_only && !inode_states[ino].wb_new)) continue;
+        if(wb_flush_locked(ino) < 0) DISK_ERROR = 1;
     }
-    // get directory/file basename
-    char *f_basename = basename(fname_CPY1);
-    // get parent directory name
-    char *f_dirname = dirname(fname_CPY2);
-    struct dirent f_dirent = { .valid = 1, .ino = f_ino };
-    strcpy(f_dirent.name, fname);
+    pthread_mutex_unlock(&state_lock);
 
+    if(DISK_ERROR) return -1;
+    return 0;
+}
 
-    // Step 1: Read dir_inode's data block and check each directory entry of dir_inode
-	// Step 2: Check if fname (directory name) is already used in other entries
+static void wb_precommit() {
+    if(wb_flush_all(1) < 0) ERROR("Failed to write back buffered blocks before commit");
+}
 
-    // If dir_inode isn't already the current directory
-    if(strcmp(fname, "/")
-    && strcmp(fname, ".")
-    && !((dir_inode.ino == 0) && (strcmp(fname, "..")))
-    ) {
-        // get directory inode
-        if(dir_find(dir_inode.ino, f_dirname, strlen(f_dirname), &dirent)) {
-            free(fname_CPY1);
-            free(fname_CPY2);
-            free(dirent_blk);
-            free(ptr_blk);
+// Copy a write that doesn't cover its whole block into the inode's buffered block.
+// The block is written back once the write reaches the end of the block, when another
+// block of the file is written, or when too many blocks are buffered.
+int wb_write(uint16_t ino, int blk_indx, int blkno, int new_blk, int offset, const char *buf, int size) {
+
+    struct inode_state *state = &inode_states[ino];
+
+    pthread_mutex_lock(&state_lock);
+
+
+    // Step 1: Write back whatever other block this inode has buffered
+    if(state->wb_data && state->wb_indx != blk_indx && wb_flush_locked(ino) < 0) {
+        pthread_mutex_unlock(&state_lock);
+        return -1;
+    }
+
+
+    // Step 2: Start buffering this block, making room by writing back another inode's block
+    if(!state->wb_data) {
+
+        for(int i = 0; wb_pages >= WB_MAX_PAGES && i < MAX_INUM; ++i) {
+            wb_clock = (wb_clock + 1) % MAX_INUM;
+            if(wb_clock != ino && inode_states[wb_clock].wb_data && wb_flush_locked(wb_clock) < 0) {
+                pthread_mutex_unlock(&state_lock);
+                return -1;
+            }
+        }
+
+        char *data = malloc(BLOCK_SIZE);
+        if(!data) {
+            pthread_mutex_unlock(&state_lock);
+            ERROR("Failed to allocate memory");
             return -1;
         }
-        readi(dirent.ino, &dir_inode);
+
+        // a new block starts out zeroed, an existing one is read once and then patched in memory
+        if(new_blk) {
+            memset(data, 0, BLOCK_SIZE);
+        } else if(bio_read(superblock.d_start_blk + blkno, data) < 0) {
+            free(data);
+            pthread_mutex_unlock(&state_lock);
+            return -1;
+        }
+
+        state->wb_data = data;
+        state->wb_indx = blk_indx;
+        state->wb_blkno = blkno;
+        state->wb_new = new_blk;
+        ++wb_pages;
     }
 
 
-    // check if a directory of the same name already exists
-    if(!dir_find(dir_inode.ino, f_basename, strlen(f_basename), &dirent)) {
-        ERROR("Directory already exists");
-        free(fname_CPY1);
-        free(fname_CPY2);
-        free(dirent_blk);
-        free(ptr_blk);
+    // Step 3: Copy the write in and write the block back once it is filled to the end
+    memcpy(state->wb_data + offset, buf, size);
+
+    int retstat = 0;
+    if(offset + size == BLOCK_SIZE) retstat = wb_flush_locked(ino);
+
+    pthread_mutex_unlock(&state_lock);
+    return retstat;
+}
+
+// Copy a read out of the inode's buffered block. Returns 1 if the block is buffered.
+int wb_read(uint16_t ino, int blk_indx, int offset, char *buf, int size) {
+
+    struct inode_state *state = &inode_states[ino];
+    int found = 0;
+
+    pthread_mutex_lock(&state_lock);
+    if(state->wb_data && state->wb_indx == blk_indx) {
+        memcpy(buf, state->wb_data + offset, size);
+        found = 1;
+    }
+    pthread_mutex_unlock(&state_lock);
+    return found;
+}
+
+// Drop the buffered copy of a block that is about to be overwritten in full
+void wb_discard(uint16_t ino, int blk_indx) {
+
+    struct inode_state *state = &inode_states[ino];
+
+    pthread_mutex_lock(&state_lock);
+    if(state->wb_data && state->wb_indx == blk_indx) {
+        free(state->wb_data);
+        state->wb_data = NULL;
+        state->wb_new = 0;
+        --wb_pages;
+    }
+    pthread_mutex_unlock(&state_lock);
+}
+
+// Drop the buffered block if it lies at or past file block blk_indx, for a file being cut short
+void wb_discard_from(uint16_t ino, int blk_indx) {
+
+    struct inode_state *state = &inode_states[ino];
+
+    pthread_mutex_lock(&state_lock);
+    if(state->wb_data && state->wb_indx >= blk_indx) {
+        free(state->wb_data);
+        state->wb_data = NULL;
+        state->wb_new = 0;
+        --wb_pages;
+    }
+    pthread_mutex_unlock(&state_lock);
+}
+
+int inode_sync(uint16_t ino, int datasync) {
+
+    int DISK_ERROR = 0;
+    struct inode_state *state = &inode_states[ino];
+
+
+    // Step 1: Write out the inode's buffered block, then take its dirty data blocks
+    // and the transaction its metadata is in
+    // (fdatasync only waits for the last size/block map change, not timestamp updates)
+    pthread_mutex_lock(&state_lock);
+    if(wb_flush_locked(ino) < 0) {
+        pthread_mutex_unlock(&state_lock);
         return -1;
     }
+    int ndirty = state->ndirty ? dirty_compact(state) : 0;
+    int *blks = state->dirty_blks;
+    uint32_t tid = datasync ? state->datasync_tid : state->sync_tid;
+    state->dirty_blks = NULL;
+    state->ndirty = 0;
+    state->cap = 0;
+    pthread_mutex_unlock(&state_lock);
+
+
+    // Step 2: Write out the data blocks, one call per run of adjacent blocks,
+    // before the metadata that points at them commits
+    for(int i = 0; i < ndirty; ) {
+        int run = 1;
+        while(i + run < ndirty && blks[i + run] == blks[i] + run) ++run;
+        if(bio_sync(superblock.d_start_blk + blks[i], run) < 0) DISK_ERROR = 1;
+        i += run;
+    }
+    free(blks);
+    if(DISK_ERROR) return -1;
 
 
-	// Step 3: Add directory entry in dir_inode's data block and write to disk
-	// Allocate a new data block for this directory if it does not exist
-	// Update directory inode
-	// Write directory entry
-    memcpy(ptr_blk, dir_inode.direct_ptr, sizeof(dir_inode.direct_ptr));
-    for(int i = -1; i < 8; ) {
-        for(int j = 0; j < 16; ++j) {
+    // Step 3: Commit the inode's block map and inode block unless that transaction already committed
+    int committed = journal_commit_tid(tid);
+    if(committed < 0) return -1;
 
-            // if array is not in use
-            if(ptr_blk[j] < 0)  {
 
-                // clear dirent block
-                memset(dirent_blk, 0, BLOCK_SIZE);
+    // Step 4: A commit flushes DISKFILE itself; otherwise flush it for the data written above
+    if(!committed && ndirty && dev_sync() < 0) return -1;
 
-                // set array entry to a new data block
-                ptr_blk[j] = get_avail_blkno();
 
-                // if we failed to get a new data block
-                if(ptr_blk[j] < 0) {
-                    DISK_ERROR = 1;
-                    break;
-                }
+    return 0;
+}
 
-                // copy dirent entry into first spot of dirent block
-                memcpy(&dirent_blk[0], &f_dirent, sizeof(struct dirent));
-            }
-            // array is in use
-            else {
 
-                // read block from pointer array entry
-                bio_read(superblock.d_start_blk + ptr_blk[j], dirent_blk);
+/*
+ * block map operations
+ */
+// Map count file blocks from blk_indx to data block numbers in blknos, allocating blocks (and their
+// pointer arrays) when alloc is set. Each pointer array is read and written once for the whole range.
+// Unallocated blocks map to -1. Returns the number of blocks mapped, which is short when the disk
+// fills up, or -2 on failure.
+int bmap_range(struct inode *inode, int blk_indx, int count, int alloc, int *blknos, int *new_blks) {
 
-                // search the directory entry block
-                for(int k = 0; k < dirents_per_blk; ++k) {
+    int DISK_ERROR = 0;
+    int n = 0;
+    int *ptr_blk = NULL;
+    int cur_array = -1;
+    int array_dirty = 0;
+    // new blocks are placed after the last block mapped, or from the start of the inode's group
+    int goal = blk_goal(inode);
 
-                    // if the entry is not in use
-                    if(!dirent_blk[k].valid) {
+    if(blk_indx < 0 || count < 0 || blk_indx + count > MAX_FILE_BLKS) return -2;
 
-                        // add the directory entry to the directory entry block
-                        memcpy(&dirent_blk[k], &f_dirent, sizeof(struct dirent));
+    while(n < count) {
 
-                        DIRECTORY_ADDED = 1;
-                        break;
-                    }
-                }
+        int indx = blk_indx + n;
+        int blkno;
+        int is_new = 0;
 
-                // if the directory was not added, go to next iteration
-                if(!DIRECTORY_ADDED) continue;
+
+        // Step 1: Blocks below 16 come straight from the direct pointer array
+        if(indx < 16) {
+            if(inode->direct_ptr[indx] < 0 && alloc) {
+                blkno = get_avail_blkno(goal);
+                if(blkno < 0) break;
+                inode->direct_ptr[indx] = blkno;
+                is_new = 1;
             }
+            blknos[n] = inode->direct_ptr[indx];
+            if(blknos[n] >= 0) goal = blknos[n] + 1;
+            if(new_blks) new_blks[n] = is_new;
+            ++n;
+            continue;
+        }
 
-            // write directory entry to disk
-            if(bio_write((superblock.d_start_blk + ptr_blk[j]), dirent_blk) < 0) {
+
+        // Step 2: Otherwise load the indirect pointer array that holds the block,
+        // writing back the previous one if blocks were added to it
+        int i = (indx - 16)/PTRS_PER_BLK;
+        int j = (indx - 16)%PTRS_PER_BLK;
+
+        if(i != cur_array) {
+
+            if(array_dirty && journal_write(superblock.d_start_blk + inode->indirect_ptr[cur_array], ptr_blk) < 0) {
                 DISK_ERROR = 1;
                 break;
             }
+            array_dirty = 0;
+            cur_array = -1;
 
-            // if it's a direct pointer array, copy the pointer array block to the direct pointer array
-            if(i < 0) memcpy(dir_inode.direct_ptr, ptr_blk, sizeof(dir_inode.direct_ptr));
-            // else write pointer array block to disk
-            else if(bio_write((superblock.d_start_blk + dir_inode.indirect_ptr[i]), ptr_blk) < 0) {
+            if(!ptr_blk && !(ptr_blk = malloc(BLOCK_SIZE))) {
+                ERROR("Failed to allocate memory");
                 DISK_ERROR = 1;
                 break;
             }
 
-            // update directory inode
-            if(writei(dir_inode.ino, &dir_inode) < 0) {
+            if(inode->indirect_ptr[i] < 0) {
+
+                // if the pointer array is unused, the block isn't allocated either
+                if(!alloc) {
+                    blknos[n] = -1;
+                    if(new_blks) new_blks[n] = 0;
+                    ++n;
+                    continue;
+                }
+
+                int array_blkno = get_avail_blkno(goal);
+                if(array_blkno < 0) break;
+                goal = array_blkno + 1;
+
+                // set unused entries to -1
+                memset(ptr_blk, 0, BLOCK_SIZE);
+                for(int k = 0; k < PTRS_PER_BLK; ++k) ptr_blk[k] = -1;
+                inode->indirect_ptr[i] = array_blkno;
+                array_dirty = 1;
+            }
+            else if(journal_read(superblock.d_start_blk + inode->indirect_ptr[i], ptr_blk) < 0) {
                 DISK_ERROR = 1;
                 break;
             }
+            cur_array = i;
+        }
 
 
-            DIRECTORY_ADDED = 1;
-            break;
+        // Step 3: Allocate the block and record it in the pointer array
+        if(ptr_blk[j] < 0 && alloc) {
+            blkno = get_avail_blkno(goal);
+            if(blkno < 0) break;
+            ptr_blk[j] = blkno;
+            array_dirty = 1;
+            is_new = 1;
         }
+        blknos[n] = ptr_blk[j];
+        if(blknos[n] >= 0) goal = blknos[n] + 1;
+        if(new_blks) new_blks[n] = is_new;
+        ++n;
+    }
 
-        // if the directory has been added or if a disk error occurred
-        if(DIRECTORY_ADDED || DISK_ERROR) break;
 
-        // if we haven't checked all indirect array entries
-        // else, all directory entries are in use
-        if((++i) < 8) {
+    // Step 4: Write back the last pointer array touched
+    if(array_dirty && journal_write(superblock.d_start_blk + inode->indirect_ptr[cur_array], ptr_blk) < 0) DISK_ERROR = 1;
 
-            // if indirect array entry is unused
-            if(dir_inode.indirect_ptr[i] < 0) {
 
-                // get available data block address
-                int array_blkno = get_avail_blkno();
-                if(array_blkno < 0) {
-                    DISK_ERROR = 1;
-                    break;
-                }
+    free(ptr_blk);
+    if(DISK_ERROR) return -2;
+    return n;
+}
 
-                // clear block
-                memset(ptr_blk, 0, BLOCK_SIZE);
+// Map a single file block index, see bmap_range(). Returns -1 for a block that isn't allocated, -2 on failure.
+int bmap(struct inode *inode, int blk_indx, int alloc, int *new_blk) {
 
-                // set unused entries to -1
-                for(int j = 1; j < 16; ++j) ptr_blk[j] = -1;
+    int blkno = -1;
 
-                // set indirect pointer entry to pointer array block number
-                dir_inode.indirect_ptr[i] = array_blkno;
+    if(bmap_range(inode, blk_indx, 1, alloc, &blkno, new_blk) < 1) return -2;
+    return blkno;
+}
 
-                // update inode size
-                dir_inode.size += BLOCK_SIZE;
-                dir_inode.vstat.st_size += BLOCK_SIZE;
-                dir_inode.vstat.st_blocks++;
+// Journal the reference count region block holding blkno's count, caller holds alloc_lock
+static int ref_write(int blkno) {
 
-                //update bitmap
-                set_bitmap(d_bitmap, array_blkno);
-                if(bio_write(superblock.d_bitmap_blk, d_bitmap) < 0) {
-                    DISK_ERROR = 1;
-                    break;
-                }
-            }
+    int i = blkno/REF_PER_BLK;
+    return journal_write(superblock.ref_start_blk + i, d_refs + i*REF_PER_BLK);
+}
 
-            // read pointer array block from the indirect array entry
-            if(bio_read((superblock.d_start_blk + dir_inode.indirect_ptr[i]), ptr_blk)) {
-                DISK_ERROR = 1;
-                break;
-            }
-        } else ERROR("All directory entries are in use");
-    }
+// Returns 1 if more than one file block points at the data block
+int blk_shared(int blkno) {
 
+    alloc_acquire();
+    int shared = d_refs[blkno] > 0;
+    pthread_mutex_unlock(&alloc_lock);
+    return shared;
+}
 
-    free(fname_CPY1);
-    free(fname_CPY2);
-    free(dirent_blk);
-    free(ptr_blk);
-    if(DISK_ERROR) {
-        ERROR("Failed to make directory");
-        return -1;
+// Drop a data block from the dedup index, caller holds alloc_lock
+static void dedup_forget(int blkno) {
+
+    if(!get_bitmap(dd_indexed, blkno)) return;
+
+    int *link = &dd_head[dd_hash[blkno] % DEDUP_BUCKETS];
+    while(*link != blkno + 1) link = &dd_next[*link - 1];
+    *link = dd_next[blkno];
+    unset_bitmap(dd_indexed, blkno);
+}
+
+// Free a data block in the in-memory bitmap; it isn't handed out again until the freeing transaction commits.
+// Its checksum goes too, since it may come back as file data, which isn't checked.
+// A shared block only loses a reference. The caller holds alloc_lock.
+static void blk_free(int blkno) {
+
+    if(d_refs[blkno]) {
+        --d_refs[blkno];
+        if(ref_write(blkno) < 0) ERROR("Failed to write reference count");
+        return;
     }
-	return 0;
+
+    dedup_forget(blkno);
+    unset_bitmap(d_bitmap, blkno);
+    ++superblock.free_blks;
+    blk_hints_give(blkno);
+    set_bitmap(d_pending, blkno);
+    journal_forget(superblock.d_start_blk + blkno);
 }
 
-int dir_remove(struct inode dir_inode, const char *fname, size_t name_len) {
+// Free every data block from file block index from_blk on, and the pointer arrays left with no blocks,
+// clearing their pointers in the inode. Holes are skipped, so blocks past one are still found.
+// The caller holds alloc_lock and writes the inode and the data block bitmap.
+int bmap_free(struct inode *inode, int from_blk) {
 
-    int DISK_ERROR = 0;
-    int DIRECTORY_REMOVED = 0;
+    // an inline file's pointer area holds its data
+    if(inode->flags & INODE_INLINE) return 0;
 
-    char *fname_CPY1 = strdup(fname);
-    char *fname_CPY2 = strdup(fname);
-    struct dirent dirent = {0};
-    struct dirent *dirent_blk = malloc(BLOCK_SIZE);
-    int *ptr_blk = calloc(1, BLOCK_SIZE);
-    if(!fname_CPY1
-    || !fname_CPY2
-    || !dirent_blk
-    || !ptr_blk
-    ) {
-        if(fname_CPY1)  free(fname_CPY1);
-        if(fname_CPY2)  free(fname_CPY2);
-        if(dirent_blk)  free(dirent_blk);
-        if(ptr_blk)     free(ptr_blk);
-        ERROR("Failed to allocate memory.");
+    int *ptr_blk = malloc(BLOCK_SIZE);
+    if(!ptr_blk) {
+        ERROR("Failed to allocate memory");
+        return -1;
     }
-    // get directory/file basename
-    char *f_basename = basename(fname_CPY1);
-    // get parent directory
-    char *f_dirname = dirname(fname_CPY2);
 
-	// Step 1: Read dir_inode's data block and checks each directory entry of dir_inode
-	// Step 2: Check if fname exist
-    if(dir_find(dir_inode.ino, f_dirname, strlen(f_dirname), &dirent)) {
-        fprintf(stderr, "Could not open %s\n", f_dirname);
-        free(fname_CPY1);
-        free(fname_CPY2);
-        free(dirent_blk);
-        free(ptr_blk);
-        return -1;
+
+    // Step 1: Free the blocks held by direct pointers, forgetting which of the freed blocks were preallocated
+    for(int k = from_blk; k < MAX_FILE_BLKS; ++k) unset_bitmap(inode->unwritten, k);
+    for(int k = from_blk; k < 16; ++k) {
+        if(inode->direct_ptr[k] < 0) continue;
+        blk_free(inode->direct_ptr[k]);
+        inode->direct_ptr[k] = -1;
     }
 
-    readi(dirent.ino, &dir_inode);
-    if(dir_find(dir_inode.ino, f_basename, strlen(f_basename), &dirent)) {
-        ERROR("Directory doesn't exists");
-        free(fname_CPY1);
-        free(fname_CPY2);
-        free(dirent_blk);
+
+    // Step 2: Free the blocks held by each pointer array that reaches from_blk, then the array
+    // itself if none of its blocks are kept, or write it back with the freed entries cleared
+    for(int i = 0; i < 8; ++i) {
+
+        int first = 16 + i*PTRS_PER_BLK;
+        if(inode->indirect_ptr[i] < 0 || first + PTRS_PER_BLK <= from_blk) continue;
+
+        if(journal_read(superblock.d_start_blk + inode->indirect_ptr[i], ptr_blk) < 0) {
+            free(ptr_blk);
+            return -1;
+        }
+
+        int changed = 0;
+        for(int j = from_blk > first ? from_blk - first : 0; j < PTRS_PER_BLK; ++j) {
+            if(ptr_blk[j] < 0) continue;
+            blk_free(ptr_blk[j]);
+            ptr_blk[j] = -1;
+            changed = 1;
+        }
+
+        if(from_blk <= first) {
+            blk_free(inode->indirect_ptr[i]);
+            inode->indirect_ptr[i] = -1;
+        }
+        else if(changed && journal_write(superblock.d_start_blk + inode->indirect_ptr[i], ptr_blk) < 0) {
+            free(ptr_blk);
+            return -1;
+        }
+    }
+
+
+    free(ptr_blk);
+    return 0;
+}
+
+// Point file block blk_indx at data block blkno, or at nothing for -1, allocating its pointer array if it has none
+static int bmap_set(struct inode *inode, int blk_indx, int blkno) {
+
+    if(blk_indx < 16) {
+        inode->direct_ptr[blk_indx] = blkno;
+        return 0;
+    }
+
+    int i = (blk_indx - 16)/PTRS_PER_BLK;
+    if(inode->indirect_ptr[i] < 0 && blkno < 0) return 0;
+
+    int *ptr_blk = malloc(BLOCK_SIZE);
+    if(!ptr_blk) {
+        ERROR("Failed to allocate memory");
+        return -1;
+    }
+    if(inode->indirect_ptr[i] < 0) {
+        int array_blkno = get_avail_blkno(blkno >= 0 ? blkno : blk_goal(inode));
+        if(array_blkno < 0) {
+            free(ptr_blk);
+            return -1;
+        }
+        memset(ptr_blk, 0, BLOCK_SIZE);
+        for(int k = 0; k < PTRS_PER_BLK; ++k) ptr_blk[k] = -1;
+        inode->indirect_ptr[i] = array_blkno;
+    }
+    else if(journal_read(superblock.d_start_blk + inode->indirect_ptr[i], ptr_blk) < 0) {
+        free(ptr_blk);
+        return -1;
+    }
+    ptr_blk[(blk_indx - 16)%PTRS_PER_BLK] = blkno;
+    int retstat = journal_write(superblock.d_start_blk + inode->indirect_ptr[i], ptr_blk);
+    free(ptr_blk);
+    return retstat < 0 ? -1 : 0;
+}
+
+// Give file block blk_indx, which points at the shared data block blkno, a block of its own, copying
+// the contents into it unless the caller is about to overwrite all of it. Returns the new block, or -2.
+// The caller holds a journal handle and writes the inode.
+int bmap_unshare(struct inode *inode, int blk_indx, int blkno, int copy) {
+
+    int DISK_ERROR = 0;
+
+    int new_blkno = get_avail_blkno(blk_goal(inode));
+    if(new_blkno < 0) return -2;
+
+
+    // Step 1: Copy the shared contents
+    if(copy) {
+        char *data = malloc(BLOCK_SIZE);
+        if(!data
+        || bio_read(superblock.d_start_blk + blkno, data) < 0
+        || bio_write(superblock.d_start_blk + new_blkno, data) < 0
+        ) {
+            DISK_ERROR = 1;
+        }
+        else inode_dirty_blk(inode->ino, new_blkno);
+        free(data);
+    }
+
+
+    // Step 2: Point the file block at the copy and drop its reference to the shared block
+    if(!DISK_ERROR && bmap_set(inode, blk_indx, new_blkno) < 0) DISK_ERROR = 1;
+
+    alloc_acquire();
+    blk_free(DISK_ERROR ? new_blkno : blkno);
+    if(journal_write(superblock.d_bitmap_blk, d_bitmap) < 0) DISK_ERROR = 1;
+    pthread_mutex_unlock(&alloc_lock);
+
+
+    if(DISK_ERROR) return -2;
+    return new_blkno;
+}
+
+
+/*
+ * dedup operations
+ */
+// Returns 1 if some inode has writes to the data block buffered, caller holds state_lock
+static int wb_holds(int blkno) {
+
+    for(int ino = 0; ino < MAX_INUM && wb_pages; ++ino) {
+        if(inode_states[ino].wb_data && inode_states[ino].wb_blkno == blkno) return 1;
+    }
+    return 0;
+}
+
+// Index a file data block that was just written whole with data, replacing what it was indexed under
+void dedup_add(int blkno, const char *data) {
+
+    uint32_t hash = crc32c(0, data, BLOCK_SIZE);
+
+    alloc_acquire();
+    dedup_forget(blkno);
+    dd_hash[blkno] = hash;
+    dd_next[blkno] = dd_head[hash % DEDUP_BUCKETS];
+    dd_head[hash % DEDUP_BUCKETS] = blkno + 1;
+    set_bitmap(dd_indexed, blkno);
+    pthread_mutex_unlock(&alloc_lock);
+}
+
+// Take another reference to a data block, caller holds alloc_lock. Fails if the count is full.
+static int ref_get(int blkno) {
+
+    if(d_refs[blkno] == UINT16_MAX) return -1;
+    ++d_refs[blkno];
+    if(ref_write(blkno) < 0) {
+        --d_refs[blkno];
+        return -1;
+    }
+    return 0;
+}
+
+// Find a data block that already holds data, whose CRC32C is hash, and take a reference to it. Candidates
+// are compared byte for byte, since the index isn't updated when a block is later partly overwritten;
+// blocks with buffered writes are passed over. Returns the block, or -1 if there is none.
+int dedup_find(const char *data, uint32_t hash) {
+
+    int found = -1;
+    char *blk = malloc(BLOCK_SIZE);
+    if(!blk) return -1;
+
+    alloc_acquire();
+    pthread_mutex_lock(&state_lock);
+    for(int b = dd_head[hash % DEDUP_BUCKETS] - 1; b >= 0 && found < 0; b = dd_next[b] - 1) {
+        if(dd_hash[b] != hash || d_refs[b] == UINT16_MAX || wb_holds(b)) continue;
+        if(bio_read(superblock.d_start_blk + b, blk) < 0 || memcmp(blk, data, BLOCK_SIZE)) continue;
+        found = b;
+    }
+    pthread_mutex_unlock(&state_lock);
+
+    if(found >= 0 && ref_get(found) < 0) found = -1;
+    pthread_mutex_unlock(&alloc_lock);
+
+    free(blk);
+    return found;
+}
+
+// Before a write, point the whole blocks it covers whose contents are already on disk at those blocks
+// (with -o dedup) and give each other shared block it covers a copy of its own. blknos maps the write's
+// blocks and is updated; done[k] is set for a block that needs no write. Returns -1 on failure.
+static int dedup_map(struct inode *inode, const char *buffer, size_t size, off_t offset,
+                     int *blknos, int *done, int count, int *map_changed) {
+
+    int first_blk = offset/BLOCK_SIZE;
+    // only the first and last blocks of a write can be partly covered
+    int first_whole = offset%BLOCK_SIZE ? 1 : 0;
+    int last_whole = (offset + size)%BLOCK_SIZE ? count - 2 : count - 1;
+    uint32_t *hashes = tfs_config.dedup ? malloc(count*sizeof(uint32_t)) : NULL;
+
+    for(int k = 0; k < count; ++k) {
+
+        int blk_indx = first_blk + k;
+        int whole = k >= first_whole && k <= last_whole;
+        const char *data = buffer + ((off_t)blk_indx*BLOCK_SIZE - offset);
+        done[k] = 0;
+
+
+        // Step 1: A whole block whose contents some block already holds is pointed at that one:
+        // an earlier block of this write, which is written below, or one in the dedup index
+        if(whole && hashes) {
+            int blkno = -1;
+            hashes[k] = crc32c(0, data, BLOCK_SIZE);
+            for(int j = first_whole; j < k && blkno < 0; ++j) {
+                if(hashes[j] == hashes[k] && !memcmp(buffer + ((off_t)(first_blk + j)*BLOCK_SIZE - offset), data, BLOCK_SIZE)) {
+                    alloc_acquire();
+                    if(ref_get(blknos[j]) == 0) blkno = blknos[j];
+                    pthread_mutex_unlock(&alloc_lock);
+                }
+            }
+            if(blkno < 0) blkno = dedup_find(data, hashes[k]);
+
+            if(blkno == blknos[k]) {
+                alloc_acquire();
+                blk_free(blkno);
+                pthread_mutex_unlock(&alloc_lock);
+                done[k] = 1;
+                continue;
+            }
+            if(blkno >= 0) {
+                int retstat = bmap_set(inode, blk_indx, blkno);
+                alloc_acquire();
+                blk_free(retstat < 0 ? blkno : blknos[k]);
+                if(journal_write(superblock.d_bitmap_blk, d_bitmap) < 0) retstat = -1;
+                pthread_mutex_unlock(&alloc_lock);
+                if(retstat < 0) {
+                    free(hashes);
+                    return -1;
+                }
+
+                // a buffered copy of the old block must not be written back over it
+                wb_discard(inode->ino, blk_indx);
+                blknos[k] = blkno;
+                done[k] = 1;
+                *map_changed = 1;
+                continue;
+            }
+        }
+
+
+        // Step 2: Any other shared block is copied before it is written
+        if(blk_shared(blknos[k])) {
+            int blkno = bmap_unshare(inode, blk_indx, blknos[k], !whole);
+            if(blkno < 0) {
+                free(hashes);
+                return -1;
+            }
+            blknos[k] = blkno;
+            *map_changed = 1;
+        }
+    }
+
+    free(hashes);
+    return 0;
+}
+
+
+/*
+ * compressed cluster operations
+ */
+// Copy the data block numbers of cluster c into ptrs, -1 for holes
+static int cluster_map(struct inode *inode, int c, int *ptrs) {
+
+    if(!c) {
+        memcpy(ptrs, inode->direct_ptr, CLUSTER_BLKS*sizeof(int));
+        return 0;
+    }
+    if(inode->indirect_ptr[c-1] < 0) {
+        for(int k = 0; k < CLUSTER_BLKS; ++k) ptrs[k] = -1;
+        return 0;
+    }
+
+    int *ptr_blk = malloc(BLOCK_SIZE);
+    if(!ptr_blk) {
+        ERROR("Failed to allocate memory");
+        return -1;
+    }
+    if(journal_read(superblock.d_start_blk + inode->indirect_ptr[c-1], ptr_blk) < 0) {
+        free(ptr_blk);
+        return -1;
+    }
+    memcpy(ptrs, ptr_blk, CLUSTER_BLKS*sizeof(int));
+    free(ptr_blk);
+    return 0;
+}
+
+// Read cluster c of a compressed file into plain (CLUSTER_SIZE bytes, zeros past the end of the file),
+// from the cluster cache if it is there, otherwise from disk into the cache
+static int cluster_load(struct inode *inode, int c, char *plain) {
+
+    int DISK_ERROR = 0;
+    int ptrs[CLUSTER_BLKS];
+
+    if(ccache_read(inode->ino, c, 0, plain, CLUSTER_SIZE)) return 0;
+    if(cluster_map(inode, c, ptrs) < 0) return -1;
+
+
+    // Step 1: Read the compressed blocks, or a cluster stored as is straight into plain,
+    // one call per run of adjacent blocks and holes as zeros
+    uint32_t clen = inode->cluster_len[c];
+    int nblks = clen ? (clen + BLOCK_SIZE - 1)/BLOCK_SIZE : CLUSTER_BLKS;
+    char *packed = clen ? malloc((size_t)nblks*BLOCK_SIZE) : plain;
+    if(!packed) {
+        ERROR("Failed to allocate memory");
+        return -1;
+    }
+
+    for(int k = 0; k < nblks; ) {
+        int run = 1;
+        if(ptrs[k] < 0) {
+            memset(packed + (size_t)k*BLOCK_SIZE, 0, BLOCK_SIZE);
+            ++k;
+            continue;
+        }
+        while(k + run < nblks && ptrs[k + run] == ptrs[k] + run) ++run;
+
+        struct iovec iov = { packed + (size_t)k*BLOCK_SIZE, (size_t)run*BLOCK_SIZE };
+        if(bio_readv(superblock.d_start_blk + ptrs[k], &iov, 1) < 0) {
+            DISK_ERROR = 1;
+            break;
+        }
+        k += run;
+    }
+
+
+    // Step 2: Inflate a compressed cluster
+    if(clen && !DISK_ERROR) {
+        uLongf plain_len = CLUSTER_SIZE;
+        if(uncompress((Bytef *)plain, &plain_len, (Bytef *)packed, clen) != Z_OK) {
+            fprintf(stderr, "inode %u: cluster %d doesn't decompress\n", inode->ino, c);
+            DISK_ERROR = 1;
+        }
+        else memset(plain + plain_len, 0, CLUSTER_SIZE - plain_len);
+    }
+    if(clen) free(packed);
+    if(DISK_ERROR) return -1;
+
+
+    ccache_put(inode->ino, c, plain);
+    return 0;
+}
+
+// Write len bytes at off into cluster c of a compressed file whose size is becoming size, or with len 0
+// just store it again cut at size. The cluster is kept compressed when that saves a block, and goes to
+// newly allocated blocks: the old ones are freed with the running journal transaction, so a crash before
+// it commits leaves the old cluster whole. The caller holds a journal handle and writes the inode.
+static int cluster_write(struct inode *inode, int c, const char *buf, int off, int len, off_t size) {
+
+    int DISK_ERROR = 0;
+    int old_ptrs[CLUSTER_BLKS];
+    int ptrs[CLUSTER_BLKS];
+    int array_blkno = -1;
+
+    off_t plain_len = size - (off_t)c*CLUSTER_SIZE;
+    if(plain_len > CLUSTER_SIZE) plain_len = CLUSTER_SIZE;
+    if(plain_len < 0) plain_len = 0;
+
+    uLongf packed_len = compressBound(CLUSTER_SIZE);
+    char *plain = malloc(CLUSTER_SIZE);
+    char *packed = malloc(packed_len);
+    if(!plain || !packed) {
+        free(plain);
+        free(packed);
+        ERROR("Failed to allocate memory");
+        return -1;
+    }
+
+
+    // Step 1: Patch the write into the cluster's contents, zeroing what now lies past the end of the file
+    if(cluster_load(inode, c, plain) < 0 || cluster_map(inode, c, old_ptrs) < 0) {
+        free(plain);
+        free(packed);
+        return -1;
+    }
+    if(len) memcpy(plain + off, buf, len);
+    memset(plain + plain_len, 0, CLUSTER_SIZE - plain_len);
+
+
+    // Step 2: Compress it, keeping the result only if it takes fewer blocks
+    int nblks = (plain_len + BLOCK_SIZE - 1)/BLOCK_SIZE;
+    uint32_t clen = 0;
+    const char *out = plain;
+    if((inode->flags & INODE_COMPRESSED) && nblks > 1
+    && compress2((Bytef *)packed, &packed_len, (Bytef *)plain, plain_len, Z_BEST_SPEED) == Z_OK
+    && (int)((packed_len + BLOCK_SIZE - 1)/BLOCK_SIZE) < nblks
+    ) {
+        clen = packed_len;
+        nblks = (clen + BLOCK_SIZE - 1)/BLOCK_SIZE;
+        memset(packed + clen, 0, (size_t)nblks*BLOCK_SIZE - clen);
+        out = packed;
+    }
+
+
+    // Step 3: Allocate its new blocks, and a pointer array for a cluster past the direct pointers that has none;
+    // if the disk is full, give back what was taken, which nothing was written to
+    int nalloc = 0;
+    int need_array = c && nblks && inode->indirect_ptr[c-1] < 0;
+    for(int k = 0; k < CLUSTER_BLKS; ++k) ptrs[k] = -1;
+    int goal = blk_goal(inode);
+    while(nalloc < nblks && (ptrs[nalloc] = get_avail_blkno(nalloc ? ptrs[nalloc-1] + 1 : goal)) >= 0) ++nalloc;
+    if(nalloc == nblks && need_array) array_blkno = get_avail_blkno(goal);
+
+    if(nalloc < nblks || (need_array && array_blkno < 0)) {
+        alloc_acquire();
+        for(int k = 0; k < nalloc; ++k) {
+            unset_bitmap(d_bitmap, ptrs[k]);
+            blk_hints_give(ptrs[k]);
+        }
+        superblock.free_blks += nalloc;
+        journal_write(superblock.d_bitmap_blk, d_bitmap);
+        pthread_mutex_unlock(&alloc_lock);
+        free(plain);
+        free(packed);
+        return -ENOSPC;
+    }
+
+
+    // Step 4: Write the blocks, one call per run of adjacent ones
+    for(int k = 0; k < nblks; ) {
+        int run = 1;
+        while(k + run < nblks && ptrs[k + run] == ptrs[k] + run) ++run;
+
+        struct iovec iov = { (void *)(out + (size_t)k*BLOCK_SIZE), (size_t)run*BLOCK_SIZE };
+        if(bio_writev(superblock.d_start_blk + ptrs[k], &iov, 1) < 0) {
+            DISK_ERROR = 1;
+            break;
+        }
+        for(int r = 0; r < run; ++r) inode_dirty_blk(inode->ino, ptrs[k] + r);
+        k += run;
+    }
+
+
+    // Step 5: Free the old blocks, or on failure the new ones
+    alloc_acquire();
+    for(int k = 0; k < CLUSTER_BLKS; ++k) {
+        int blkno = DISK_ERROR ? ptrs[k] : old_ptrs[k];
+        if(blkno >= 0) blk_free(blkno);
+    }
+    if(DISK_ERROR && array_blkno >= 0) blk_free(array_blkno);
+    if(journal_write(superblock.d_bitmap_blk, d_bitmap) < 0) DISK_ERROR = 1;
+    pthread_mutex_unlock(&alloc_lock);
+    if(DISK_ERROR) {
+        free(plain);
+        free(packed);
+        return -1;
+    }
+
+
+    // Step 6: Point the cluster at the new blocks and cache its new contents
+    if(!c) {
+        memcpy(inode->direct_ptr, ptrs, CLUSTER_BLKS*sizeof(int));
+    } else if(array_blkno >= 0 || inode->indirect_ptr[c-1] >= 0) {
+        int *ptr_blk = calloc(1, BLOCK_SIZE);
+        if(array_blkno >= 0) inode->indirect_ptr[c-1] = array_blkno;
+        if(!ptr_blk) DISK_ERROR = 1;
+        else {
+            memcpy(ptr_blk, ptrs, CLUSTER_BLKS*sizeof(int));
+            if(journal_write(superblock.d_start_blk + inode->indirect_ptr[c-1], ptr_blk) < 0) DISK_ERROR = 1;
+        }
         free(ptr_blk);
+    }
+    inode->cluster_len[c] = clen;
+    if(!DISK_ERROR) ccache_put(inode->ino, c, plain);
+    else ccache_drop(inode->ino, c);
+
+
+    free(plain);
+    free(packed);
+    if(DISK_ERROR) return -1;
+    return 0;
+}
+
+// Write a compressed file a cluster at a time, growing its size as clusters are written.
+// Returns the number of bytes written, which is short if the disk filled up.
+static int clusters_write(struct inode *inode, const char *buffer, size_t size, off_t offset) {
+
+    size_t buffer_offset = 0;
+
+    while(buffer_offset < size) {
+
+        off_t pos = offset + buffer_offset;
+        int off = pos%CLUSTER_SIZE;
+        size_t bytes = CLUSTER_SIZE - off;
+        if(bytes > size - buffer_offset) bytes = size - buffer_offset;
+        off_t end = pos + bytes > inode->size ? pos + bytes : inode->size;
+
+        int retstat = cluster_write(inode, pos/CLUSTER_SIZE, buffer + buffer_offset, off, bytes, end);
+        if(retstat < 0) {
+            if(buffer_offset) break;
+            return retstat == -ENOSPC ? -ENOSPC : -EIO;
+        }
+
+        inode->size = end;
+        inode->vstat.st_size = end;
+        buffer_offset += bytes;
+    }
+
+    return buffer_offset;
+}
+
+// Read a compressed file a cluster at a time through the cluster cache. The caller has cut size at the end of the file.
+static int clusters_read(struct inode *inode, char *buffer, size_t size, off_t offset) {
+
+    size_t buffer_offset = 0;
+    char *plain = NULL;
+
+    while(buffer_offset < size) {
+
+        off_t pos = offset + buffer_offset;
+        int c = pos/CLUSTER_SIZE;
+        int off = pos%CLUSTER_SIZE;
+        size_t bytes = CLUSTER_SIZE - off;
+        if(bytes > size - buffer_offset) bytes = size - buffer_offset;
+
+        if(!ccache_read(inode->ino, c, off, buffer + buffer_offset, bytes)) {
+            if(!plain && !(plain = malloc(CLUSTER_SIZE))) {
+                ERROR("Failed to allocate memory");
+                break;
+            }
+            if(cluster_load(inode, c, plain) < 0) break;
+            memcpy(buffer + buffer_offset, plain + off, bytes);
+        }
+        buffer_offset += bytes;
+    }
+
+    free(plain);
+    if(!buffer_offset && size) return -EIO;
+    return buffer_offset;
+}
+
+/* 
+ * directory operations
+ */
+// Look name up in an inline directory, including "." and "..". Returns 1 if found.
+static int inline_find(const struct inode *dir_inode, const char *name, struct dirent *dirent) {
+
+    size_t name_len = strlen(name);
+
+    memset(dirent, 0, sizeof(struct dirent));
+    dirent->valid = 1;
+    if(name_len >= sizeof(dirent->name)) return 0;
+    memcpy(dirent->name, name, name_len);
+
+    if(!strcmp(name, ".")) {
+        dirent->ino = dir_inode->ino;
+        return 1;
+    }
+    if(!strcmp(name, "..")) {
+        memcpy(&dirent->ino, dir_inode->inline_data, INLINE_DIR_HDR);
+        return 1;
+    }
+
+    for(uint32_t off = INLINE_DIR_HDR; off < dir_inode->size; ) {
+        const struct inline_dirent *entry = (const void *)(dir_inode->inline_data + off);
+        if(entry->name_len == name_len && !memcmp(entry->name, name, name_len)) {
+            dirent->ino = entry->ino;
+            return 1;
+        }
+        off += sizeof(struct inline_dirent) + entry->name_len;
+    }
+    return 0;
+}
+
+// Append an entry to an inline directory in memory. Returns -1 if it doesn't fit.
+static int inline_add(struct inode *dir_inode, uint16_t f_ino, const char *name) {
+
+    size_t name_len = strlen(name);
+    size_t entsize = sizeof(struct inline_dirent) + name_len;
+
+    if(name_len >= sizeof(((struct dirent *)0)->name) || dir_inode->size + entsize > INLINE_MAX) return -1;
+
+    struct inline_dirent *entry = (void *)(dir_inode->inline_data + dir_inode->size);
+    entry->ino = f_ino;
+    entry->name_len = name_len;
+    memcpy(entry->name, name, name_len);
+
+    dir_inode->size += entsize;
+    dir_inode->vstat.st_size = dir_inode->size;
+    return 0;
+}
+
+// Take an entry out of an inline directory in memory, closing the gap. Returns -1 if it isn't there.
+static int inline_remove(struct inode *dir_inode, const char *name) {
+
+    size_t name_len = strlen(name);
+
+    for(uint32_t off = INLINE_DIR_HDR; off < dir_inode->size; ) {
+        struct inline_dirent *entry = (void *)(dir_inode->inline_data + off);
+        size_t entsize = sizeof(struct inline_dirent) + entry->name_len;
+
+        if(entry->name_len == name_len && !memcmp(entry->name, name, name_len)) {
+            memmove(dir_inode->inline_data + off, dir_inode->inline_data + off + entsize, dir_inode->size - off - entsize);
+            dir_inode->size -= entsize;
+            memset(dir_inode->inline_data + dir_inode->size, 0, entsize);
+            dir_inode->vstat.st_size = dir_inode->size;
+            return 0;
+        }
+        off += entsize;
+    }
+    return -1;
+}
+
+struct spill_ctx {
+    struct dirent *dirents;
+    int n;
+};
+
+static int spill_collect(const struct dirent *dirent, void *arg) {
+
+    struct spill_ctx *ctx = arg;
+
+    memcpy(&ctx->dirents[ctx->n++], dirent, sizeof(struct dirent));
+    return 0;
+}
+
+// Move an inline directory's entries, with "." and "..", out to dirent blocks once another entry
+// doesn't fit. The entries fill fewer blocks than there are direct pointers.
+// The caller holds a journal handle; the inode is written back in block form. Returns 0, -ENOSPC or -1.
+static int dir_spill(struct inode *dir_inode) {
+
+    int DISK_ERROR = 0;
+    int NO_SPACE = 0;
+
+    struct spill_ctx ctx = { .n = 0 };
+    ctx.dirents = calloc(2 + INLINE_MAX/sizeof(struct inline_dirent), sizeof(struct dirent));
+    struct dirent *dirent_blk = malloc(BLOCK_SIZE);
+    if(!ctx.dirents
+    || !dirent_blk
+    ) {
+        if(ctx.dirents) free(ctx.dirents);
+        if(dirent_blk)  free(dirent_blk);
+        ERROR("Failed to allocate memory");
+        return -1;
+    }
+
+
+    // Step 1: Collect the entries and turn the pointer area back into an empty block map,
+    // clearing the rest of the inline bytes as inline_promote() does
+    if(dir_iterate(dir_inode, spill_collect, &ctx) < 0) {
+        free(ctx.dirents);
+        free(dirent_blk);
         return -1;
     }
+    dir_inode->flags &= ~INODE_INLINE;
+    for(int i = 0; i < 8; ++i) {
+        dir_inode->direct_ptr[i] = -1;
+        dir_inode->direct_ptr[15-i] = -1;
+        dir_inode->indirect_ptr[i] = -1;
+    }
+    memset(dir_inode->cluster_len, 0, sizeof(dir_inode->cluster_len));
+    memset(dir_inode->unwritten, 0, sizeof(dir_inode->unwritten));
+    dir_inode->size = 0;
+
+
+    // Step 2: Write them out a block at a time
+    for(int j = 0; j*dirents_per_blk < ctx.n; ++j) {
+
+        int blkno = get_avail_blkno(blk_goal(dir_inode));
+        if(blkno < 0) {
+            NO_SPACE = 1;
+            DISK_ERROR = 1;
+            break;
+        }
+
+        int cnt = ctx.n - j*dirents_per_blk < dirents_per_blk ? ctx.n - j*dirents_per_blk : dirents_per_blk;
+        memset(dirent_blk, 0, BLOCK_SIZE);
+        memcpy(dirent_blk, &ctx.dirents[j*dirents_per_blk], cnt*sizeof(struct dirent));
+        dir_inode->direct_ptr[j] = blkno;
+        if(journal_write(superblock.d_start_blk + blkno, dirent_blk) < 0) {
+            DISK_ERROR = 1;
+            break;
+        }
+
+        dir_inode->size += BLOCK_SIZE;
+    }
+    dir_inode->vstat.st_size = dir_inode->size;
+    dir_inode->vstat.st_blocks = dir_inode->size/BLOCK_SIZE;
+
+
+    // Step 3: Write the inode in block form
+    if(!DISK_ERROR && writei(dir_inode->ino, dir_inode) < 0) DISK_ERROR = 1;
+
+    // the inode wasn't written in block form, so nothing links the blocks written so far
+    if(DISK_ERROR) {
+        alloc_acquire();
+        for(int j = 0; j < 16 && dir_inode->direct_ptr[j] >= 0; ++j) blk_free(dir_inode->direct_ptr[j]);
+        if(journal_write(superblock.d_bitmap_blk, d_bitmap) < 0) ERROR("Failed to write to disk");
+        pthread_mutex_unlock(&alloc_lock);
+    }
+
+
+    free(ctx.dirents);
+    free(dirent_blk);
+    if(DISK_ERROR) return NO_SPACE ? -ENOSPC : -1;
+    return 0;
+}
+
+int dir_find(uint16_t ino, const char *fname, size_t name_len, struct dirent *dirent) {
+
+    int DISK_ERROR = 0;
+    int FOUND = 0;
+    int STOP = 0;
+
+    char delim [2] = "/";
+    char *fname_CPY1 = strdup(fname);
+    char *fname_CPY2 = strdup(fname);
+    struct inode inode = {0};
+    struct dirent *dirent_blk = malloc(BLOCK_SIZE);
+    int *ptr_blk = calloc(1, BLOCK_SIZE);
+
+    // Step 1: Call readi() to get the inode using ino (inode number of current directory)
+    // Step 2: Get data block of current directory from inode
+    if(!fname_CPY1
+    || !fname_CPY2
+    || !dirent_blk
+    || !ptr_blk
+   ) {
+        if(fname_CPY1)  free(fname_CPY1);
+        if(fname_CPY2)  free(fname_CPY2);
+        if(dirent_blk)  free(dirent_blk);
+        if(ptr_blk)     free(ptr_blk);
+        ERROR("Failed to allocate memory");
+        return -1;
+    }
+    // get parent directory
+    char *f_basename = basename(fname_CPY2);
+
+
+    // Step 3: Read directory's data block and check each directory entry.
+    // If the name matches, then copy directory entry to dirent structure
+    if(fname[0] == '/'
+    && readi(0, &inode) < 0
+    ) {
+        free(fname_CPY1);
+        free(fname_CPY2);
+        free(dirent_blk);
+        free(ptr_blk);
+        return -1;
+    } else if(readi(ino, &inode) < 0) {
+        free(fname_CPY1);
+        free(fname_CPY2);
+        free(dirent_blk);
+        free(ptr_blk);
+        return -1;
+    }
+
+    char *save = NULL;
+    for(char *path = strtok_r(fname_CPY1, delim, &save); path != NULL; path = strtok_r(NULL, delim, &save)) {
+
+        // reset found to 0
+        FOUND = 0;
+        STOP = 0;
+
+        // an inline directory's entries are in the inode itself
+        if(inode.flags & INODE_INLINE) {
+            struct dirent found = {0};
+            if(!inline_find(&inode, path, &found)) break;
+
+            // if the basename has been found
+            if(!strcmp(path, f_basename)) memcpy(dirent, &found, sizeof(struct dirent));
+
+            readi(found.ino, &inode);
+            FOUND = 1;
+            continue;
+        }
+
+        // search inode for directory/subdirectory
+        memcpy(ptr_blk, inode.direct_ptr, sizeof(inode.direct_ptr));
+        for(int i = -1; i < 8; ) {
+            for(int j = 0; j < 16; ++j) {
+
+                // if unused section of direct array has been reached
+                if(ptr_blk[j] < 0) {
+                    STOP = 1;
+                    break;
+                }
+
+                // read block from the direct array entry
+                if(journal_read((superblock.d_start_blk + ptr_blk[j]), dirent_blk) < 0) {
+                    DISK_ERROR = 1;
+                    break;
+                }
+
+                // search block for the directory/subdirectory entry
+                for(int k = 0; k < dirents_per_blk; ++k) {
+
+                    // if we reached unused section of directory entry block
+                    if(!dirent_blk[k].valid) break;
+
+                    // if the directory entry matches the directory/subdirectory name
+                    if(!strcmp(path, dirent_blk[k].name)) {
+
+                        // if the basename has been found
+                        if(!strcmp(path, f_basename)) memcpy(dirent, &dirent_blk[k], sizeof(struct dirent));
+
+                        // read inode
+                        readi(dirent_blk[k].ino, &inode);
+
+                        // set found to 1 and exit loop
+                        FOUND = 1;
+                        break;
+                    }
+                }
+
+                // if directory/subdirectory has been found
+                if(FOUND) break;
+            }
+
+            // if the directory/subdirectory has been found or if a disk error occurred
+            if(FOUND || STOP || DISK_ERROR) break;
+
+            // if we haven't checked all indirect array entries
+            if((++i) < 8) {
+
+                // if the unused pointer section of the indirect pointer array has been reached
+                if(inode.indirect_ptr[i] < 0) break;
+
+                // read array block from the indirect array entry
+                if(journal_read((superblock.d_start_blk + inode.indirect_ptr[i]), ptr_blk) < 0) {
+                    DISK_ERROR = 1;
+                    break;
+                }
+            }
+        }
+
+        // if directory/subdirectory has not been found
+        if(!FOUND) break;
+    }
+
+
+    free(fname_CPY1);
+    free(fname_CPY2);
+    free(dirent_blk);
+    free(ptr_blk);
+    if(DISK_ERROR) {
+        ERROR("Failed to find directory");
+        return -1;
+    }
+    if(!FOUND) {
+        ERROR("Directory doesn't exist");
+        return -1;
+    }
+	return 0;
+}
+
+int dir_add(struct inode dir_inode, uint16_t f_ino, const char *fname, size_t name_len) {
+
+    int DISK_ERROR = 0;
+    int NO_SPACE = 0;
+    int DIRECTORY_ADDED = 0;
+    int new_blks[2];                /* blocks allocated here, freed again if the entry isn't added */
+    int n_new = 0;
+
+    // node_create() and node_rename() refuse longer names; this keeps the strcpy() below in bounds
+    if(strlen(fname) >= sizeof(((struct dirent *)0)->name)) return -1;
+
+    char *fname_CPY1 = strdup(fname);
+    char *fname_CPY2 = strdup(fname);
+    struct dirent dirent = {0};
+    struct dirent *dirent_blk = malloc(BLOCK_SIZE);
+    int *ptr_blk = calloc(1, BLOCK_SIZE);
+    if(!fname_CPY1
+    || !fname_CPY2
+    || !dirent_blk
+    || !ptr_blk
+    ) {
+        if(fname_CPY1)  free(fname_CPY1);
+        if(fname_CPY2)  free(fname_CPY2);
+        if(dirent_blk)  free(dirent_blk);
+        if(ptr_blk)     free(ptr_blk);
+        ERROR("Failed to allocate memory.");
+        return -1;
+    }
+    // get directory/file basename
+    char *f_basename = basename(fname_CPY1);
+    // get parent directory name
+    char *f_dirname = dirname(fname_CPY2);
+    struct dirent f_dirent = { .valid = 1, .ino = f_ino };
+    strcpy(f_dirent.name, fname);
+
+
+    // Step 1: Read dir_inode's data block and check each directory entry of dir_inode
+	// Step 2: Check if fname (directory name) is already used in other entries
+
+    // If dir_inode isn't already the current directory
+    if(strcmp(fname, "/")
+    && strcmp(fname, ".")
+    && !((dir_inode.ino == 0) && (strcmp(fname, "..")))
+    ) {
+        // get directory inode
+        if(dir_find(dir_inode.ino, f_dirname, strlen(f_dirname), &dirent)) {
+            free(fname_CPY1);
+            free(fname_CPY2);
+            free(dirent_blk);
+            free(ptr_blk);
+            return -1;
+        }
+        readi(dirent.ino, &dir_inode);
+    }
+
+
+    // check if a directory of the same name already exists
+    if(!dir_find(dir_inode.ino, f_basename, strlen(f_basename), &dirent)) {
+        ERROR("Directory already exists");
+        free(fname_CPY1);
+        free(fname_CPY2);
+        free(dirent_blk);
+        free(ptr_blk);
+        return -1;
+    }
+
+
+    // an inline directory takes the entry in its inode if there's room,
+    // otherwise its entries move out to blocks and the entry is added below
+    if(dir_inode.flags & INODE_INLINE) {
+        if(!inline_add(&dir_inode, f_ino, f_basename)) {
+            if(writei(dir_inode.ino, &dir_inode) < 0) DISK_ERROR = 1;
+            else inode_dirty(dir_inode.ino, 1);
+            DIRECTORY_ADDED = 1;
+        }
+        else {
+            int spilled = dir_spill(&dir_inode);
+            if(spilled < 0) {
+                NO_SPACE = spilled == -ENOSPC;
+                DISK_ERROR = 1;
+            }
+        }
+    }
+
+
+	// Step 3: Add directory entry in dir_inode's data block and write to disk
+	// Allocate a new data block for this directory if it does not exist
+	// Update directory inode
+	// Write directory entry
+    memcpy(ptr_blk, dir_inode.direct_ptr, sizeof(dir_inode.direct_ptr));
+    for(int i = -1; i < 8 && !DIRECTORY_ADDED && !DISK_ERROR; ) {
+        for(int j = 0; j < 16; ++j) {
+
+            // if array is not in use
+            if(ptr_blk[j] < 0)  {
+
+                // clear dirent block
+                memset(dirent_blk, 0, BLOCK_SIZE);
+
+                // set array entry to a new data block
+                ptr_blk[j] = get_avail_blkno(blk_goal(&dir_inode));
+
+                // if we failed to get a new data block
+                if(ptr_blk[j] < 0) {
+                    NO_SPACE = 1;
+                    DISK_ERROR = 1;
+                    break;
+                }
+                new_blks[n_new++] = ptr_blk[j];
+
+                // copy dirent entry into first spot of dirent block
+                memcpy(&dirent_blk[0], &f_dirent, sizeof(struct dirent));
+
+                // a directory's size counts its dirent blocks, as dir_spill() and defrag_dir() set it
+                dir_inode.size += BLOCK_SIZE;
+                dir_inode.vstat.st_size += BLOCK_SIZE;
+                dir_inode.vstat.st_blocks++;
+            }
+            // array is in use
+            else {
+
+                // read block from pointer array entry
+                journal_read(superblock.d_start_blk + ptr_blk[j], dirent_blk);
+
+                // search the directory entry block
+                for(int k = 0; k < dirents_per_blk; ++k) {
+
+                    // if the entry is not in use
+                    if(!dirent_blk[k].valid) {
+
+                        // add the directory entry to the directory entry block
+                        memcpy(&dirent_blk[k], &f_dirent, sizeof(struct dirent));
+
+                        DIRECTORY_ADDED = 1;
+                        break;
+                    }
+                }
+
+                // if the directory was not added, go to next iteration
+                if(!DIRECTORY_ADDED) continue;
+            }
+
+            // write directory entry to disk
+            if(journal_write((superblock.d_start_blk + ptr_blk[j]), dirent_blk) < 0) {
+                DISK_ERROR = 1;
+                break;
+            }
+
+            // if it's a direct pointer array, copy the pointer array block to the direct pointer array
+            if(i < 0) memcpy(dir_inode.direct_ptr, ptr_blk, sizeof(dir_inode.direct_ptr));
+            // else write pointer array block to disk
+            else if(journal_write((superblock.d_start_blk + dir_inode.indirect_ptr[i]), ptr_blk) < 0) {
+                DISK_ERROR = 1;
+                break;
+            }
+
+            // update directory inode
+            if(writei(dir_inode.ino, &dir_inode) < 0) {
+                DISK_ERROR = 1;
+                break;
+            }
+            inode_dirty(dir_inode.ino, 1);
+
+
+            DIRECTORY_ADDED = 1;
+            break;
+        }
+
+        // if the directory has been added or if a disk error occurred
+        if(DIRECTORY_ADDED || DISK_ERROR) break;
+
+        // if we haven't checked all indirect array entries
+        // else, all directory entries are in use
+        if((++i) < 8) {
+
+            // if indirect array entry is unused
+            if(dir_inode.indirect_ptr[i] < 0) {
+
+                // get available data block address
+                int array_blkno = get_avail_blkno(blk_goal(&dir_inode));
+                if(array_blkno < 0) {
+                    NO_SPACE = 1;
+                    DISK_ERROR = 1;
+                    break;
+                }
+                new_blks[n_new++] = array_blkno;
+
+                // set unused entries to -1, all of them, since freeing the directory walks the whole array
+                for(int j = 0; j < PTRS_PER_BLK; ++j) ptr_blk[j] = -1;
+
+                // set indirect pointer entry to pointer array block number
+                dir_inode.indirect_ptr[i] = array_blkno;
+
+                // write the fresh pointer array so it can be read back below
+                if(journal_write((superblock.d_start_blk + array_blkno), ptr_blk) < 0) {
+                    DISK_ERROR = 1;
+                    break;
+                }
+            }
+
+            // read pointer array block from the indirect array entry
+            if(journal_read((superblock.d_start_blk + dir_inode.indirect_ptr[i]), ptr_blk) < 0) {
+                DISK_ERROR = 1;
+                break;
+            }
+        } else {
+            ERROR("All directory entries are in use");
+            NO_SPACE = 1;
+            DISK_ERROR = 1;
+        }
+    }
+
+
+    // the directory's inode wasn't written, so nothing links the blocks allocated for it
+    if(DISK_ERROR && n_new) {
+        alloc_acquire();
+        for(int k = 0; k < n_new; ++k) blk_free(new_blks[k]);
+        if(journal_write(superblock.d_bitmap_blk, d_bitmap) < 0) ERROR("Failed to write to disk");
+        pthread_mutex_unlock(&alloc_lock);
+    }
+
+
+    free(fname_CPY1);
+    free(fname_CPY2);
+    free(dirent_blk);
+    free(ptr_blk);
+    if(DISK_ERROR) {
+        ERROR("Failed to make directory");
+        return NO_SPACE ? -ENOSPC : -1;
+    }
+	return 0;
+}
+
+int dir_remove(struct inode dir_inode, const char *fname, size_t name_len) {
+
+    int DISK_ERROR = 0;
+    int DIRECTORY_REMOVED = 0;
+
+    char *fname_CPY1 = strdup(fname);
+    char *fname_CPY2 = strdup(fname);
+    struct dirent dirent = {0};
+    struct dirent *dirent_blk = malloc(BLOCK_SIZE);
+    int *ptr_blk = calloc(1, BLOCK_SIZE);
+    if(!fname_CPY1
+    || !fname_CPY2
+    || !dirent_blk
+    || !ptr_blk
+    ) {
+        if(fname_CPY1)  free(fname_CPY1);
+        if(fname_CPY2)  free(fname_CPY2);
+        if(dirent_blk)  free(dirent_blk);
+        if(ptr_blk)     free(ptr_blk);
+        ERROR("Failed to allocate memory.");
+    }
+    // get directory/file basename
+    char *f_basename = basename(fname_CPY1);
+    // get parent directory
+    char *f_dirname = dirname(fname_CPY2);
+
+	// Step 1: Read dir_inode's data block and checks each directory entry of dir_inode
+	// Step 2: Check if fname exist
+    if(dir_find(dir_inode.ino, f_dirname, strlen(f_dirname), &dirent)) {
+        fprintf(stderr, "Could not open %s\n", f_dirname);
+        free(fname_CPY1);
+        free(fname_CPY2);
+        free(dirent_blk);
+        free(ptr_blk);
+        return -1;
+    }
+
+    readi(dirent.ino, &dir_inode);
+    if(dir_find(dir_inode.ino, f_basename, strlen(f_basename), &dirent)) {
+        ERROR("Directory doesn't exists");
+        free(fname_CPY1);
+        free(fname_CPY2);
+        free(dirent_blk);
+        free(ptr_blk);
+        return -1;
+    }
+
+
+    // an inline directory drops the entry from its inode
+    if(dir_inode.flags & INODE_INLINE) {
+        if(!inline_remove(&dir_inode, f_basename)) {
+            if(writei(dir_inode.ino, &dir_inode) < 0) DISK_ERROR = 1;
+            else inode_dirty(dir_inode.ino, 1);
+            DIRECTORY_REMOVED = 1;
+        }
+    }
+
+
+	// Step 3: If exist, then remove it from dir_inode's data block and write to disk
+    memcpy(ptr_blk, dir_inode.direct_ptr, sizeof(dir_inode.direct_ptr));
+    for(int i = -1; i < 8 && !(dir_inode.flags & INODE_INLINE); ) {
+        for(int j = 0; j < 16; ++j) {
+
+            // if we reached unused section of the pointer array
+            if(ptr_blk[j] < 0) break;
+
+            // read the directory entry block from the pointer array entry
+            if(journal_read(superblock.d_start_blk + ptr_blk[j], dirent_blk) < 0) {
+                DISK_ERROR = 1;
+                break;
+            }
+
+            // check directory entry block for the directory we want to remove
+            for(int k = 0; k < dirents_per_blk; ++k) {
+
+                // if we reached unused section of directory entry block
+                if(!dirent_blk[k].valid) break;
+
+                // if the directory entry matches the directory we want to remove
+                if(!strcmp(dirent_blk[k].name, f_basename)) {
+
+                    // shift the valid entries after it down by one so the block stays packed
+                    int l = k+1;
+                    for(; l < dirents_per_blk; ++l) {
+                        if(!dirent_blk[l].valid) break;
+                        memcpy(&dirent_blk[l-1], &dirent_blk[l], sizeof(struct dirent));
+                    }
+
+                    // invalidate the last entry of the block, which is now a duplicate or the removed entry
+                    memset(&dirent_blk[l-1], 0, sizeof(struct dirent));
+
+                    // write directory entry block back to disk
+                    // (an emptied block stays linked and is reused by dir_add())
+                    if(journal_write(superblock.d_start_blk + ptr_blk[j], dirent_blk) < 0) {
+                        DISK_ERROR = 1;
+                        break;
+                    }
+                    inode_dirty(dir_inode.ino, 1);
+
+
+                    DIRECTORY_REMOVED = 1;
+                    break;
+                }
+            }
+
+            // if the directory has been removed or if a disk error occurred
+            if(DIRECTORY_REMOVED || DISK_ERROR) break;
+        }
+
+        // if the directory has been removed or if a disk error occurred
+        if(DIRECTORY_REMOVED || DISK_ERROR) break;
+
+        // if we haven't checked all indirect array entries
+        // else, all directory entries are in use
+        if((++i) < 8) {
+
+            // if the unused section of the indirect array has been reached, break outer loop
+            if(dir_inode.indirect_ptr[i] < 0) break;
+
+            // read pointer array block from the indirect array entry
+            if(journal_read((superblock.d_start_blk + dir_inode.indirect_ptr[i]), ptr_blk) < 0) {
+                DISK_ERROR = 1;
+                break;
+            }
+        } else {
+            ERROR("Directory to remove not found");
+        }
+    }
+
+    free(fname_CPY1);
+    free(fname_CPY2);
+    free(dirent_blk);
+    free(ptr_blk);
+    if(DISK_ERROR) {
+        ERROR("Failed to remove directory");
+        return -1;
+    }
+    if(!DIRECTORY_REMOVED) {
+        ERROR("Directory doesn't exists");
+        return -1;
+    }
+	return 0;
+}
+
+int dir_is_empty(struct inode *dir_inode) {
+
+    int DISK_ERROR = 0;
+    int EMPTY = 1;
+
+    // an inline directory holds nothing but its header when empty
+    if(dir_inode->flags & INODE_INLINE) return dir_inode->size <= INLINE_DIR_HDR;
+
+    struct dirent *dirent_blk = malloc(BLOCK_SIZE);
+    int *ptr_blk = malloc(BLOCK_SIZE);
+    if(!dirent_blk
+    || !ptr_blk
+    ) {
+        if(dirent_blk)  free(dirent_blk);
+        if(ptr_blk)     free(ptr_blk);
+        ERROR("Failed to allocate memory");
+        return -1;
+    }
+
+
+    // look for any entry besides "." and ".."
+    memcpy(ptr_blk, dir_inode->direct_ptr, sizeof(dir_inode->direct_ptr));
+    for(int i = -1; i < 8; ) {
+        for(int j = 0; j < 16; ++j) {
+
+            // if we reached unused section of the pointer array
+            if(ptr_blk[j] < 0) break;
+
+            if(journal_read(superblock.d_start_blk + ptr_blk[j], dirent_blk) < 0) {
+                DISK_ERROR = 1;
+                break;
+            }
+
+            for(int k = 0; k < dirents_per_blk; ++k) {
+
+                // if we reached unused section of directory entry block
+                if(!dirent_blk[k].valid) break;
+
+                if(strcmp(dirent_blk[k].name, ".")
+                && strcmp(dirent_blk[k].name, "..")
+                ) {
+                    EMPTY = 0;
+                    break;
+                }
+            }
+
+            if(!EMPTY) break;
+        }
+
+        if(!EMPTY || DISK_ERROR) break;
+
+        // if we haven't checked all indirect array entries
+        if((++i) < 8) {
+
+            // if the unused section of the indirect array has been reached, break outer loop
+            if(dir_inode->indirect_ptr[i] < 0) break;
+
+            if(journal_read((superblock.d_start_blk + dir_inode->indirect_ptr[i]), ptr_blk) < 0) {
+                DISK_ERROR = 1;
+                break;
+            }
+        }
+    }
+
+
+    free(dirent_blk);
+    free(ptr_blk);
+    if(DISK_ERROR) return -1;
+    return EMPTY;
+}
+
+// Call fn on each valid entry of the directory in order until it returns nonzero
+int dir_iterate(struct inode *dir_inode, int (*fn)(const struct dirent *dirent, void *arg), void *arg) {
+
+    int DISK_ERROR = 0;
+    int STOP = 0;
+
+    // an inline directory's entries come from the inode, after "." and ".."
+    if(dir_inode->flags & INODE_INLINE) {
+        struct dirent dirent = { .valid = 1, .ino = dir_inode->ino, .name = "." };
+        if(fn(&dirent, arg)) return 0;
+
+        memcpy(&dirent.ino, dir_inode->inline_data, INLINE_DIR_HDR);
+        strcpy(dirent.name, "..");
+        if(fn(&dirent, arg)) return 0;
+
+        for(uint32_t off = INLINE_DIR_HDR; off < dir_inode->size; ) {
+            const struct inline_dirent *entry = (const void *)(dir_inode->inline_data + off);
+            if(entry->name_len >= sizeof(dirent.name)) return -1;
+            memset(dirent.name, 0, sizeof(dirent.name));
+            memcpy(dirent.name, entry->name, entry->name_len);
+            dirent.ino = entry->ino;
+            if(fn(&dirent, arg)) return 0;
+            off += sizeof(struct inline_dirent) + entry->name_len;
+        }
+        return 0;
+    }
+
+    struct dirent *dirent_blk = malloc(BLOCK_SIZE);
+    int *ptr_blk = malloc(BLOCK_SIZE);
+    if(!dirent_blk
+    || !ptr_blk
+    ) {
+        if(dirent_blk)  free(dirent_blk);
+        if(ptr_blk)     free(ptr_blk);
+        ERROR("Failed to allocate memory");
+        return -1;
+    }
+
+
+    memcpy(ptr_blk, dir_inode->direct_ptr, sizeof(dir_inode->direct_ptr));
+    for(int i = -1; i < 8; ) {
+        for(int j = 0; j < 16; ++j) {
+
+            // if we reached unused section of the pointer array
+            if(ptr_blk[j] < 0) break;
+
+            if(journal_read(superblock.d_start_blk + ptr_blk[j], dirent_blk) < 0) {
+                DISK_ERROR = 1;
+                break;
+            }
+
+            for(int k = 0; k < dirents_per_blk; ++k) {
+
+                // if we reached unused section of directory entry block
+                if(!dirent_blk[k].valid) break;
+
+                if(fn(&dirent_blk[k], arg)) {
+                    STOP = 1;
+                    break;
+                }
+            }
+
+            if(STOP) break;
+        }
+
+        if(STOP || DISK_ERROR) break;
+
+        // if we haven't checked all indirect array entries
+        if((++i) < 8) {
+
+            // if the unused section of the indirect array has been reached, break outer loop
+            if(dir_inode->indirect_ptr[i] < 0) break;
+
+            if(journal_read((superblock.d_start_blk + dir_inode->indirect_ptr[i]), ptr_blk) < 0) {
+                DISK_ERROR = 1;
+                break;
+            }
+        }
+    }
+
+
+    free(dirent_blk);
+    free(ptr_blk);
+    if(DISK_ERROR) return -1;
+    return 0;
+}
+
+// Returns 1 for the root's entry of the snapshot directory, which listings leave out
+// so that copying or archiving the file system doesn't descend into every snapshot
+int dir_hidden(const struct dirent *dirent) {
+
+    return superblock.snap_ino && dirent->ino == superblock.snap_ino && !strcmp(dirent->name, SNAP_DIR_NAME);
+}
+
+/* 
+ * namei operation
+ */
+int get_node_by_path(const char *path, uint16_t ino, struct inode *inode) {
+
+    struct dirent dirent = {0};
+    char name[sizeof(dirent.name)];
+    size_t len;
+
+	// Step 1: Resolve the path name, walk through path, and finally, find its inode.
+	// Note: You could either implement it in a iterative way or recursive way
+
+    // one component at a time, each directory locked shared while it is searched; the root has no entry of its own
+    for(const char *p = path + strspn(path, "/"); *p; p += len + strspn(p + len, "/")) {
+        len = strcspn(p, "/");
+        if(len >= sizeof(name)) return -1;
+        memcpy(name, p, len);
+        name[len] = '\0';
+
+        uint16_t dir = dirent.ino;
+        inode_lock(dir, 0);
+        int retstat = dir_find(dir, name, len, &dirent);
+        inode_unlock(dir);
+        if(retstat < 0) return -1;
+    }
+    if(readi(dirent.ino, inode) < 0) return -1;
+
+
+	return 0;
+}
+
+/*
+ * superblock operations
+ */
+int write_superblock() {
+
+    void *blk = calloc(1, BLOCK_SIZE);
+    if(!blk) {
+        ERROR("Failed to allocate memory");
+        return -1;
+    }
+
+    // the superblock only occupies the head of block 0
+    memcpy(blk, &superblock, sizeof(struct superblock));
+    if(journal_write(0, blk) < 0) {
+        free(blk);
+        return -1;
+    }
+
+
+    free(blk);
+    return 0;
+}
+
+/*
+ * orphan operations
+ */
+int orphan_add(uint16_t ino) {
+
+    alloc_acquire();
+
+    // Step 1: Append the inode to the superblock's orphan list and persist it,
+    // so a crash before reclaim still frees the inode on the next mount
+    superblock.orphans[superblock.orphan_cnt++] = ino;
+    if(write_superblock() < 0) {
+        superblock.orphan_cnt--;
+        pthread_mutex_unlock(&alloc_lock);
+        return -1;
+    }
+
+
+    // Step 2: Wake the reclaim thread
+    pthread_cond_signal(&reclaim_cond);
+    pthread_mutex_unlock(&alloc_lock);
+    return 0;
+}
+
+// Once a commit has made the frees in it durable, the blocks they released can hold file data again
+static void pending_postcommit() {
+
+    pthread_mutex_lock(&alloc_lock);
+    memset(d_pending, 0, sizeof(d_pending));
+    pthread_mutex_unlock(&alloc_lock);
+}
+
+/*
+ * Free an orphaned inode's data blocks, pointer array blocks and inode number in the in-memory bitmaps.
+ * The caller holds alloc_lock and writes the bitmaps to disk.
+ */
+int reclaim_inode(uint16_t ino) {
+
+    struct inode inode = {0};
+    struct inode clean_inode = {0};
+
+
+    // Step 1: Read the inode, skipping one a previous reclaim already cleared before a crash
+    if(readi(ino, &inode) < 0) return -1;
+    if(!inode.valid) {
+        if(get_bitmap(i_bitmap, ino)) ++superblock.free_inodes;
+        unset_bitmap(i_bitmap, ino);
+        hint_give(&superblock.group[ino_group(ino)].ino_hint, ino);
+        return 0;
+    }
+
+
+    // Step 2: Clear the inode on disk before its blocks are released,
+    // so a crash in between leaks blocks instead of freeing them twice
+    if(writei(ino, &clean_inode) < 0) return -1;
+
+
+    // Step 3: Clear data block bitmap of every block in the block map, including blocks past holes
+    if(bmap_free(&inode, 0) < 0) return -1;
+
+
+    // Step 4: Clear inode bitmap and drop the inode's unsynced state
+    if(get_bitmap(i_bitmap, ino)) ++superblock.free_inodes;
+    unset_bitmap(i_bitmap, ino);
+    hint_give(&superblock.group[ino_group(ino)].ino_hint, ino);
+    inode_forget(ino);
+
+
+    return 0;
+}
+
+// Move orphans the kernel still holds references to to the front of the orphan list and
+// return how many at the tail can be reclaimed now. Caller holds alloc_lock.
+static int orphans_ready() {
+
+    int busy = 0;
+
+    pthread_mutex_lock(&state_lock);
+    for(uint32_t i = 0; i < superblock.orphan_cnt; ++i) {
+        uint16_t ino = superblock.orphans[i];
+        if(!inode_states[ino].nlookup) continue;
+        superblock.orphans[i] = superblock.orphans[busy];
+        superblock.orphans[busy++] = ino;
+    }
+    pthread_mutex_unlock(&state_lock);
+
+    return superblock.orphan_cnt - busy;
+}
+
+void *reclaim_worker(void *arg) {
+
+    struct timespec deadline;
+
+    // only reclaiming needs the bitmaps, so waiting for orphans doesn't read them in
+    pthread_mutex_lock(&alloc_lock);
+    while(!reclaim_stop) {
+
+        int DISK_ERROR = 0;
+
+
+        // Step 1: Sleep until unlink/rmdir queues an orphan that isn't still open (or the interval passes)
+        if(!orphans_ready()) {
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += RECLAIM_INTERVAL;
+            pthread_cond_timedwait(&reclaim_cond, &alloc_lock, &deadline);
+            continue;
+        }
+
+
+        // Step 2: Open a journal handle so the batch commits as one transaction
+        // (taken before alloc_lock, the same order FUSE operations use)
+        pthread_mutex_unlock(&alloc_lock);
+        journal_begin();
+        alloc_acquire();
+
+
+        // Step 3: Reclaim a batch from the tail of the orphan list
+        int ready = orphans_ready();
+        int batch = ready < RECLAIM_BATCH ? ready : RECLAIM_BATCH;
+        int reclaimed = 0;
+        for(; reclaimed < batch; ++reclaimed) {
+            if(reclaim_inode(superblock.orphans[superblock.orphan_cnt - reclaimed - 1]) < 0) break;
+        }
+
+
+        // Step 4: Persist the freed blocks, then drop the batch from the orphan list.
+        // The inode bitmap goes last so an inode number isn't reused while still listed as an orphan
+        if(journal_write(superblock.d_bitmap_blk, d_bitmap) < 0) {
+            DISK_ERROR = 1;
+        } else {
+            superblock.orphan_cnt -= reclaimed;
+            if(write_superblock() < 0
+            || journal_write(superblock.i_bitmap_blk, i_bitmap) < 0
+            ) {
+                DISK_ERROR = 1;
+            }
+        }
+        pthread_mutex_unlock(&alloc_lock);
+        journal_end();
+
+        // if the batch didn't fully go through, retry after the interval instead of spinning
+        if(DISK_ERROR || reclaimed < batch) {
+            ERROR("Failed to reclaim orphaned inodes");
+            alloc_acquire();
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += RECLAIM_INTERVAL;
+            pthread_cond_timedwait(&reclaim_cond, &alloc_lock, &deadline);
+            continue;
+        }
+
+
+        // Step 5: Commit the batch, after which its freed blocks may hold file data (see pending_postcommit())
+        journal_commit();
+        alloc_acquire();
+    }
+    pthread_mutex_unlock(&alloc_lock);
+
+
+    return NULL;
+}
+
+/* 
+ * Make file system
+ */
+int tfs_mkfs() {
+
+    int DISK_ERROR = 0;
+    void *blk = calloc(1, BLOCK_SIZE);
+    if(!blk) {
+        ERROR("Failed to allocate memory");
+        return -1;
+    }
+
+	// Call dev_init() to initialize (Create) Diskfile
+    dev_init(diskfile_path);
+
+
+	// lay out the superblock with every block group (mkfs.tfs formats with fewer)
+    mkfs_layout(&superblock, BLOCK_GROUPS);
+
+
+    // initialize the journal region (the journal isn't running yet, so mkfs writes go straight to disk)
+    if(journal_format(superblock.j_start_blk, superblock.j_blks) < 0) {
+        free(blk);
+        return -1;
+    }
+
+
+    // update inode for root directory, which starts out inline and is its own parent
+    struct inode root_inode = {
+        .ino = 0,
+        .valid = 1,
+        .size = INLINE_DIR_HDR,
+        .type = directory,
+        .link = 2,
+        .flags = INODE_INLINE,
+        .vstat = {
+                .st_ino = 0,
+                .st_mode = S_IFDIR | 0755,
+                .st_nlink = 2,
+                .st_blksize = BLOCK_SIZE,
+                .st_blocks = 0,
+                .st_size = INLINE_DIR_HDR,
+        }
+    };
+    inode_touch(&root_inode, TOUCH_ATIME | TOUCH_MTIME | TOUCH_CTIME);
+
+    // the snapshot directory, an empty inline directory under the root that only takes snapshots
+    struct inode snap_inode = {
+        .ino = superblock.snap_ino,
+        .valid = 1,
+        .size = INLINE_DIR_HDR,
+        .type = directory,
+        .link = 2,
+        .flags = INODE_INLINE | INODE_SNAPSHOT,
+        .vstat = {
+                .st_ino = superblock.snap_ino,
+                .st_mode = S_IFDIR | 0755,
+                .st_nlink = 2,
+                .st_blksize = BLOCK_SIZE,
+                .st_blocks = 0,
+                .st_size = INLINE_DIR_HDR,
+        }
+    };
+    snap_inode.vstat.st_atim = snap_inode.vstat.st_mtim = snap_inode.vstat.st_ctim = root_inode.vstat.st_mtim;
+    inline_add(&root_inode, snap_inode.ino, SNAP_DIR_NAME);
+
+    // write the superblock and both bitmaps, with the root and the snapshot directory in use, in one write
+    set_bitmap(i_bitmap, 0);
+    set_bitmap(i_bitmap, snap_inode.ino);
+    memcpy(blk, &superblock, sizeof(struct superblock));
+    struct iovec iov[3] = {
+        { .iov_base = blk, .iov_len = BLOCK_SIZE },
+        { .iov_base = i_bitmap, .iov_len = BLOCK_SIZE },
+        { .iov_base = d_bitmap, .iov_len = BLOCK_SIZE },
+    };
+    if(bio_writev(0, iov, 3) < 0) {
+        free(blk);
+        return -1;
+    }
+
+
+    // write the root inode and the snapshot directory; "." and ".." need no entries while they are inline
+    if(writei(root_inode.ino, &root_inode) < 0
+    || writei(snap_inode.ino, &snap_inode) < 0
+    ) {
+        DISK_ERROR = 1;
+    }
+
+
+    free(blk);
+    if(DISK_ERROR) {
+        ERROR("Failed to initialize disk");
+        return -1;
+    }
+	return 0;
+}
+
+
+/*
+ * mount operations
+ */
+static int snap_drop(uint16_t ino);
+
+void tfs_mount(struct fuse_conn_info *conn) {
+
+    for(int i = 0; i < MAX_INUM; ++i) pthread_rwlock_init(&inode_locks[i], NULL);
+
+    // Step 1a: If disk file is not found, call mkfs
+    if(dev_open(diskfile_path) < 0) {
+        if(tfs_mkfs() < 0) exit(EXIT_FAILURE);
+    }
+
+
+    // Step 1b: Read superblock from disk to locate the journal
+    unsigned char *blk = malloc(BLOCK_SIZE);
+    if(!blk) {
+        ERROR("Failed to allocate memory");
+        exit(EXIT_FAILURE);
+    }
+
+    if((bio_read(0, blk)) < 0) {
+        ERROR("Failed to read disk");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(&superblock, blk, sizeof(struct superblock));
+
+    if(superblock.magic_num != MAGIC_NUM) {
+        ERROR( "Disk's filesystem is not recognized");
+        exit(EXIT_FAILURE);
+    }
+    if(superblock.version != TFS_VERSION) {
+        fprintf(stderr, "DISKFILE has layout version %u, expected %u; remove it to reformat\n", superblock.version, TFS_VERSION);
+        exit(EXIT_FAILURE);
+    }
+
+
+    // Step 2: Replay committed metadata transactions and start group commits
+    if(journal_load(superblock.j_start_blk, superblock.j_blks) < 0) {
+        ERROR("Failed to load journal");
+        exit(EXIT_FAILURE);
+    }
+
+    // the replayed checksum region; blocks mkfs wrote have none until their first journaled write
+    if(bio_csum_load(superblock.csum_start_blk, superblock.csum_blks, tfs_config.csum) < 0) {
+        ERROR("Failed to load checksums");
+        exit(EXIT_FAILURE);
+    }
+
+
+    // Step 3: Initialize in-memory data structures from the (replayed) superblock and bitmaps
+    if((bio_read(0, blk)) < 0) {
+        ERROR("Failed to read disk");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(&superblock, blk, sizeof(struct superblock));
+    free(blk);
+    mounted_clean = superblock.state == SB_CLEAN;
+
+    // the bitmaps and reference counts are read now, or with -o lazy by the first operation that needs them
+    // (with -o warmup, by a background thread right away)
+    alloc_loaded = 0;
+    if(!tfs_config.lazy) {
+        alloc_acquire();
+        pthread_mutex_unlock(&alloc_lock);
+    }
+    else if(tfs_config.warmup) {
+        pthread_t warmup_thread;
+        if(pthread_create(&warmup_thread, NULL, alloc_warmup, NULL)) ERROR("Failed to start warm-up thread");
+        else pthread_detach(warmup_thread);
+    }
+
+
+    // Step 4: Write buffered data into new blocks before the commit that links them to a file,
+    // and let freed blocks be reused once the commit that frees them is durable
+    journal_set_precommit(wb_precommit);
+    journal_set_postcommit(pending_postcommit);
+
+
+    // Step 4b: Mark the file system in use until a clean unmount, durably before anything else changes,
+    // so a crash leaves the next mount counting the free inodes and blocks again
+    superblock.state = SB_DIRTY;
+    journal_begin();
+
+    // a snapshot a crash interrupted is dropped along with everything copied into it, see snap_create()
+    if(superblock.snap_pending) {
+        if(snap_drop(superblock.snap_pending) < 0) ERROR("Failed to drop an unfinished snapshot");
+        superblock.snap_pending = 0;
+    }
+    if(write_superblock() < 0) {
+        ERROR("Failed to write superblock");
+        exit(EXIT_FAILURE);
+    }
+    journal_end();
+    if(journal_commit() < 0) {
+        ERROR("Failed to write superblock");
+        exit(EXIT_FAILURE);
+    }
+
+
+    // Step 5: Start the reclaim thread, which also picks up orphans left over from before a crash
+    reclaim_stop = 0;
+    if(pthread_create(&reclaim_thread, NULL, reclaim_worker, NULL)) {
+        ERROR("Failed to start reclaim thread");
+        exit(EXIT_FAILURE);
+    }
+    reclaim_running = 1;
+
+
+    // Step 6: Ask the kernel for few, large requests. big_writes lifts the one-page limit on writes;
+    // libfuse starts max_write at the size of its receive buffer and max_readahead at the kernel's
+    // limit, so those can only be capped, here at the largest file
+    if(conn->capable & FUSE_CAP_BIG_WRITES) conn->want |= FUSE_CAP_BIG_WRITES;
+    if(conn->capable & FUSE_CAP_ASYNC_READ) {
+        conn->want |= FUSE_CAP_ASYNC_READ;
+        conn->async_read = 1;
+    }
+    if(conn->max_write > TFS_MAX_IO) conn->max_write = TFS_MAX_IO;
+    if(conn->max_readahead > TFS_MAX_IO) conn->max_readahead = TFS_MAX_IO;
+
+    // FUSE 2 headers don't know the writeback cache, and tfs_parse_opts() refuses the option without them
+#ifdef FUSE_CAP_WRITEBACK_CACHE
+    if(tfs_config.writeback_cache && (conn->capable & FUSE_CAP_WRITEBACK_CACHE)) conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+    else if(tfs_config.writeback_cache) fprintf(stderr, "tfs: the kernel doesn't offer writeback_cache; writes go straight to tfs\n");
+#endif
+}
+
+#define TFS_OPT(t, p, v) { t, offsetof(struct tfs_config, p), v }
+
+static const struct fuse_opt tfs_opts[] = {
+    TFS_OPT("writeback_cache", writeback_cache, 1),
+    TFS_OPT("relatime", atime, ATIME_RELATIME),
+    TFS_OPT("noatime", atime, ATIME_NOATIME),
+    TFS_OPT("strictatime", atime, ATIME_STRICT),
+    TFS_OPT("csum", csum, 1),
+    TFS_OPT("nocsum", csum, 0),
+    TFS_OPT("compress", compress, 1),
+    TFS_OPT("dedup", dedup, 1),
+    TFS_OPT("lazy", lazy, 1),
+    TFS_OPT("warmup", warmup, 1),
+    FUSE_OPT_END
+};
+
+// Take the tfs options out of args, leaving the rest for FUSE
+int tfs_parse_opts(struct fuse_args *args) {
+
+    if(fuse_opt_parse(args, &tfs_config, tfs_opts, NULL) == -1) return -1;
+
+    // an option this build can't act on is an error rather than silently ignored
+#ifndef FUSE_CAP_WRITEBACK_CACHE
+    if(tfs_config.writeback_cache) {
+        fprintf(stderr, "tfs: writeback_cache needs FUSE 3 headers, and this build uses FUSE 2\n");
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+void tfs_unmount() {
+
+	// Step 1: Stop the reclaim thread; orphans it hasn't reached stay in the superblock for the next mount
+    if(reclaim_running) {
+        alloc_acquire();
+        reclaim_stop = 1;
+        pthread_cond_signal(&reclaim_cond);
+        pthread_mutex_unlock(&alloc_lock);
+        pthread_join(reclaim_thread, NULL);
+        reclaim_running = 0;
+    }
+
+
+	// Step 2: Write back all buffered data, then the superblock with the current free counters and group hints,
+    // marked clean only if everything was written back
+    int flushed = wb_flush_all(0) == 0;
+    if(!flushed) ERROR("Failed to write back buffered blocks");
+    journal_begin();
+    alloc_acquire();
+    if(flushed) superblock.state = SB_CLEAN;
+    if(write_superblock() < 0) ERROR("Failed to write superblock");
+    pthread_mutex_unlock(&alloc_lock);
+    journal_end();
+
+
+	// Step 3: Commit the running metadata transaction and stop the commit thread
+    journal_shutdown();
+
+
+	// Step 4: De-allocate in-memory data structures (skipped, all on stack)
+
+
+	// Step 5: Close diskfile
+    dev_close(diskfile_path);
+}
+
+// Report sizes and free counts for statfs from the allocators' counters, without scanning the bitmaps.
+// Blocks freed by a transaction that hasn't committed yet count as free.
+void fs_statfs(struct statvfs *stbuf) {
+
+    memset(stbuf, 0, sizeof(struct statvfs));
+    stbuf->f_bsize = BLOCK_SIZE;
+    stbuf->f_frsize = BLOCK_SIZE;
+    stbuf->f_blocks = MAX_DNUM;
+    stbuf->f_files = MAX_INUM;
+    stbuf->f_namemax = sizeof(((struct dirent *)0)->name) - 1;
+
+    // after a clean unmount the counters on disk are right, so the bitmaps don't need to be read in
+    if(mounted_clean) pthread_mutex_lock(&alloc_lock);
+    else alloc_acquire();
+    stbuf->f_bfree = stbuf->f_bavail = superblock.free_blks;
+    stbuf->f_ffree = stbuf->f_favail = superblock.free_inodes;
+    pthread_mutex_unlock(&alloc_lock);
+}
+
+/*
+ * inode-based file operations
+ */
+// Update a directory's mtime and ctime after an entry was added or removed, re-reading it
+// since dir_add() may have grown it. The caller holds a journal handle.
+static int dir_changed(uint16_t ino) {
+
+    struct inode dir_inode = {0};
+
+    if(readi(ino, &dir_inode) < 0) return -1;
+    inode_touch(&dir_inode, TOUCH_MTIME | TOUCH_CTIME);
+    if(writei(ino, &dir_inode) < 0) return -1;
+    inode_dirty(ino, 0);
+    return 0;
+}
+
+
+/*
+ * snapshot operations
+ */
+static int snap_copy(uint16_t src_ino, uint16_t parent_ino, const char *name, int *copy_ino);
+static int snap_drop(uint16_t ino);
+
+struct snap_ctx {
+    uint16_t dir_ino;               /* the directory's copy */
+    int retstat;
+};
+
+struct snap_need {
+    uint32_t inodes;                /* inodes the copy takes */
+    uint32_t blks;                  /* pointer arrays and directory blocks it takes */
+};
+
+// Add up what copying an inode, and for a directory everything below it, takes
+static int snap_count(uint16_t ino, struct snap_need *need);
+
+static int snap_count_entry(const struct dirent *dirent, void *arg) {
+
+    if(!strcmp(dirent->name, ".") || !strcmp(dirent->name, "..") || dir_hidden(dirent)) return 0;
+    return snap_count(dirent->ino, arg) < 0;
+}
+
+static int snap_count(uint16_t ino, struct snap_need *need) {
+
+    struct inode inode = {0};
+
+    if(readi(ino, &inode) < 0) return -1;
+    ++need->inodes;
+    for(int i = 0; i < 8 && !(inode.flags & INODE_INLINE); ++i) {
+        if(inode.indirect_ptr[i] >= 0) ++need->blks;
+    }
+
+    // a directory's copy has its entries added one by one, so it ends up with as many blocks
+    if(inode.type == directory) {
+        if(!(inode.flags & INODE_INLINE)) need->blks += inode.size/BLOCK_SIZE;
+        if(dir_iterate(&inode, snap_count_entry, need) < 0) return -1;
+    }
+    return 0;
+}
+
+// Copy a directory entry and everything below it into the directory's copy
+static int snap_copy_entry(const struct dirent *dirent, void *arg) {
+
+    struct snap_ctx *ctx = arg;
+    int child = -1;
+
+    if(!strcmp(dirent->name, ".") || !strcmp(dirent->name, "..") || dir_hidden(dirent)) return 0;
+
+    ctx->retstat = snap_copy(dirent->ino, ctx->dir_ino, dirent->name, &child);
+    return ctx->retstat != 0;
+}
+
+// Copy inode src_ino, and for a directory everything below it, into new read-only inodes. A file's copy
+// takes another reference to each data block instead of copying it, so only pointer arrays and directory
+// entries are written; later writes to either side copy a shared block first.
+// Each copy is linked into its parent's copy as name in the transaction that allocates it, and the root's
+// copy, with no name, is recorded in the superblock instead. So everything copied can be reached from the
+// root's copy, which dropping it frees, even after a crash part way. A copy that couldn't be linked is
+// dropped here. *copy_ino is set to the root's copy once allocated.
+// The caller holds journal_lock() and has written back every buffered block.
+static int snap_copy(uint16_t src_ino, uint16_t parent_ino, const char *name, int *copy_ino) {
+
+    int DISK_ERROR = 0;
+    int NO_SPACE = 0;
+
+    struct inode src = {0};
+    struct inode copy = {0};
+    struct inode parent = {0};
+    int *ptr_blk = malloc(BLOCK_SIZE);
+    if(!ptr_blk) {
+        ERROR("Failed to allocate memory");
+        return -ENOMEM;
+    }
+
+
+    // Step 1: Read the inode and allocate its copy
+    if(journal_reserve(SNAP_TX_BLKS) < 0 || readi(src_ino, &src) < 0) {
+        free(ptr_blk);
+        return -EIO;
+    }
+    int ino = get_avail_ino(ino_group(parent_ino));
+    if(ino < 0) {
+        free(ptr_blk);
+        return -ENOSPC;
+    }
+    if(!name) *copy_ino = ino;
+    memcpy(&copy, &src, sizeof(struct inode));
+    copy.ino = ino;
+    copy.vstat.st_ino = ino;
+    copy.flags |= INODE_SNAPSHOT;
+
+
+    // Step 2: A file's copy shares its data blocks and gets pointer arrays of its own;
+    // an inline file's data comes along with the inode
+    if(src.type == file && !(src.flags & INODE_INLINE)) {
+
+        alloc_acquire();
+        for(int k = 0; k < 16; ++k) {
+            if(copy.direct_ptr[k] >= 0 && ref_get(copy.direct_ptr[k]) < 0) {
+                copy.direct_ptr[k] = -1;
+                DISK_ERROR = 1;
+            }
+        }
+        pthread_mutex_unlock(&alloc_lock);
+
+        for(int i = 0; i < 8; ++i) {
+
+            copy.indirect_ptr[i] = -1;
+            if(src.indirect_ptr[i] < 0 || DISK_ERROR || NO_SPACE) continue;
+
+            if(journal_read(superblock.d_start_blk + src.indirect_ptr[i], ptr_blk) < 0) {
+                DISK_ERROR = 1;
+                continue;
+            }
+            int array_blkno = get_avail_blkno(blk_goal(&copy));
+            if(array_blkno < 0) {
+                NO_SPACE = 1;
+                continue;
+            }
+
+            alloc_acquire();
+            for(int j = 0; j < PTRS_PER_BLK; ++j) {
+                if(ptr_blk[j] >= 0 && ref_get(ptr_blk[j]) < 0) {
+                    ptr_blk[j] = -1;
+                    DISK_ERROR = 1;
+                }
+            }
+            pthread_mutex_unlock(&alloc_lock);
+
+            // the array is recorded even after a failure, so dropping the copy releases its references
+            if(journal_write(superblock.d_start_blk + array_blkno, ptr_blk) < 0) DISK_ERROR = 1;
+            copy.indirect_ptr[i] = array_blkno;
+        }
+    }
+
+
+    // Step 3: A directory's copy starts out empty and inline, under its parent's copy
+    if(src.type == directory) {
+        copy.flags |= INODE_INLINE;
+        memset(copy.inline_data, 0, INLINE_MAX);
+        memcpy(copy.inline_data, &parent_ino, INLINE_DIR_HDR);
+        copy.size = INLINE_DIR_HDR;
+        copy.vstat.st_size = copy.size;
+        copy.vstat.st_blocks = 0;
+    }
+    int linked = writei(ino, &copy) == 0;
+
+
+    // Step 4: Link the copy where dropping the root's copy finds it, in the same transaction
+    if(linked && name) {
+        linked = readi(parent_ino, &parent) == 0 && !dir_add(parent, ino, name, strlen(name));
+    }
+    else if(linked) {
+        superblock.snap_pending = ino;
+        linked = write_superblock() == 0;
+    }
+    if(!linked) {
+        snap_drop(ino);
+        free(ptr_blk);
+        return NO_SPACE ? -ENOSPC : -EIO;
+    }
+
+
+    // Step 5: Copy each of the directory's entries into it, then restore the timestamps adding them changed
+    if(src.type == directory && !DISK_ERROR && !NO_SPACE) {
+
+        struct snap_ctx ctx = { .dir_ino = ino, .retstat = 0 };
+        if(dir_iterate(&src, snap_copy_entry, &ctx) < 0) DISK_ERROR = 1;
+        if(ctx.retstat == -ENOSPC) NO_SPACE = 1;
+        else if(ctx.retstat) DISK_ERROR = 1;
+
+        if(journal_reserve(SNAP_TX_BLKS) < 0 || readi(ino, &copy) < 0) DISK_ERROR = 1;
+        else {
+            copy.vstat.st_atim = src.vstat.st_atim;
+            copy.vstat.st_mtim = src.vstat.st_mtim;
+            copy.vstat.st_ctim = src.vstat.st_ctim;
+            if(writei(ino, &copy) < 0) DISK_ERROR = 1;
+        }
+    }
+
+
+    free(ptr_blk);
+    if(NO_SPACE) return -ENOSPC;
+    if(DISK_ERROR) return -EIO;
+    return 0;
+}
+
+static int snap_drop_entry(const struct dirent *dirent, void *arg) {
+
+    if(strcmp(dirent->name, ".") && strcmp(dirent->name, "..") && snap_drop(dirent->ino) < 0) *(int *)arg = -1;
+    return 0;
+}
+
+// Hand a snapshot's inode and everything below it to the reclaim thread. A directory's entries go
+// first, since its blocks may be freed as soon as it is listed. The caller holds a journal handle or journal_lock().
+static int snap_drop(uint16_t ino) {
+
+    struct inode inode = {0};
+    int retstat = 0;
+
+    if(readi(ino, &inode) < 0) return -1;
+    if(inode.type == directory && dir_iterate(&inode, snap_drop_entry, &retstat) < 0) retstat = -1;
+    if(orphan_add(ino) < 0) retstat = -1;
+    return retstat;
+}
+
+// Take a snapshot of the whole file system called name in the snapshot directory and return its root.
+// Operations wait while the tree is copied, so the snapshot shows it as of one instant. A snapshot takes
+// an inode for every one in the tree, so it is refused up front unless the free inodes and blocks hold it.
+// The copy spans several transactions and is linked into the snapshot directory in the last one; until
+// then the superblock records its root, so mounting after a crash part way drops it (see tfs_mount()).
+static int snap_create(const char *name, struct inode *inode) {
+
+    int DISK_ERROR = 0;
+    struct inode snap_dir = {0};
+    struct snap_need need = { .inodes = 0, .blks = 0 };
+    int top = -1;
+
+
+    // Step 1: Wait for running operations, then write back buffered blocks, which are written in place
+    // and so must not be in a block a snapshot shares
+    journal_lock();
+    if(wb_flush_all(0) < 0) {
+        journal_unlock();
+        return -EIO;
+    }
+
+
+    // Step 2: Count what the copy takes before making any of it
+    if(snap_count(0, &need) < 0) {
+        journal_unlock();
+        return -EIO;
+    }
+    alloc_acquire();
+    int fits = need.inodes <= superblock.free_inodes && need.blks <= superblock.free_blks;
+    pthread_mutex_unlock(&alloc_lock);
+    if(!fits) {
+        journal_unlock();
+        return -ENOSPC;
+    }
+
+
+    // Step 3: Copy the tree from the root down, leaving out the snapshot directory
+    int retstat = snap_copy(0, superblock.snap_ino, NULL, &top);
+
+
+    // Step 4: Link the copy's root into the snapshot directory and clear the record of it, or drop what was copied
+    if(journal_reserve(SNAP_TX_BLKS) < 0) DISK_ERROR = 1;
+    if(!retstat && !DISK_ERROR
+    && (readi(superblock.snap_ino, &snap_dir) < 0
+        || dir_add(snap_dir, top, name, strlen(name))
+        || dir_changed(superblock.snap_ino) < 0
+    )) {
+        DISK_ERROR = 1;
+    }
+    if(top >= 0) {
+        if(retstat || DISK_ERROR) snap_drop(top);
+        else if(readi(top, inode) < 0) DISK_ERROR = 1;
+        superblock.snap_pending = 0;
+        if(write_superblock() < 0) DISK_ERROR = 1;
+    }
+    journal_unlock();
+
+
+    if(retstat) return retstat;
+    if(DISK_ERROR) return -EIO;
+    return 0;
+}
+
+// Clear an inode node_create() made and give its number back, when the entry for it couldn't be added.
+// The caller holds the journal handle the inode was allocated in, so both commit together.
+static int node_create_undo(uint16_t ino) {
+
+    struct inode clean_inode = {0};
+
+    if(writei(ino, &clean_inode) < 0) return -1;
+    inode_forget(ino);
+
+    alloc_acquire();
+    if(get_bitmap(i_bitmap, ino)) ++superblock.free_inodes;
+    unset_bitmap(i_bitmap, ino);
+    hint_give(&superblock.group[ino_group(ino)].ino_hint, ino);
+    int retstat = journal_write(superblock.i_bitmap_blk, i_bitmap);
+    pthread_mutex_unlock(&alloc_lock);
+    return retstat;
+}
+
+// Create a file or directory called name in the parent directory and return its inode
+static int node_create_locked(struct inode *parent_inode, const char *name, mode_t mode, enum type type, struct inode *inode) {
+
+    struct dirent dirent = {0};
+
+    // a name must fit a directory entry, inline ones included, whose length is a byte
+    if(strlen(name) >= sizeof(dirent.name)) return -ENAMETOOLONG;
+    if(dir_find(parent_inode->ino, name, strlen(name), &dirent) == 0) return -EEXIST;
+
+    // nothing is created in a snapshot; a directory made in the snapshot directory is a new snapshot
+    if(parent_inode->flags & INODE_SNAPSHOT) {
+        if(parent_inode->ino == superblock.snap_ino && type == directory) return snap_create(name, inode);
+        return -EROFS;
+    }
+
+
+    // Step 1: Call get_avail_ino() to get an available inode number, in the parent's block group
+    // (all metadata writes from here on commit as one journal transaction)
+    journal_begin();
+    int ino = get_avail_ino(new_ino_group(parent_inode->ino, type));
+    // if we failed to get a new ino
+    if(ino < 0) {
+        journal_end();
+        return -ENOSPC;
+    }
+
+
+    // Step 2: Initialize the inode and call writei() to write it to disk.
+    // A new file or directory starts out inline: an empty file's data, or a directory's parent for "..",
+    // and is compressed if its directory is or -o compress is given
+    int size = type == directory ? INLINE_DIR_HDR : 0;
+    int compress = tfs_config.compress || (parent_inode->flags & INODE_COMPRESSED);
+    *inode = (struct inode) {
+            .ino = ino,
+            .valid = 1,
+            .size = size,
+            .type = type,
+            .link = 0,
+            .flags = INODE_INLINE | (compress ? INODE_COMPRESSED : 0),
+            .vstat = {
+                    .st_ino = ino,
+                    .st_mode = type == directory ? (mode | S_IFDIR) : mode,
+                    .st_nlink = type == directory ? 2 : 1,
+                    .st_blksize = BLOCK_SIZE,
+                    .st_blocks = 0,
+                    .st_size = size
+            }
+    };
+    inode_touch(inode, TOUCH_ATIME | TOUCH_MTIME | TOUCH_CTIME);
+    if(type == directory) memcpy(inode->inline_data, &parent_inode->ino, INLINE_DIR_HDR);
+    int retstat = writei(inode->ino, inode) < 0 ? -EIO : 0;
+    inode_dirty(inode->ino, 1);
+
+
+    // Step 3: Call dir_add() to add the entry to the parent directory; if it can't be added,
+    // the inode is undone in the same transaction instead of being left in no directory
+    if(!retstat) {
+        retstat = dir_add(*parent_inode, inode->ino, name, strlen(name));
+        if(retstat) retstat = retstat == -ENOSPC ? -ENOSPC : -EIO;
+    }
+    if(retstat) {
+        if(node_create_undo(inode->ino) < 0) ERROR("Failed to free the inode of a failed create");
+        journal_end();
+        ERROR("Failed to create directory entry");
+        return retstat;
+    }
+
+
+    // Step 4: The parent directory's contents changed
+    if(dir_changed(parent_inode->ino) < 0) {
+        journal_end();
+        return -EIO;
+    }
+
+
+    // Step 5: Return the inode as dir_add() left it
+    retstat = readi(inode->ino, inode) < 0 ? -EIO : 0;
+    journal_end();
+    return retstat;
+}
+
+// The parent is locked for the lookup and the add, so two creates of one name can't both succeed,
+// and read again under the lock, since the caller read it before
+int node_create(struct inode *parent_inode, const char *name, mode_t mode, enum type type, struct inode *inode) {
+
+    inode_lock(parent_inode->ino, 1);
+    int retstat = readi(parent_inode->ino, parent_inode) < 0 ? -EIO : node_create_locked(parent_inode, name, mode, type, inode);
+    inode_unlock(parent_inode->ino);
+    return retstat;
+}
+
+// Remove the entry called name from the parent directory and hand its inode to the reclaim thread
+static int node_remove_locked(struct inode *parent_inode, const char *name, enum type type) {
+
+    struct dirent dirent = {0};
+    struct inode inode = {0};
+
+
+    // Step 1: Find the target and check it can be removed this way
+    if(dir_find(parent_inode->ino, name, strlen(name), &dirent) < 0) return -ENOENT;
+    if(readi(dirent.ino, &inode) < 0) return -EIO;
+
+    if(type == file && inode.type == directory) return -EISDIR;
+    if((parent_inode->flags & INODE_SNAPSHOT) && parent_inode->ino != superblock.snap_ino) return -EROFS;
+    if(type == directory) {
+        if(inode.ino == 0 || inode.ino == superblock.snap_ino) return -EBUSY;
+        if(inode.type != directory) return -ENOTDIR;
+
+        // removing a snapshot drops everything in it
+        if(parent_inode->ino == superblock.snap_ino) {
+            journal_begin();
+            int retstat = dir_remove(*parent_inode, name, strlen(name)) < 0
+                       || dir_changed(parent_inode->ino) < 0
+                       || snap_drop(inode.ino) < 0 ? -EIO : 0;
+            journal_end();
+            return retstat;
+        }
+
+        int empty = dir_is_empty(&inode);
+        if(empty <= 0) return empty < 0 ? -EIO : -ENOTEMPTY;
+    }
+
+
+	// Step 2: Call dir_remove() to remove the directory entry from the parent directory
+	// (detaching and orphaning commit as one journal transaction)
+    journal_begin();
+    if(dir_remove(*parent_inode, name, strlen(name)) < 0
+    || dir_changed(parent_inode->ino) < 0
+    ) {
+        journal_end();
+        return -EIO;
+    }
+
+
+	// Step 3: Hand the detached inode to the reclaim thread, which clears its
+	// data block bitmap, inode bitmap and data blocks in the background
+	// once nothing holds it open
+    if(orphan_add(inode.ino) < 0) {
+        journal_end();
+        return -EIO;
+    }
+    journal_end();
+
+
+    return 0;
+}
+
+// The parent is locked, then a directory being removed, so nothing is created in it between the
+// check that it is empty and its removal
+int node_remove(struct inode *parent_inode, const char *name, enum type type) {
+
+    struct dirent dirent = {0};
+    int child = -1;
+
+    inode_lock(parent_inode->ino, 1);
+    int retstat = readi(parent_inode->ino, parent_inode) < 0 ? -EIO : 0;
+    if(!retstat && type == directory && dir_find(parent_inode->ino, name, strlen(name), &dirent) == 0) child = dirent.ino;
+    if(child >= 0) inode_lock(child, 1);
+
+    if(!retstat) retstat = node_remove_locked(parent_inode, name, type);
+
+    if(child >= 0) inode_unlock(child);
+    inode_unlock(parent_inode->ino);
+    return retstat;
+}
+
+// Point a moved directory's ".." at its new parent. dir_spill() writes "." and ".." first in the first
+// block and removals keep entries in order, so a directory in block form has it there.
+// The caller holds a journal handle and, for an inline directory, writes the inode.
+static int dir_set_parent(struct inode *dir_inode, uint16_t parent_ino) {
+
+    if(dir_inode->flags & INODE_INLINE) {
+        memcpy(dir_inode->inline_data, &parent_ino, INLINE_DIR_HDR);
+        return 0;
+    }
+
+    struct dirent *dirent_blk = malloc(BLOCK_SIZE);
+    if(!dirent_blk) {
+        ERROR("Failed to allocate memory");
+        return -1;
+    }
+    if(journal_read(superblock.d_start_blk + dir_inode->direct_ptr[0], dirent_blk) < 0) {
+        free(dirent_blk);
+        return -1;
+    }
+
+    int retstat = -1;
+    for(int k = 0; k < dirents_per_blk && dirent_blk[k].valid; ++k) {
+        if(strcmp(dirent_blk[k].name, "..")) continue;
+        dirent_blk[k].ino = parent_ino;
+        retstat = journal_write(superblock.d_start_blk + dir_inode->direct_ptr[0], dirent_blk) < 0 ? -1 : 0;
+        break;
+    }
+
+
+    free(dirent_blk);
+    return retstat;
+}
+
+// Returns 1 if directory ino is dir_ino or lies below it, following ".." up to the root
+static int dir_within(uint16_t ino, uint16_t dir_ino) {
+
+    struct dirent dirent = {0};
+
+    while(ino != dir_ino) {
+        if(!ino || dir_find(ino, "..", 2, &dirent) < 0) return 0;
+        ino = dirent.ino;
+    }
+    return 1;
+}
+
+// Move the entry called name in the parent directory to new_name in new_parent, replacing what is there.
+// Only directory entries change, never data blocks; the move, a moved directory's ".." and the
+// orphaning of a replaced inode commit as one journal transaction.
+static int node_rename_locked(struct inode *parent_inode, const char *name, struct inode *new_parent_inode, const char *new_name) {
+
+    int DISK_ERROR = 0;
+
+    struct dirent dirent = {0};
+    struct dirent target = {0};
+    struct inode inode = {0};
+    struct inode target_inode = {0};
+    struct inode dir_inode = {0};
+
+
+    // Step 1: Find the source; node_rename() checked it isn't moved below itself
+    if(dir_find(parent_inode->ino, name, strlen(name), &dirent) < 0) return -ENOENT;
+    if(readi(dirent.ino, &inode) < 0) return -EIO;
+    if(inode.ino == 0 || inode.ino == superblock.snap_ino) return -EBUSY;
+
+
+    // Step 2: An existing target must be the same kind of file, and an empty one if a directory
+    int replace = dir_find(new_parent_inode->ino, new_name, strlen(new_name), &target) == 0;
+    if(replace) {
+        int retstat = 0;
+        if(target.ino == inode.ino) retstat = 1;
+        else if(readi(target.ino, &target_inode) < 0) retstat = -EIO;
+        else if(target.ino == 0 || target.ino == superblock.snap_ino) retstat = -EBUSY;
+        else if(inode.type == file && target_inode.type == directory) retstat = -EISDIR;
+        else if(inode.type == directory && target_inode.type != directory) retstat = -ENOTDIR;
+        else if(target_inode.type == directory) {
+            int empty = dir_is_empty(&target_inode);
+            if(empty <= 0) retstat = empty < 0 ? -EIO : -ENOTEMPTY;
+        }
+        if(retstat) return retstat > 0 ? 0 : retstat;
+    }
+
+
+    // Step 3: Swap the entries: drop the target's, add the new one, then drop the old one
+    // (each directory is read again, since the one before may have changed it)
+    journal_begin();
+    if(replace
+    && (readi(new_parent_inode->ino, &dir_inode) < 0
+        || dir_remove(dir_inode, new_name, strlen(new_name)) < 0
+    )) {
+        DISK_ERROR = 1;
+    }
+    if(!DISK_ERROR
+    && (readi(new_parent_inode->ino, &dir_inode) < 0
+        || dir_add(dir_inode, inode.ino, new_name, strlen(new_name))
+        || readi(parent_inode->ino, &dir_inode) < 0
+        || dir_remove(dir_inode, name, strlen(name)) < 0
+    )) {
+        DISK_ERROR = 1;
+    }
+
+
+    // Step 4: A directory that changed parents has its ".." pointed at the new one; the moved inode's ctime changes
+    if(!DISK_ERROR && readi(inode.ino, &inode) < 0) DISK_ERROR = 1;
+    if(!DISK_ERROR
+    && inode.type == directory
+    && parent_inode->ino != new_parent_inode->ino
+    && dir_set_parent(&inode, new_parent_inode->ino) < 0
+    ) {
+        DISK_ERROR = 1;
+    }
+    if(!DISK_ERROR) {
+        inode_touch(&inode, TOUCH_CTIME);
+        if(writei(inode.ino, &inode) < 0) DISK_ERROR = 1;
+        else inode_dirty(inode.ino, 0);
+    }
+
+
+    // Step 5: Both directories' contents changed, and the replaced inode goes to the reclaim thread
+    if(!DISK_ERROR && dir_changed(parent_inode->ino) < 0) DISK_ERROR = 1;
+    if(!DISK_ERROR && parent_inode->ino != new_parent_inode->ino && dir_changed(new_parent_inode->ino) < 0) DISK_ERROR = 1;
+    if(!DISK_ERROR && replace && orphan_add(target.ino) < 0) DISK_ERROR = 1;
+    journal_end();
+
+
+    if(DISK_ERROR) return -EIO;
+    return 0;
+}
+
+// Renames are serialized by rename_lock, so the tree's shape only changes under it. Both parents are
+// locked, the one above the other first, then the moved and replaced entries in inode number order.
+// A rename that would lock an entry above one of its parents fails before taking it.
+int node_rename(struct inode *parent_inode, const char *name, struct inode *new_parent_inode, const char *new_name) {
+
+    struct dirent dirent = {0};
+    uint16_t locks[4];
+    int nlocks = 0;
+    int retstat = 0;
+
+    if(strlen(new_name) >= sizeof(dirent.name)) return -ENAMETOOLONG;
+    if((parent_inode->flags | new_parent_inode->flags) & INODE_SNAPSHOT) return -EROFS;
+
+    pthread_mutex_lock(&rename_lock);
+
+
+    // Step 1: Lock the parents, the one above the other first
+    int below = parent_inode->ino != new_parent_inode->ino && dir_within(parent_inode->ino, new_parent_inode->ino);
+    locks[nlocks++] = below ? new_parent_inode->ino : parent_inode->ino;
+    if(parent_inode->ino != new_parent_inode->ino) locks[nlocks++] = below ? parent_inode->ino : new_parent_inode->ino;
+    for(int i = 0; i < nlocks; ++i) inode_lock(locks[i], 1);
+
+
+    // Step 2: Lock the moved entry, which mustn't be moved below itself, and the one it replaces,
+    // which can't be a directory holding the source
+    int moved = dir_find(parent_inode->ino, name, strlen(name), &dirent) == 0 ? dirent.ino : -1;
+    int replaced = dir_find(new_parent_inode->ino, new_name, strlen(new_name), &dirent) == 0 ? dirent.ino : -1;
+    if(moved >= 0 && dir_within(new_parent_inode->ino, moved)) retstat = -EINVAL;
+    else if(replaced >= 0 && replaced != moved && dir_within(parent_inode->ino, replaced)) retstat = -ENOTEMPTY;
+
+    int first = replaced >= 0 && replaced < moved ? replaced : moved;
+    int second = first == moved ? replaced : moved;
+    for(int i = 0; !retstat && i < 2; ++i) {
+        int ino = i ? second : first;
+        int held = ino < 0;
+        for(int k = 0; k < nlocks; ++k) held |= locks[k] == ino;
+        if(held) continue;
+        inode_lock(ino, 1);
+        locks[nlocks++] = ino;
+    }
+
+
+    // Step 3: Move the entry, with both parents read again under their locks
+    if(!retstat
+    && (readi(parent_inode->ino, parent_inode) < 0
+        || readi(new_parent_inode->ino, new_parent_inode) < 0
+    )) {
+        retstat = -EIO;
+    }
+    if(!retstat) retstat = node_rename_locked(parent_inode, name, new_parent_inode, new_name);
+
+    for(int i = nlocks - 1; i >= 0; --i) inode_unlock(locks[i]);
+    pthread_mutex_unlock(&rename_lock);
+    return retstat;
+}
+
+// Move an inline file's data out to its first block, so the file can grow past INLINE_MAX.
+// The block is buffered like a partial write and written before the commit that links it.
+// The caller holds a journal handle and writes the inode.
+static int inline_promote(struct inode *inode) {
+
+    char data[INLINE_MAX];
+    int new_blk = 0;
+
+
+    // Step 1: Take the data out and turn the pointer area back into an empty block map
+    memcpy(data, inode->inline_data, INLINE_MAX);
+    inode->flags &= ~INODE_INLINE;
+    for(int i = 0; i < 8; ++i) {
+        inode->direct_ptr[i] = -1;
+        inode->direct_ptr[15-i] = -1;
+        inode->indirect_ptr[i] = -1;
+    }
+    memset(inode->cluster_len, 0, sizeof(inode->cluster_len));
+    memset(inode->unwritten, 0, sizeof(inode->unwritten));
+    if(!inode->size) return 0;
+
+    // a compressed file's data starts its first cluster instead
+    if(inode->flags & INODE_COMPRESSED) return cluster_write(inode, 0, data, 0, inode->size, inode->size);
+
+
+    // Step 2: Copy it into a newly allocated first block
+    int blkno = bmap(inode, 0, 1, &new_blk);
+    if(blkno < 0) return -1;
+    return wb_write(inode->ino, 0, blkno, new_blk, 0, data, inode->size);
+}
+
+static int file_read_locked(struct inode *inode, char *buffer, size_t size, off_t offset) {
+
+    int DISK_ERROR = 0;
+
+    size_t buffer_offset = 0;
+    void *data_blk = malloc(BLOCK_SIZE);
+    if(!data_blk) {
+        ERROR("Failed to allocate memory");
+        return -ENOMEM;
+    }
+
+
+    // Step 1: Nothing to read at or past the end of the file
+    if(offset >= inode->size || !size) {
+        free(data_blk);
+        return 0;
+    }
+    if(offset + size > inode->size) size = inode->size - offset;
+
+    // an inline file is already in memory with its inode
+    if(inode->flags & INODE_INLINE) {
+        memcpy(buffer, inode->inline_data + offset, size);
+        free(data_blk);
+        return size;
+    }
+
+    // a compressed one goes through the cluster cache
+    if(inode->flags & INODE_COMPRESSED) {
+        free(data_blk);
+        return clusters_read(inode, buffer, size, offset);
+    }
+
+
+    // Step 2: Map every block the request covers with one walk of the pointer arrays
+    int first_blk = offset/BLOCK_SIZE;
+    int nblks = (offset + size - 1)/BLOCK_SIZE - first_blk + 1;
+    int *blknos = malloc(nblks*sizeof(int));
+    if(!blknos) {
+        free(data_blk);
+        ERROR("Failed to allocate memory");
+        return -ENOMEM;
+    }
+    if(bmap_range(inode, first_blk, nblks, 0, blknos, NULL) < nblks) {
+        free(blknos);
+        free(data_blk);
+        return -EIO;
+    }
+
+    // preallocated blocks read as zeros until written, like holes
+    for(int k = 0; k < nblks; ++k) {
+        if(get_bitmap(inode->unwritten, first_blk + k)) blknos[k] = -1;
+    }
+
+
+	// Step 3: Based on size and offset, read its data blocks from disk
+    // Step 4: copy the correct amount of data from offset to buffer
+    for(int k = 0; k < nblks && buffer_offset < size; ) {
+
+        int blk_indx = first_blk + k;
+        int blk_offset = (offset + buffer_offset)%BLOCK_SIZE;
+        size_t bytes = BLOCK_SIZE - blk_offset;
+        if(bytes > size - buffer_offset) bytes = size - buffer_offset;
+        int run = 1;
+
+        // a block with buffered writes is read from memory
+        if(wb_read(inode->ino, blk_indx, blk_offset, buffer + buffer_offset, bytes)) {
+        }
+        // a block that was never written reads as zeros
+        else if(blknos[k] < 0) {
+            memset(buffer + buffer_offset, 0, bytes);
+        }
+        // whole blocks that are adjacent on disk are read straight into the caller's buffer in one call
+        else if(bytes == BLOCK_SIZE) {
+            while(k + run < nblks && blknos[k + run] == blknos[k] + run
+                  && buffer_offset + (size_t)(run + 1)*BLOCK_SIZE <= size) ++run;
+
+            struct iovec iov = { buffer + buffer_offset, (size_t)run*BLOCK_SIZE };
+            if(bio_readv(superblock.d_start_blk + blknos[k], &iov, 1) < 0) {
+                DISK_ERROR = 1;
+                break;
+            }
+
+            // buffered writes to the rest of the run are newer than the disk
+            for(int r = 1; r < run; ++r) {
+                wb_read(inode->ino, blk_indx + r, 0, buffer + buffer_offset + (size_t)r*BLOCK_SIZE, BLOCK_SIZE);
+            }
+            bytes = (size_t)run*BLOCK_SIZE;
+        } else {
+            if(bio_read(superblock.d_start_blk + blknos[k], data_blk) < 0) {
+                DISK_ERROR = 1;
+                break;
+            }
+            memcpy(buffer + buffer_offset, data_blk + blk_offset, bytes);
+        }
+
+        buffer_offset += bytes;
+        k += run;
+    }
+
+
+    free(blknos);
+    free(data_blk);
+    if(DISK_ERROR && !buffer_offset) return -EIO;
+    // Note: this function should return the amount of bytes you copied to buffer
+	return buffer_offset;
+}
+
+// Read from a file holding its lock shared, with the inode read again under it
+int file_read(struct inode *inode, char *buffer, size_t size, off_t offset) {
+
+    inode_lock(inode->ino, 0);
+    int retstat = readi(inode->ino, inode) < 0 ? -EIO : file_read_locked(inode, buffer, size, offset);
+    inode_unlock(inode->ino);
+    return retstat;
+}
+
+static int file_write_locked(uint16_t ino, const char *buffer, size_t size, off_t offset) {
+
+    int DISK_ERROR = 0;
+    int NO_SPACE = 0;
+    int MAP_CHANGED = 0;
+
+    struct inode inode = {0};
+    size_t buffer_offset = 0;
+
+    // if block and offset will reach max offset prematurely
+    if(offset + size > (off_t)MAX_FILE_BLKS*BLOCK_SIZE) {
+        ERROR("Offset and size will reach max possible data offset");
+        return -EFBIG;
+    }
+    if(!size) return 0;
+
+    int first_blk = offset/BLOCK_SIZE;
+    int nblks = (offset + size - 1)/BLOCK_SIZE - first_blk + 1;
+    int *blknos = malloc(3*nblks*sizeof(int));
+    if(!blknos) {
+        ERROR("Failed to allocate memory");
+        return -ENOMEM;
+    }
+    int *new_blks = blknos + nblks;
+    int *done = new_blks + nblks;
+
+
+    // Step 1: Read the inode
+    // (block allocations and the inode update below commit as one journal transaction)
+    journal_begin();
+    if(readi(ino, &inode) < 0) {
+        journal_end();
+        free(blknos);
+        return -EIO;
+    }
+    if(inode.flags & INODE_SNAPSHOT) {
+        journal_end();
+        free(blknos);
+        return -EROFS;
+    }
+
+
+    // Step 1b: A file that still fits in the inode is written there, journaled with the inode;
+    // one that outgrows it has its data moved to a block first
+    if((inode.flags & INODE_INLINE) && offset + size <= INLINE_MAX) {
+        memcpy(inode.inline_data + offset, buffer, size);
+        if(offset + size > inode.size) {
+            inode.size = offset + size;
+            inode.vstat.st_size = inode.size;
+        }
+        inode_touch(&inode, TOUCH_MTIME | TOUCH_CTIME);
+        int retstat = writei(inode.ino, &inode) < 0 ? -EIO : (int)size;
+        if(retstat > 0) inode_dirty(inode.ino, 1);
+        journal_end();
+        inode_data_changed(inode.ino);
+        free(blknos);
+        return retstat;
+    }
+    if((inode.flags & INODE_INLINE) && inline_promote(&inode) < 0) {
+        journal_end();
+        free(blknos);
+        return -EIO;
+    }
+
+
+    // Step 1c: A compressed file is rewritten a cluster at a time instead, see cluster_write()
+    if(inode.flags & INODE_COMPRESSED) {
+        int retstat = clusters_write(&inode, buffer, size, offset);
+        if(retstat > 0) inode_touch(&inode, TOUCH_MTIME | TOUCH_CTIME);
+        if(writei(inode.ino, &inode) < 0) retstat = -EIO;
+        else inode_dirty(inode.ino, 1);
+        journal_end();
+        if(retstat > 0) inode_data_changed(inode.ino);
+        free(blknos);
+        return retstat;
+    }
+
+
+    // Step 2: Map every block the request covers with one walk of the pointer arrays,
+    // allocating the missing ones; a short count means the disk filled up
+    int mapped = bmap_range(&inode, first_blk, nblks, 1, blknos, new_blks);
+    if(mapped < 0) {
+        DISK_ERROR = 1;
+        mapped = 0;
+    }
+    else if(mapped < nblks) NO_SPACE = 1;
+    for(int k = 0; k < mapped; ++k) {
+        if(new_blks[k]) MAP_CHANGED = 1;
+    }
+
+
+    // Step 2b: Share blocks whose contents are already on disk, and copy shared blocks before they are written
+    if(dedup_map(&inode, buffer, size, offset, blknos, done, mapped, &MAP_CHANGED) < 0) {
+        DISK_ERROR = 1;
+        mapped = 0;
+    }
+
+
+    // Step 2c: A preallocated block is written like a new one, from zeros, and is unwritten from then on
+    for(int k = 0; k < mapped; ++k) {
+        if(!get_bitmap(inode.unwritten, first_blk + k)) continue;
+        unset_bitmap(inode.unwritten, first_blk + k);
+        new_blks[k] = 1;
+        MAP_CHANGED = 1;
+    }
+
+
+    // Step 3: Write the correct amount of data from offset to disk
+    for(int k = 0; k < mapped && buffer_offset < size; ) {
+
+        int blk_indx = first_blk + k;
+        int blk_offset = (offset + buffer_offset)%BLOCK_SIZE;
+        size_t bytes = BLOCK_SIZE - blk_offset;
+        if(bytes > size - buffer_offset) bytes = size - buffer_offset;
+        int run = 1;
+
+        // a block shared in Step 2b already holds the data
+        if(done[k]) {
+        }
+        // whole blocks that are adjacent on disk are written straight from the caller's buffer in one call
+        else if(bytes == BLOCK_SIZE) {
+            while(k + run < mapped && blknos[k + run] == blknos[k] + run && !done[k + run]
+                  && buffer_offset + (size_t)(run + 1)*BLOCK_SIZE <= size) ++run;
+
+            for(int r = 0; r < run; ++r) wb_discard(inode.ino, blk_indx + r);
+            struct iovec iov = { (void *)(buffer + buffer_offset), (size_t)run*BLOCK_SIZE };
+            if(bio_writev(superblock.d_start_blk + blknos[k], &iov, 1) < 0) {
+                DISK_ERROR = 1;
+                break;
+            }
+            for(int r = 0; r < run; ++r) {
+                inode_dirty_blk(inode.ino, blknos[k] + r);
+                if(tfs_config.dedup) dedup_add(blknos[k] + r, buffer + buffer_offset + (size_t)r*BLOCK_SIZE);
+            }
+            bytes = (size_t)run*BLOCK_SIZE;
+        }
+        // a partial block is merged in memory and written once it fills up or the file is flushed
+        else if(wb_write(inode.ino, blk_indx, blknos[k], new_blks[k], blk_offset, buffer + buffer_offset, bytes) < 0) {
+            DISK_ERROR = 1;
+            break;
+        }
+
+        buffer_offset += bytes;
+        k += run;
+    }
+
+
+    // Step 4: Update the inode info and write it to disk
+    if(offset + buffer_offset > inode.size) {
+        inode.size = offset + buffer_offset;
+        inode.vstat.st_size = inode.size;
+        MAP_CHANGED = 1;
+    }
+    if(buffer_offset) inode_touch(&inode, TOUCH_MTIME | TOUCH_CTIME);
+    if(writei(inode.ino, &inode) < 0) DISK_ERROR = 1;
+    else inode_dirty(inode.ino, MAP_CHANGED);
+    journal_end();
+    if(buffer_offset) inode_data_changed(inode.ino);
+
+
+    free(blknos);
+    if(NO_SPACE && !buffer_offset) return -ENOSPC;
+    if(DISK_ERROR && !buffer_offset) return -EIO;
+    // Note: this function should return the amount of bytes you write to disk
+    return buffer_offset;
+}
+
+int file_write(uint16_t ino, const char *buffer, size_t size, off_t offset) {
+
+    inode_lock(ino, 1);
+    int retstat = file_write_locked(ino, buffer, size, offset);
+    inode_unlock(ino);
+    return retstat;
+}
+
+// Change a file's size, freeing the blocks past a new end and zeroing the rest of its last block,
+// so growing the file again reads zeros there
+static int file_truncate_locked(uint16_t ino, off_t size) {
+
+    int DISK_ERROR = 0;
+    struct inode inode = {0};
+
+    if(size < 0) return -EINVAL;
+    if(size > (off_t)MAX_FILE_BLKS*BLOCK_SIZE) return -EFBIG;
+
+
+    // Step 1: Read the inode
+    // (freeing blocks and the inode update below commit as one journal transaction)
+    journal_begin();
+    if(readi(ino, &inode) < 0) {
+        journal_end();
+        return -EIO;
+    }
+    if(inode.type == directory) {
+        journal_end();
+        return -EISDIR;
+    }
+    if(inode.flags & INODE_SNAPSHOT) {
+        journal_end();
+        return -EROFS;
+    }
+    if(size == inode.size) {
+        journal_end();
+        return 0;
+    }
+
+
+    // Step 2: An inline file zeroes what it drops and moves to a block if it grows too large
+    if(inode.flags & INODE_INLINE) {
+        if(size < inode.size) memset(inode.inline_data + size, 0, inode.size - size);
+        else if(size > (off_t)INLINE_MAX && inline_promote(&inode) < 0) DISK_ERROR = 1;
+    }
+
+
+    // Step 2b: A compressed file frees the clusters wholly past the new end and stores the last one again cut short
+    else if((inode.flags & INODE_COMPRESSED) && size < inode.size) {
+
+        int keep = (size + CLUSTER_SIZE - 1)/CLUSTER_SIZE;
+        ccache_drop(ino, keep);
+
+        alloc_acquire();
+        if(bmap_free(&inode, keep*CLUSTER_BLKS) < 0
+        || journal_write(superblock.d_bitmap_blk, d_bitmap) < 0
+        ) {
+            DISK_ERROR = 1;
+        }
+        pthread_mutex_unlock(&alloc_lock);
+        for(int c = keep; c < MAX_CLUSTERS; ++c) inode.cluster_len[c] = 0;
+
+        if(!DISK_ERROR && size%CLUSTER_SIZE && cluster_write(&inode, size/CLUSTER_SIZE, NULL, 0, 0, size) < 0) DISK_ERROR = 1;
+    }
+
+
+    // Step 3: When shrinking, free the blocks wholly past the new end, dropping a buffered one
+    else if(size < inode.size) {
+
+        int keep_blks = (size + BLOCK_SIZE - 1)/BLOCK_SIZE;
+        wb_discard_from(ino, keep_blks);
+
+        alloc_acquire();
+        if(bmap_free(&inode, keep_blks) < 0
+        || journal_write(superblock.d_bitmap_blk, d_bitmap) < 0
+        ) {
+            DISK_ERROR = 1;
+        }
+        pthread_mutex_unlock(&alloc_lock);
+
+
+        // Step 4: Zero the last block from the new end on
+        int tail = size%BLOCK_SIZE;
+        int blkno = tail && !DISK_ERROR ? bmap(&inode, size/BLOCK_SIZE, 0, NULL) : -1;
+        if(blkno >= 0 && blk_shared(blkno)) blkno = bmap_unshare(&inode, size/BLOCK_SIZE, blkno, 1);
+        if(blkno >= 0) {
+            char *zeros = calloc(1, BLOCK_SIZE - tail);
+            if(!zeros
+            || wb_write(ino, size/BLOCK_SIZE, blkno, 0, tail, zeros, BLOCK_SIZE - tail) < 0
+            ) {
+                DISK_ERROR = 1;
+            }
+            free(zeros);
+        }
+        else if(blkno == -2) DISK_ERROR = 1;
+    }
+
+
+    // Step 5: Update the inode info and write it to disk
+    if(!DISK_ERROR) {
+        inode.size = size;
+        inode.vstat.st_size = size;
+        inode_touch(&inode, TOUCH_MTIME | TOUCH_CTIME);
+        if(writei(ino, &inode) < 0) DISK_ERROR = 1;
+        else inode_dirty(ino, 1);
+    }
+    journal_end();
+    inode_data_changed(ino);
+
+
+    if(DISK_ERROR) return -EIO;
+    return 0;
+}
+
+int file_truncate(uint16_t ino, off_t size) {
+
+    inode_lock(ino, 1);
+    int retstat = file_truncate_locked(ino, size);
+    inode_unlock(ino);
+    return retstat;
+}
+
+// Set a file's atime and mtime, each either given, UTIME_NOW for the current time, or NULL to keep it.
+// ctime always becomes the current time.
+static int file_set_times_locked(uint16_t ino, const struct timespec *atime, const struct timespec *mtime) {
+
+    struct inode inode = {0};
+    int flags = TOUCH_CTIME;
+
+    journal_begin();
+    if(readi(ino, &inode) < 0) {
+        journal_end();
+        return -EIO;
+    }
+    if(inode.flags & INODE_SNAPSHOT) {
+        journal_end();
+        return -EROFS;
+    }
+
+    if(atime && atime->tv_nsec == UTIME_NOW) flags |= TOUCH_ATIME;
+    else if(atime) inode.vstat.st_atim = *atime;
+    if(mtime && mtime->tv_nsec == UTIME_NOW) flags |= TOUCH_MTIME;
+    else if(mtime) inode.vstat.st_mtim = *mtime;
+    inode_touch(&inode, flags);
+
+    int retstat = writei(ino, &inode) < 0 ? -EIO : 0;
+    if(!retstat) inode_dirty(ino, 0);
+    journal_end();
+    return retstat;
+}
+
+int file_set_times(uint16_t ino, const struct timespec *atime, const struct timespec *mtime) {
+
+    inode_lock(ino, 1);
+    int retstat = file_set_times_locked(ino, atime, mtime);
+    inode_unlock(ino);
+    return retstat;
+}
+
+// Report a file's attributes as chattr sees them: FS_COMPR_FL for a compressed file or directory
+int file_get_flags(uint16_t ino, int *fsflags) {
+
+    struct inode inode = {0};
+
+    if(readi(ino, &inode) < 0) return -EIO;
+    *fsflags = inode.flags & INODE_COMPRESSED ? FS_COMPR_FL : 0;
+    return 0;
+}
+
+// Set a file's attributes from chattr; FS_COMPR_FL is the only one. A file that becomes compressed
+// compresses what is written from then on; one that stops has its compressed clusters stored as is.
+static int file_set_flags_locked(uint16_t ino, int fsflags) {
+
+    int DISK_ERROR = 0;
+    struct inode inode = {0};
+
+    if(fsflags & ~FS_COMPR_FL) return -EOPNOTSUPP;
+
+
+    // Step 1: Write back a buffered block, which compressed reads and writes don't look for
+    if(wb_flush(ino) < 0) return -EIO;
+
+
+    // Step 2: Read the inode
+    // (storing clusters again and the inode update below commit as one journal transaction)
+    journal_begin();
+    if(readi(ino, &inode) < 0) {
+        journal_end();
+        return -EIO;
+    }
+    if(inode.flags & INODE_SNAPSHOT) {
+        journal_end();
+        return -EROFS;
+    }
+    int compress = (fsflags & FS_COMPR_FL) != 0;
+    if(compress == ((inode.flags & INODE_COMPRESSED) != 0)) {
+        journal_end();
+        return 0;
+    }
+    int has_clusters = inode.type == file && !(inode.flags & INODE_INLINE);
+
+
+    // Step 3: Change the flag. Every cluster of a file that wasn't compressed is stored as is; one that
+    // stops being compressed is stored as is again, one cluster at a time
+    if(compress) {
+        inode.flags |= INODE_COMPRESSED;
+        if(has_clusters) memset(inode.cluster_len, 0, sizeof(inode.cluster_len));
+
+        // clusters stored as is are read straight from their blocks, so preallocated ones are zeroed on disk
+        char *zeros = has_clusters ? calloc(1, BLOCK_SIZE) : NULL;
+        if(has_clusters && !zeros) DISK_ERROR = 1;
+        for(int k = 0; zeros && k < MAX_FILE_BLKS && !DISK_ERROR; ++k) {
+            if(!get_bitmap(inode.unwritten, k)) continue;
+            int blkno = bmap(&inode, k, 0, NULL);
+            if(blkno == -2 || (blkno >= 0 && bio_write(superblock.d_start_blk + blkno, zeros) < 0)) DISK_ERROR = 1;
+            else {
+                if(blkno >= 0) inode_dirty_blk(ino, blkno);
+                unset_bitmap(inode.unwritten, k);
+            }
+        }
+        free(zeros);
+    } else {
+        inode.flags &= ~INODE_COMPRESSED;
+        for(int c = 0; has_clusters && c < MAX_CLUSTERS && !DISK_ERROR; ++c) {
+            if(inode.cluster_len[c] && cluster_write(&inode, c, NULL, 0, 0, inode.size) < 0) DISK_ERROR = 1;
+        }
+        if(has_clusters) ccache_drop(ino, 0);
+    }
+
+
+    // Step 4: Update ctime and write the inode to disk. Clusters already stored again moved to new blocks,
+    // so after a failure the inode is still written, as a compressed file with those clusters stored as is
+    if(DISK_ERROR) inode.flags |= INODE_COMPRESSED;
+    else inode_touch(&inode, TOUCH_CTIME);
+    if(writei(ino, &inode) < 0) DISK_ERROR = 1;
+    else inode_dirty(ino, 1);
+    journal_end();
+
+    // the kernel only sees an ioctl, so it is told the file's attributes changed
+    if(notify_inval_inode) notify_inval_inode(ino);
+
+
+    if(DISK_ERROR) return -EIO;
+    return 0;
+}
+
+int file_set_flags(uint16_t ino, int fsflags) {
+
+    inode_lock(ino, 1);
+    int retstat = file_set_flags_locked(ino, fsflags);
+    inode_unlock(ino);
+    return retstat;
+}
+
+// Reserve blocks for len bytes of a file from offset, or with FALLOC_FL_PUNCH_HOLE free them. Reserved blocks
+// are allocated in runs that are adjacent on disk and read as zeros until written; the file grows over them
+// unless FALLOC_FL_KEEP_SIZE is given. A hole is punched within the file's size, which it keeps.
+static int file_fallocate_locked(uint16_t ino, int mode, off_t offset, off_t len) {
+
+    int DISK_ERROR = 0;
+    int NO_SPACE = 0;
+    int MAP_CHANGED = 0;
+
+    struct inode inode = {0};
+    int punch = (mode & FALLOC_FL_PUNCH_HOLE) != 0;
+
+    if(offset < 0 || len <= 0) return -EINVAL;
+    if(mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE)) return -EOPNOTSUPP;
+    if(punch && !(mode & FALLOC_FL_KEEP_SIZE)) return -EOPNOTSUPP;
+    if(offset + len > (off_t)MAX_FILE_BLKS*BLOCK_SIZE) return -EFBIG;
+
+
+    // Step 1: Read the inode
+    // (the block allocations or frees and the inode update below commit as one journal transaction)
+    journal_begin();
+    if(readi(ino, &inode) < 0) {
+        journal_end();
+        return -EIO;
+    }
+    if(inode.type == directory) {
+        journal_end();
+        return -EISDIR;
+    }
+    if(inode.flags & INODE_SNAPSHOT) {
+        journal_end();
+        return -EROFS;
+    }
+    if(inode.flags & INODE_COMPRESSED) {
+        journal_end();
+        return -EOPNOTSUPP;
+    }
+    off_t end = offset + len;
+    off_t old_size = inode.size;
+
+
+    // Step 2: Punch the hole: an inline file zeroes the range in the inode, any other frees the whole blocks
+    // it covers and zeroes the partial ones at either end once the transaction is over
+    off_t head_end = offset;
+    off_t tail_start = end;
+    if(punch) {
+
+        if(end > inode.size) end = inode.size;
+        if(offset >= end) {
+            journal_end();
+            return 0;
+        }
+
+        if(inode.flags & INODE_INLINE) {
+            memset(inode.inline_data + offset, 0, end - offset);
+            head_end = tail_start = offset;
+        } else {
+            int first_blk = (offset + BLOCK_SIZE - 1)/BLOCK_SIZE;
+            int last_blk = end/BLOCK_SIZE;
+            head_end = (off_t)first_blk*BLOCK_SIZE;
+            tail_start = (off_t)last_blk*BLOCK_SIZE;
+            if(head_end > end) head_end = end;
+            if(tail_start < head_end) tail_start = head_end;
+
+            for(int k = first_blk; k < last_blk; ++k) {
+                int blkno = bmap(&inode, k, 0, NULL);
+                if(blkno == -2) {
+                    DISK_ERROR = 1;
+                    break;
+                }
+                unset_bitmap(inode.unwritten, k);
+                if(blkno < 0) continue;
+
+                wb_discard(ino, k);
+                if(bmap_set(&inode, k, -1) < 0) {
+                    DISK_ERROR = 1;
+                    break;
+                }
+                alloc_acquire();
+                blk_free(blkno);
+                pthread_mutex_unlock(&alloc_lock);
+                MAP_CHANGED = 1;
+            }
+
+            alloc_acquire();
+            if(MAP_CHANGED && journal_write(superblock.d_bitmap_blk, d_bitmap) < 0) DISK_ERROR = 1;
+            pthread_mutex_unlock(&alloc_lock);
+
+            // a partial block that is a hole or preallocated already reads as zeros
+            int head_blk = offset/BLOCK_SIZE;
+            int tail_blk = tail_start/BLOCK_SIZE;
+            if(head_end > offset && (bmap(&inode, head_blk, 0, NULL) == -1 || get_bitmap(inode.unwritten, head_blk))) head_end = offset;
+            if(tail_start < end && (bmap(&inode, tail_blk, 0, NULL) == -1 || get_bitmap(inode.unwritten, tail_blk))) tail_start = end;
+        }
+        inode_touch(&inode, TOUCH_MTIME | TOUCH_CTIME);
+    }
+
+
+    // Step 3: Or preallocate: a range that fits in an inline file is already there,
+    // otherwise each run of unmapped blocks in the range gets blocks that are adjacent on disk
+    else {
+
+        if((inode.flags & INODE_INLINE) && end > (off_t)INLINE_MAX && inline_promote(&inode) < 0) DISK_ERROR = 1;
+
+        int first_blk = offset/BLOCK_SIZE;
+        int nblks = (end - 1)/BLOCK_SIZE - first_blk + 1;
+        int *blknos = NULL;
+        if(!DISK_ERROR && !(inode.flags & INODE_INLINE)) {
+            blknos = malloc(nblks*sizeof(int));
+            if(!blknos || bmap_range(&inode, first_blk, nblks, 0, blknos, NULL) < nblks) DISK_ERROR = 1;
+        }
+
+        int goal = blk_goal(&inode);
+        for(int k = 0; blknos && k < nblks && !DISK_ERROR && !NO_SPACE; ) {
+            if(blknos[k] >= 0) {
+                goal = blknos[k++] + 1;
+                continue;
+            }
+            int want = 1;
+            while(k + want < nblks && blknos[k + want] < 0) ++want;
+
+            int got = 0;
+            int blkno = get_avail_blkno_run(goal, want, &got);
+            if(blkno < 0) {
+                NO_SPACE = 1;
+                break;
+            }
+            for(int r = 0; r < got; ++r) {
+                if(bmap_set(&inode, first_blk + k + r, blkno + r) < 0) {
+                    // the blocks not yet mapped go back to the free pool
+                    alloc_acquire();
+                    for(int f = r; f < got; ++f) blk_free(blkno + f);
+                    if(journal_write(superblock.d_bitmap_blk, d_bitmap) < 0) DISK_ERROR = 1;
+                    pthread_mutex_unlock(&alloc_lock);
+                    DISK_ERROR = 1;
+                    break;
+                }
+                set_bitmap(inode.unwritten, first_blk + k + r);
+                MAP_CHANGED = 1;
+            }
+            goal = blkno + got;
+            k += got;
+        }
+        free(blknos);
+
+        if(!(mode & FALLOC_FL_KEEP_SIZE) && !DISK_ERROR && !NO_SPACE && end > inode.size) {
+            inode.size = end;
+            inode.vstat.st_size = inode.size;
+            MAP_CHANGED = 1;
+        }
+        inode_touch(&inode, inode.size != old_size ? TOUCH_MTIME | TOUCH_CTIME : TOUCH_CTIME);
+    }
+
+
+    // Step 4: Write the inode to disk
+    if(writei(ino, &inode) < 0) DISK_ERROR = 1;
+    else inode_dirty(ino, 1);
+    journal_end();
+
+
+    // Step 5: Zero the parts of blocks at either end of a punched hole, which stay allocated
+    if(!DISK_ERROR && (head_end > offset || tail_start < end)) {
+        char *zeros = calloc(1, BLOCK_SIZE);
+        if(!zeros) DISK_ERROR = 1;
+        if(zeros && head_end > offset && file_write_locked(ino, zeros, head_end - offset, offset) < 0) DISK_ERROR = 1;
+        if(zeros && tail_start < end && file_write_locked(ino, zeros, end - tail_start, tail_start) < 0) DISK_ERROR = 1;
+        free(zeros);
+    }
+    if(punch || MAP_CHANGED) inode_data_changed(ino);
+
+
+    if(DISK_ERROR) return -EIO;
+    if(NO_SPACE) return -ENOSPC;
+    return 0;
+}
+
+int file_fallocate(uint16_t ino, int mode, off_t offset, off_t len) {
+
+    inode_lock(ino, 1);
+    int retstat = file_fallocate_locked(ino, mode, offset, len);
+    inode_unlock(ino);
+    return retstat;
+}
+
+// Point count whole blocks of dst_ino from dst_blk at the blocks of src_ino from src_blk, taking a reference
+// to each and dropping the ones dst_ino had; holes in the source punch holes. Returns the number of blocks
+// cloned, 0 if either file's blocks can't be shared (inline or compressed data), or -errno. It stops early at a
+// block whose reference count is full, which the caller copies instead.
+static int clone_blocks(uint16_t src_ino, int src_blk, uint16_t dst_ino, int dst_blk, int count) {
+
+    int DISK_ERROR = 0;
+    struct inode src = {0};
+    struct inode dst = {0};
+    int cloned = 0;
+
+
+    // Step 1: Read both inodes; a destination still inline moves its data to a block first
+    // (the new block pointers and the destination inode commit as one journal transaction)
+    journal_begin();
+    if(readi(src_ino, &src) < 0 || readi(dst_ino, &dst) < 0) {
+        journal_end();
+        return -EIO;
+    }
+    if((src.flags & (INODE_INLINE | INODE_COMPRESSED)) || (dst.flags & INODE_COMPRESSED)) {
+        journal_end();
+        return 0;
+    }
+    if((dst.flags & INODE_INLINE) && inline_promote(&dst) < 0) {
+        journal_end();
+        return -EIO;
+    }
+
+
+    // Step 2: Share each source block, dropping a buffered copy of the block it replaces
+    for(; cloned < count; ++cloned) {
+
+        int src_blkno = bmap(&src, src_blk + cloned, 0, NULL);
+        int dst_blkno = bmap(&dst, dst_blk + cloned, 0, NULL);
+        if(src_blkno == -2 || dst_blkno == -2) {
+            DISK_ERROR = 1;
+            break;
+        }
+
+        // a preallocated source block holds nothing yet, so it clones as a hole
+        if(get_bitmap(src.unwritten, src_blk + cloned)) src_blkno = -1;
+        if(src_blkno == dst_blkno) continue;
+
+        if(src_blkno >= 0) {
+            alloc_acquire();
+            int full = ref_get(src_blkno) < 0;
+            pthread_mutex_unlock(&alloc_lock);
+            if(full) break;
+        }
+
+        wb_discard(dst_ino, dst_blk + cloned);
+        int retstat = bmap_set(&dst, dst_blk + cloned, src_blkno);
+
+        alloc_acquire();
+        if(retstat < 0 && src_blkno >= 0) blk_free(src_blkno);
+        else if(retstat == 0 && dst_blkno >= 0) blk_free(dst_blkno);
+        pthread_mutex_unlock(&alloc_lock);
+
+        if(retstat < 0) {
+            DISK_ERROR = 1;
+            break;
+        }
+        unset_bitmap(dst.unwritten, dst_blk + cloned);
+    }
+
+
+    // Step 3: Persist the freed blocks, then grow the destination over the cloned range
+    alloc_acquire();
+    if(journal_write(superblock.d_bitmap_blk, d_bitmap) < 0) DISK_ERROR = 1;
+    pthread_mutex_unlock(&alloc_lock);
+
+    if((uint32_t)(dst_blk + cloned)*BLOCK_SIZE > dst.size) {
+        dst.size = (dst_blk + cloned)*BLOCK_SIZE;
+        dst.vstat.st_size = dst.size;
+    }
+    inode_touch(&dst, TOUCH_MTIME | TOUCH_CTIME);
+    if(writei(dst_ino, &dst) < 0) DISK_ERROR = 1;
+    else inode_dirty(dst_ino, 1);
+    journal_end();
+    inode_data_changed(dst_ino);
+
+
+    if(DISK_ERROR && !cloned) return -EIO;
+    return cloned;
+}
+
+// Copy len bytes of src_ino from src_off into dst_ino at dst_off without a round trip through the kernel,
+// stopping at the end of the source. With clone, whole blocks at block-aligned offsets are shared with
+// reference counts instead of copied, and either file copies a shared block before writing it.
+// Returns the number of bytes copied, or -errno.
+static int file_copy_range_locked(uint16_t src_ino, off_t src_off, uint16_t dst_ino, off_t dst_off, size_t len, int clone) {
+
+    struct inode src = {0};
+    struct inode dst = {0};
+    size_t done = 0;
+
+
+    // Step 1: Check both are files and the ranges are usable, cutting the copy short at the source's end
+    if(src_off < 0 || dst_off < 0) return -EINVAL;
+    if(readi(src_ino, &src) < 0 || readi(dst_ino, &dst) < 0) return -EIO;
+    if(src.type != file || dst.type != file) return -EISDIR;
+    if(dst.flags & INODE_SNAPSHOT) return -EROFS;
+    if(src_off >= src.size) return 0;
+    if(len > src.size - src_off) len = src.size - src_off;
+    if(dst_off + len > (off_t)MAX_FILE_BLKS*BLOCK_SIZE) return -EFBIG;
+    if(src_ino == dst_ino && src_off < dst_off + (off_t)len && dst_off < src_off + (off_t)len) return -EINVAL;
+
+    char *buf = malloc(CLUSTER_SIZE);
+    if(!buf) {
+        ERROR("Failed to allocate memory");
+        return -ENOMEM;
+    }
+
+
+    // Step 2: Write back the source's buffered block, so its blocks on disk are current
+    if(wb_flush(src_ino) < 0) {
+        free(buf);
+        return -EIO;
+    }
+
 
+    // Step 3: Clone or copy a cluster at a time
+    while(done < len) {
 
-	// Step 3: If exist, then remove it from dir_inode's data block and write to disk
-    memcpy(ptr_blk, dir_inode.direct_ptr, sizeof(dir_inode.direct_ptr));
-    for(int i = -1; i < 8; ) {
-        for(int j = 0; j < 16; ++j) {
+        size_t chunk = len - done < CLUSTER_SIZE ? len - done : CLUSTER_SIZE;
 
-            // if we reached unused section of the pointer array
-            if(ptr_blk[j] < 0) break;
 
-            // read the directory entry block from the pointer array entry
-            if(bio_read(superblock.d_start_blk + ptr_blk[j], dirent_blk) < 0) {
-                DISK_ERROR = 1;
-                break;
+        // share the whole blocks of an aligned chunk, copying only what couldn't be shared
+        if(clone && !((src_off + done)%BLOCK_SIZE) && !((dst_off + done)%BLOCK_SIZE) && chunk >= BLOCK_SIZE) {
+            int cloned = clone_blocks(src_ino, (src_off + done)/BLOCK_SIZE, dst_ino, (dst_off + done)/BLOCK_SIZE, chunk/BLOCK_SIZE);
+            if(cloned < 0) {
+                if(done && notify_inval_inode) notify_inval_inode(dst_ino);
+                free(buf);
+                return done ? (int)done : cloned;
+            }
+            if(cloned) {
+                done += (size_t)cloned*BLOCK_SIZE;
+                continue;
             }
+        }
 
-            // check directory entry block for the directory we want to remove
-            for(int k = 0; k < dirents_per_blk; ++k) {
 
-                // if we reached unused section of directory entry block
-                if(!dirent_blk[k].valid) break;
+        // otherwise read the source into memory and write it like any write, which shares blocks with -o dedup
+        if(readi(src_ino, &src) < 0) break;
+        int nread = file_read_locked(&src, buf, chunk, src_off + done);
+        if(nread <= 0) break;
+        int nwritten = file_write_locked(dst_ino, buf, nread, dst_off + done);
+        if(nwritten < 0) {
+            if(done && notify_inval_inode) notify_inval_inode(dst_ino);
+            free(buf);
+            return done ? (int)done : nwritten;
+        }
+        done += nwritten;
+        if(nwritten < nread) break;
+    }
 
-                // if the directory entry matches the directory we want to remove
-                if(!strcmp(dirent_blk[k].name, f_basename)) {
+    // the kernel only sees an ioctl, so it is told the destination's size, times and pages changed
+    if(done && notify_inval_inode) notify_inval_inode(dst_ino);
 
-                    int DELETE_BLOCK = 1;
 
-                    // invalidate directory
-                    dirent_blk[k].valid = 0;
+    free(buf);
+    return done;
+}
 
-                    // check if there are no valid directory entries left in the block
-                    for(int l = 0; l < k; ++l) {
+// Both files are locked, the lower inode number first, since a clone changes the source's reference counts too
+int file_copy_range(uint16_t src_ino, off_t src_off, uint16_t dst_ino, off_t dst_off, size_t len, int clone) {
 
-                        // if there exists valid directory entries
-                        if(!dirent_blk[l].valid) {
-                            DELETE_BLOCK = 0;
-                            break;
-                        }
-                    }
+    uint16_t first = src_ino < dst_ino ? src_ino : dst_ino;
+    uint16_t second = src_ino < dst_ino ? dst_ino : src_ino;
 
-                    // continue checking for directory entries and shift valid entries down by one
-                    for(int l = k+1; l < dirents_per_blk; ++l) {
+    inode_lock(first, 1);
+    if(second != first) inode_lock(second, 1);
+    int retstat = file_copy_range_locked(src_ino, src_off, dst_ino, dst_off, len, clone);
+    if(second != first) inode_unlock(second);
+    inode_unlock(first);
+    return retstat;
+}
 
-                        // if the directory entry is valid
-                        if(dirent_blk[l].valid) {
-                            DELETE_BLOCK = 0;
-                            memcpy(&dirent_blk[l-1], &dirent_blk[l], sizeof(struct dirent));
-                        } else break;
-                    }
 
-                    // if there are no valid directory entries in the block
-                    // and if the pointer block is from an indirect pointer entry
-                    if(DELETE_BLOCK && (i >= 0)) {
-
-                        // clear block in disk
-                        memset(ptr_blk, 0, BLOCK_SIZE);
-                        if(bio_write((superblock.d_start_blk + dir_inode.indirect_ptr[i]), ptr_blk) < 0) {
-                            DISK_ERROR = 1;
-                            break;
-                        }
-
-                        // update data bitmap
-                        unset_bitmap(d_bitmap, dir_inode.indirect_ptr[i]);
-                        if(bio_write(superblock.d_bitmap_blk, d_bitmap) < 0) {
-                            DISK_ERROR = 1;
-                            break;
-                        }
-
-                        // update inode size
-                        dir_inode.size -= BLOCK_SIZE;
-                        dir_inode.vstat.st_size -= BLOCK_SIZE;
-                        dir_inode.vstat.st_blocks--;
-
-                    } else {
-
-                        // clear direct pointer block
-                        memset(dir_inode.direct_ptr, 0, sizeof(dir_inode.direct_ptr));
-                    }
+/*
+ * defrag operations
+ */
+// Count the runs of adjacent data blocks a block map makes in file order; holes don't end a run.
+// Sets *mapped to the number of blocks mapped.
+static int bmap_extents(const int *blknos, int nblks, int *mapped) {
+
+    int extents = 0;
+    int prev = -2;
+
+    *mapped = 0;
+    for(int k = 0; k < nblks; ++k) {
+        if(blknos[k] < 0) continue;
+        if(blknos[k] != prev + 1) ++extents;
+        prev = blknos[k];
+        ++*mapped;
+    }
+    return extents;
+}
 
-                    // update directory inode
-                    dir_inode.link--;
-                    if(writei(dir_inode.ino, &dir_inode) < 0) {
-                        DISK_ERROR = 1;
-                        break;
-                    }
+// Move a file in more than one extent into a single run of free blocks, in file order. The contents are
+// copied before the block map is switched in the running transaction, and the old blocks aren't handed out
+// until it commits, so a crash leaves the file on either its old blocks or its new ones.
+// Files sharing blocks, and snapshots, are only measured. The caller holds journal_lock().
+static int defrag_file(struct inode *inode, struct tfs_defrag *defrag) {
+
+    int DISK_ERROR = 0;
+    int blknos[MAX_FILE_BLKS];
+    int *ptr_blk[8] = {NULL};
+    int extents = 0;
+    int mapped = 0;
+    int got = 0;
 
 
-                    DIRECTORY_REMOVED = 1;
-                    break;
-                }
-            }
-        }
+    // Step 1: Map the whole file, including blocks preallocated past its end, and count its extents
+    if(!(inode->flags & INODE_INLINE)) {
+        if(bmap_range(inode, 0, MAX_FILE_BLKS, 0, blknos, NULL) < MAX_FILE_BLKS) return -1;
+        extents = bmap_extents(blknos, MAX_FILE_BLKS, &mapped);
+    }
+    ++defrag->files;
+    defrag->extents_before += extents;
+    if(extents > 1) ++defrag->frag_before;
 
-        // if the directory has been added or if a disk error occurred
-        if(DIRECTORY_REMOVED || DISK_ERROR) break;
 
-        // if we haven't checked all indirect array entries
-        // else, all directory entries are in use
-        if((++i) < 8) {
+    // Step 2: Allocate a run long enough for every block, or leave the file where it is
+    int movable = extents > 1 && !(defrag->flags & TFS_DEFRAG_DRY_RUN) && !(inode->flags & INODE_SNAPSHOT);
+    for(int k = 0; movable && k < MAX_FILE_BLKS; ++k) {
+        if(blknos[k] >= 0 && blk_shared(blknos[k])) movable = 0;
+    }
 
-            // if the unused section of the indirect array has been reached, break outer loop
-            if(dir_inode.indirect_ptr[i] < 0) break;
+    int start = movable ? get_avail_blkno_run(blk_goal(inode), mapped, &got) : -1;
+    if(start >= 0 && got < mapped) {
+        alloc_acquire();
+        for(int n = 0; n < got; ++n) blk_free(start + n);
+        journal_write(superblock.d_bitmap_blk, d_bitmap);
+        pthread_mutex_unlock(&alloc_lock);
+        start = -1;
+    }
+    if(start < 0) {
+        defrag->extents_after += extents;
+        if(extents > 1) ++defrag->frag_after;
+        return 0;
+    }
 
-            // read pointer array block from the indirect array entry
-            if(bio_read((superblock.d_start_blk + dir_inode.indirect_ptr[i]), ptr_blk)) {
-                DISK_ERROR = 1;
-                break;
-            }
-        } else {
-            ERROR("Directory to remove not found");
+    char *data = malloc((size_t)mapped*BLOCK_SIZE);
+    if(!data) {
+        ERROR("Failed to allocate memory");
+        DISK_ERROR = 1;
+    }
+
+
+    // Step 3: Read the blocks in file order and write them out as one run, then load the pointer arrays
+    for(int k = 0, n = 0; !DISK_ERROR && k < MAX_FILE_BLKS; ++k) {
+        if(blknos[k] < 0) continue;
+        if(bio_read(superblock.d_start_blk + blknos[k], data + (size_t)n*BLOCK_SIZE) < 0) DISK_ERROR = 1;
+        ++n;
+    }
+    struct iovec iov = { .iov_base = data, .iov_len = (size_t)mapped*BLOCK_SIZE };
+    if(!DISK_ERROR && bio_writev(superblock.d_start_blk + start, &iov, 1) < 0) DISK_ERROR = 1;
+
+    for(int i = 0; !DISK_ERROR && i < 8; ++i) {
+        if(inode->indirect_ptr[i] < 0) continue;
+        if(!(ptr_blk[i] = malloc(BLOCK_SIZE))
+        || journal_read(superblock.d_start_blk + inode->indirect_ptr[i], ptr_blk[i]) < 0
+        ) {
+            DISK_ERROR = 1;
         }
     }
 
-    free(fname_CPY1);
-    free(fname_CPY2);
-    free(dirent_blk);
-    free(ptr_blk);
+    // nothing points at the run yet, so it goes back on failure
     if(DISK_ERROR) {
-        ERROR("Failed to remove directory");
+        alloc_acquire();
+        for(int n = 0; n < mapped; ++n) blk_free(start + n);
+        journal_write(superblock.d_bitmap_blk, d_bitmap);
+        pthread_mutex_unlock(&alloc_lock);
+        for(int i = 0; i < 8; ++i) free(ptr_blk[i]);
+        free(data);
         return -1;
     }
-    if(!DIRECTORY_REMOVED) {
-        ERROR("Directory doesn't exists");
-        return -1;
+
+
+    // Step 4: Point the file at the run, a pointer array at a time, keeping which blocks are preallocated
+    for(int k = 0, n = 0; k < MAX_FILE_BLKS; ++k) {
+        if(blknos[k] < 0) continue;
+        if(k < 16) inode->direct_ptr[k] = start + n;
+        else ptr_blk[(k - 16)/PTRS_PER_BLK][(k - 16)%PTRS_PER_BLK] = start + n;
+        inode_dirty_blk(inode->ino, start + n);
+        ++n;
+    }
+    for(int i = 0; i < 8; ++i) {
+        if(ptr_blk[i] && journal_write(superblock.d_start_blk + inode->indirect_ptr[i], ptr_blk[i]) < 0) DISK_ERROR = 1;
     }
-	return 0;
-}
 
-/* 
- * namei operation
- */
-int get_node_by_path(const char *path, uint16_t ino, struct inode *inode) {
 
-    struct dirent dirent = {0};
+    // Step 5: Free the old blocks and write the inode
+    alloc_acquire();
+    for(int k = 0; k < MAX_FILE_BLKS; ++k) {
+        if(blknos[k] >= 0) blk_free(blknos[k]);
+    }
+    if(journal_write(superblock.d_bitmap_blk, d_bitmap) < 0) DISK_ERROR = 1;
+    pthread_mutex_unlock(&alloc_lock);
 
-	// Step 1: Resolve the path name, walk through path, and finally, find its inode.
-	// Note: You could either implement it in a iterative way or recursive way
-    if(dir_find(0, path, strlen(path), &dirent) < 0) return -1;
-    readi(dirent.ino, inode);
+    if(writei(inode->ino, inode) < 0) DISK_ERROR = 1;
+    else inode_dirty(inode->ino, 1);
 
+    defrag->extents_after += 1;
+    defrag->blks_moved += mapped;
 
-	return 0;
+
+    for(int i = 0; i < 8; ++i) free(ptr_blk[i]);
+    free(data);
+    if(DISK_ERROR) return -1;
+    return 0;
 }
 
-/* 
- * Make file system
- */
-int tfs_mkfs() {
+// Pack a directory's entries into as few of its blocks as hold them and free the rest, which removing
+// entries leaves empty or nearly so. The entries keep their order, so listing offsets stay valid.
+// The caller holds journal_lock().
+static int defrag_dir(struct inode *dir_inode, struct tfs_defrag *defrag) {
 
     int DISK_ERROR = 0;
-    void *blk = calloc(1, BLOCK_SIZE);
-    if(!blk) {
-        ERROR("Failed to allocate memory");
-        return -1;
-    }
+    int blknos[MAX_FILE_BLKS];
+    int nblks = 0;
 
-	// Call dev_init() to initialize (Create) Diskfile
-    dev_init(diskfile_path);
+    if(dir_inode->flags & (INODE_INLINE | INODE_SNAPSHOT) || defrag->flags & TFS_DEFRAG_DRY_RUN) return 0;
 
 
-	// write superblock information
-    superblock = (struct superblock) {
-        .magic_num = MAGIC_NUM,
-        .max_inum = MAX_INUM,
-        .max_dnum = MAX_DNUM,
-        .i_bitmap_blk = 1,
-        .d_bitmap_blk = 2,
-        .i_start_blk = 3,
-        .d_start_blk = (2 + ((MAX_INUM/i_per_blk) + (!(MAX_INUM%i_per_blk)))) + 1
-    };
-    memcpy(blk, &superblock, sizeof(struct superblock));
-    if(bio_write(0, blk) < 0) {
-        free(blk);
+    // Step 1: Count the blocks, which are mapped from the first on with no holes, and collect the entries
+    if(bmap_range(dir_inode, 0, MAX_FILE_BLKS, 0, blknos, NULL) < MAX_FILE_BLKS) return -1;
+    while(nblks < MAX_FILE_BLKS && blknos[nblks] >= 0) ++nblks;
+
+    struct spill_ctx ctx = { .n = 0 };
+    ctx.dirents = malloc((size_t)nblks*BLOCK_SIZE);
+    if(!ctx.dirents) {
+        ERROR("Failed to allocate memory");
         return -1;
     }
-
-
-    // initialize inode bitmap
-    memset(blk, 0, BLOCK_SIZE);
-    memcpy(blk, i_bitmap, sizeof(i_bitmap));
-    if(bio_write(superblock.i_bitmap_blk, blk) < 0) {
-        free(blk);
+    if(dir_iterate(dir_inode, spill_collect, &ctx) < 0) {
+        free(ctx.dirents);
         return -1;
     }
 
+    int needed = (ctx.n + dirents_per_blk - 1)/dirents_per_blk;
+    if(needed < 1) needed = 1;
+    if(needed >= nblks) {
+        free(ctx.dirents);
+        return 0;
+    }
 
-	// initialize data block bitmap
-    memset(blk, 0, BLOCK_SIZE);
-    memcpy(blk, d_bitmap, sizeof(d_bitmap));
-    if(bio_write(superblock.d_bitmap_blk, blk) < 0) {
-        free(blk);
+
+    // Step 2: Rewrite the first blocks packed, in the same transaction as freeing the others
+    if(journal_reserve(needed + DEFRAG_TX_BLKS) < 0) {
+        free(ctx.dirents);
         return -1;
     }
+    for(int j = 0; !DISK_ERROR && j < needed; ++j) {
 
+        char *dirent_blk = (char *)&ctx.dirents[j*dirents_per_blk];
+        int cnt = ctx.n - j*dirents_per_blk < dirents_per_blk ? ctx.n - j*dirents_per_blk : dirents_per_blk;
 
-    // update inode for root directory
-    int dirent_blks = (3/dirents_per_blk) + ((3%dirents_per_blk) != 0);
-    struct inode root_inode = {
-        .ino = 0,
-        .valid = 1,
-        .size = dirent_blks*BLOCK_SIZE,
-        .type = directory,
-        .link = 2,
-        .vstat = {
-                .st_ino = 0,
-                .st_mode = S_IFDIR | 0755,
-                .st_nlink = 2,
-                .st_blksize = BLOCK_SIZE,
-                .st_blocks = dirent_blks,
-                .st_size = dirent_blks*BLOCK_SIZE,
-        }
-    };
-    time(&root_inode.vstat.st_atime);
-    time(&root_inode.vstat.st_mtime);
-    time(&root_inode.vstat.st_ctime);
-    // initialize inode direct and indirect pointer arrays
-    for(int i = 0; i < 8; ++i) {
-        root_inode.direct_ptr[i] = -1;
-        root_inode.direct_ptr[15-i] = -1;
-        root_inode.indirect_ptr[i] = -1;
-    }
-    // update root directory's bitmap
-    set_bitmap(i_bitmap, 0);
-    memset(blk, 0, BLOCK_SIZE);
-    memcpy(blk, i_bitmap, sizeof(i_bitmap));
-    if(bio_write(superblock.i_bitmap_blk, blk) < 0) {
-        free(blk);
-        return -1;
+        // entries past the last collected are cleared, ending the block
+        memset(dirent_blk + cnt*sizeof(struct dirent), 0, BLOCK_SIZE - cnt*sizeof(struct dirent));
+        if(journal_write(superblock.d_start_blk + blknos[j], dirent_blk) < 0) DISK_ERROR = 1;
     }
+    free(ctx.dirents);
+    if(DISK_ERROR) return -1;
 
 
-    // link directory entry blocks to pointer arrays
-    if(dir_add(root_inode, root_inode.ino, ".", strlen("."))
-    || readi(root_inode.ino, &root_inode) < 0
-    || dir_add(root_inode, root_inode.ino, "..", strlen(".."))
+    // Step 3: Free the blocks after them, and the pointer arrays left empty, then write the inode
+    alloc_acquire();
+    if(bmap_free(dir_inode, needed) < 0
+    || journal_write(superblock.d_bitmap_blk, d_bitmap) < 0
     ) {
         DISK_ERROR = 1;
     }
+    pthread_mutex_unlock(&alloc_lock);
 
+    dir_inode->size = needed*BLOCK_SIZE;
+    dir_inode->vstat.st_size = dir_inode->size;
+    dir_inode->vstat.st_blocks = dir_inode->size/BLOCK_SIZE;
+    if(writei(dir_inode->ino, dir_inode) < 0) DISK_ERROR = 1;
+    else inode_dirty(dir_inode->ino, 0);
+    if(notify_inval_inode) notify_inval_inode(dir_inode->ino);
 
-    free(blk);
-    if(DISK_ERROR) {
-        ERROR("Failed to initialize disk");
-        return -1;
-    }
-	return 0;
+    ++defrag->dirs_compacted;
+    defrag->dir_blks_freed += nblks - needed;
+
+
+    if(DISK_ERROR) return -1;
+    return 0;
 }
 
+struct defrag_ctx {
+    uint16_t *queue;                /* inodes to do, in the order found */
+    int n;
+    bitmap_t seen;                  /* inodes queued, so a hard linked file is done once */
+};
 
-/* 
- * FUSE file operations
- */
-static void *tfs_init(struct fuse_conn_info *conn) {
+static int defrag_collect(const struct dirent *dirent, void *arg) {
 
-    // Step 1a: If disk file is not found, call mkfs
-    if(dev_open(diskfile_path) < 0) {
-        if(tfs_mkfs() < 0) exit(EXIT_FAILURE);
-        return NULL;
-    }
+    struct defrag_ctx *ctx = arg;
 
+    if(!strcmp(dirent->name, ".") || !strcmp(dirent->name, "..") || dir_hidden(dirent)) return 0;
+    if(get_bitmap(ctx->seen, dirent->ino)) return 0;
+    set_bitmap(ctx->seen, dirent->ino);
+    ctx->queue[ctx->n++] = dirent->ino;
+    return 0;
+}
 
-    // Step 1b: If disk file is found, just initialize in-memory data structures
-    // and read superblock from disk
-    if((bio_read(0, &superblock)) < 0) {
-        ERROR("Failed to read disk");
-        exit(EXIT_FAILURE);
-    }
+// Defragment ino, or for a directory everything below it but the snapshot directory, adding up what was
+// found and done in defrag, whose counts the caller zeroes. Each inode is done under journal_lock(), so
+// operations wait only for the one being moved, not the whole walk. Returns 0 or -errno.
+int fs_defrag(uint16_t ino, struct tfs_defrag *defrag) {
 
-    if(superblock.magic_num != MAGIC_NUM) {
-        ERROR( "Disk's filesystem is not recognized");
-        exit(EXIT_FAILURE);
+    int DISK_ERROR = 0;
+    struct inode inode = {0};
+
+    struct defrag_ctx ctx = { .n = 0 };
+    ctx.queue = malloc(MAX_INUM*sizeof(uint16_t));
+    ctx.seen = calloc(1, MAX_INUM/8);
+    if(!ctx.queue
+    || !ctx.seen
+    ) {
+        if(ctx.queue) free(ctx.queue);
+        if(ctx.seen)  free(ctx.seen);
+        ERROR("Failed to allocate memory");
+        return -ENOMEM;
     }
+    ctx.queue[ctx.n++] = ino;
+    set_bitmap(ctx.seen, ino);
 
 
-    unsigned char *bitmap_blk = malloc(BLOCK_SIZE);
-    if(!bitmap_blk) {
-        ERROR("Failed to allocate memory");
-        exit(EXIT_FAILURE);
+    // Take the inodes breadth first: a directory is compacted and its entries queued in one go, and a file's
+    // buffered block is written back before its map is read
+    for(int q = 0; q < ctx.n && !DISK_ERROR; ++q) {
+
+        inode_lock(ctx.queue[q], 1);
+        journal_lock();
+        if(journal_reserve(DEFRAG_TX_BLKS) < 0
+        || wb_flush(ctx.queue[q]) < 0
+        || readi(ctx.queue[q], &inode) < 0
+        ) {
+            DISK_ERROR = 1;
+        }
+        else if(inode.valid && inode.type == directory) {
+            if(defrag_dir(&inode, defrag) < 0 || dir_iterate(&inode, defrag_collect, &ctx) < 0) DISK_ERROR = 1;
+        }
+        else if(inode.valid && defrag_file(&inode, defrag) < 0) DISK_ERROR = 1;
+        journal_unlock();
+        inode_unlock(ctx.queue[q]);
     }
 
-    // read i_bitmap
-    if(bio_read(superblock.i_bitmap_blk, bitmap_blk) < 0) {
-        free(bitmap_blk);
-        exit(EXIT_FAILURE);
+
+    free(ctx.queue);
+    free(ctx.seen);
+    if(DISK_ERROR) return -EIO;
+    return 0;
+}
+
+static int timespec_cmp(const struct timespec *a, const struct timespec *b) {
+    if(a->tv_sec != b->tv_sec) return a->tv_sec < b->tv_sec ? -1 : 1;
+    if(a->tv_nsec != b->tv_nsec) return a->tv_nsec < b->tv_nsec ? -1 : 1;
+    return 0;
+}
+
+// Record a read of a file or a listing of a directory. With relatime, atime is only written when
+// it would otherwise look older than the last change, or once a day, so repeated reads don't each
+// cost an inode write; noatime never writes it.
+void inode_accessed(uint16_t ino) {
+
+    struct inode inode = {0};
+    struct timespec now;
+
+    if(tfs_config.atime == ATIME_NOATIME) return;
+
+    inode_lock(ino, 1);
+    journal_begin();
+    if(readi(ino, &inode) < 0 || !inode.valid || (inode.flags & INODE_SNAPSHOT)) {
+        journal_end();
+        inode_unlock(ino);
+        return;
     }
-    memcpy(i_bitmap, bitmap_blk, sizeof(i_bitmap));
 
-    // read d_bitmap
-    if(bio_read(superblock.d_bitmap_blk, bitmap_blk) < 0) {
-        free(bitmap_blk);
-        exit(EXIT_FAILURE);
+    clock_gettime(CLOCK_REALTIME, &now);
+    if(tfs_config.atime == ATIME_RELATIME
+    && timespec_cmp(&inode.vstat.st_atim, &inode.vstat.st_mtim) > 0
+    && timespec_cmp(&inode.vstat.st_atim, &inode.vstat.st_ctim) > 0
+    && now.tv_sec - inode.vstat.st_atim.tv_sec < RELATIME_INTERVAL
+    ) {
+        journal_end();
+        inode_unlock(ino);
+        return;
     }
-    memcpy(d_bitmap, bitmap_blk, sizeof(d_bitmap));
-    free(bitmap_blk);
 
+    inode.vstat.st_atim = now;
+    if(writei(ino, &inode) == 0) inode_dirty(ino, 0);
+    journal_end();
+    inode_unlock(ino);
+}
+
+#ifndef TFS_LOWLEVEL
+
+/* 
+ * FUSE file operations
+ */
+static void *tfs_init(struct fuse_conn_info *conn) {
 
+    tfs_mount(conn);
 	return NULL;
 }
 
 static void tfs_destroy(void *userdata) {
 
-	// Step 1: De-allocate in-memory data structures (skipped, all on stack)
-
-
-	// Step 2: Close diskfile
-    dev_close(diskfile_path);
+    tfs_unmount();
 }
 
 static int tfs_getattr(const char *path, struct stat *stbuf) {
@@ -886,14 +4882,21 @@ static int tfs_getattr(const char *path, struct stat *stbuf) {
     // Step 1: call get_node_by_path() to get inode from path
     if(get_node_by_path(path, 0, &inode) < 0) return -2;
 
-	// Step 2: fill attribute of file into stbuf from inode
+	// Step 2: fill attribute of file into stbuf from inode; they only change when the inode
+	// does, so the kernel can keep them for attr_timeout
     memcpy(stbuf, &inode.vstat, sizeof(struct stat));
-    time(&stbuf->st_mtime);
 
 
 	return 0;
 }
 
+// df's sizes and free counts, the same for every path in the mount
+static int tfs_statfs(const char *path, struct statvfs *stbuf) {
+
+    fs_statfs(stbuf);
+    return 0;
+}
+
 static int tfs_opendir(const char *path, struct fuse_file_info *fi) {
 
     struct inode inode = {0};
@@ -907,83 +4910,52 @@ static int tfs_opendir(const char *path, struct fuse_file_info *fi) {
     return 0;
 }
 
-static int tfs_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
+struct readdir_ctx {
+    void *buffer;
+    fuse_fill_dir_t filler;
+};
 
-    int DISK_ERROR = 0;
-    offset = 0;
+static int readdir_fill(const struct dirent *dirent, void *arg) {
 
+    struct readdir_ctx *ctx = arg;
     struct inode inode = {0};
-    struct dirent *dirent_blk = malloc(BLOCK_SIZE);
-    int *ptr_blk = malloc(BLOCK_SIZE);
-
-
-	// Step 1: Call get_node_by_path() to get inode from path
-    if(get_node_by_path(path, 0, &inode) < 0) return -1;
-
-	// Step 2: Read directory entries from its data blocks, and copy them to filler
-    memcpy(ptr_blk, inode.direct_ptr, sizeof(inode.direct_ptr));
-    for(int i = 0; i < 8; ) {
-        for(int j = 0; j < 16; ++j) {
-
-            // if you reach unused section of pointer array
-            if(ptr_blk[j] < 0) break;
-
-            // clear block
-            memset(dirent_blk, 0, BLOCK_SIZE);
-
-            // read block from the direct array entry
-            if(bio_read((superblock.d_start_blk+ ptr_blk[j]), dirent_blk) < 0) {
-                DISK_ERROR = 1;
-                break;
-            }
 
-            // search for directory entries in the block
-            for(int k = 0; k < dirents_per_blk; ++k) {
+    if(dir_hidden(dirent)) return 0;
 
-                // if we've reached unused section of the directory entries block
-                if(!dirent_blk[k].valid) break;
+    //get block's inode
+    readi(dirent->ino, &inode);
 
-                //get block's inode
-                struct inode temp_inode = {0};
-                readi(dirent_blk[k].ino, &temp_inode);
+    // add entry to buffer, stopping once it is full
+    return ctx->filler(ctx->buffer, dirent->name, &inode.vstat, 0);
+}
 
-                // add entry to buffer
-                if(!filler(buffer, dirent_blk[k].name, &temp_inode.vstat, (((++offset)*sizeof(struct dirent))))) {
-                    DISK_ERROR = 1;
-                }
-            }
-        }
+static int tfs_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
 
-        // if disk error occurs, break out of outer loop
-        if(DISK_ERROR) break;
+    struct inode inode = {0};
+    struct readdir_ctx ctx = { .buffer = buffer, .filler = filler };
 
-        // if we haven't checked all indirect array entries
-        if((++i) < 8) {
 
-            // if the unused pointer section of the indirect pointer array has been reached
-            if(inode.indirect_ptr[i] < 0) break;
+	// Step 1: Call get_node_by_path() to get inode from path
+    if(get_node_by_path(path, 0, &inode) < 0) return -ENOENT;
 
-            // read array block from the indirect array entry
-            if(bio_read((superblock.d_start_blk + inode.indirect_ptr[i]), ptr_blk)) {
-                DISK_ERROR = 1;
-                break;
-            }
-        }
+	// Step 2: Read directory entries from its data blocks, and copy them to filler
+    inode_lock(inode.ino, 0);
+    int retstat = readi(inode.ino, &inode) < 0 ? -1 : dir_iterate(&inode, readdir_fill, &ctx);
+    inode_unlock(inode.ino);
+    if(retstat < 0) {
+        ERROR("Failed to read directory");
+        return -EIO;
     }
+    inode_accessed(inode.ino);
 
 
-    free(ptr_blk);
-    free(dirent_blk);
-    if(DISK_ERROR) {
-        ERROR("Failed to read directory");
-        return -1;
-    }
 	return 0;
 }
 
 
 static int tfs_mkdir(const char *path, mode_t mode) {
 
+    struct inode inode = {0};
     struct inode parent_inode = {0};
     char *path_CPY1 = strdup(path);
     char *path_CPY2 = strdup(path);
@@ -992,7 +4964,7 @@ static int tfs_mkdir(const char *path, mode_t mode) {
         if(path_CPY1) free(path_CPY1);
         if(path_CPY2) free(path_CPY2);
         ERROR("Failed to allocate memory");
-        return -1;
+        return -ENOMEM;
     }
 
 
@@ -1002,66 +4974,24 @@ static int tfs_mkdir(const char *path, mode_t mode) {
 
 
     // Step 2: Call get_node_by_path() to get inode of parent directory
-    get_node_by_path(path_dirname, 0, &parent_inode);
-
-
-    // Step 3: Call get_avail_ino() to get an available inode number
-    int ino = get_avail_ino();
-    // if we failed to get a new ino
-    if(ino < 0) {
-        free(path_CPY1);
-        free(path_CPY2);
-        return -1;
-    }
-
-    int dirent_blks = (3/dirents_per_blk) + ((3%dirents_per_blk) != 0);
-    struct inode inode = {
-            .ino = ino,
-            .valid = 1,
-            .size = dirent_blks*BLOCK_SIZE,
-            .type = directory,
-            .link = 0,
-            .vstat = {
-                    .st_ino = ino,
-                    .st_mode = mode,
-                    .st_nlink = 0,
-                    .st_blksize = BLOCK_SIZE,
-                    .st_blocks = dirent_blks,
-                    .st_size = dirent_blks*BLOCK_SIZE
-            }
-    };
-    time(&inode.vstat.st_atime);
-    time(&inode.vstat.st_mtime);
-    time(&inode.vstat.st_ctime);
-    for(int i = 0; i < 8; ++i) {
-        inode.direct_ptr[i] = -1;
-        inode.direct_ptr[15-i] = -1;
-        inode.indirect_ptr[i] = -1;
+    if(get_node_by_path(path_dirname, 0, &parent_inode) < 0) {
+        free(path_CPY1);
+        free(path_CPY2);
+        return -ENOENT;
     }
-    writei(inode.ino, &inode);
 
 
-    // Step 4: Call dir_add() to add directory entry of target directory to parent directory
-    // Step 5: Update inode for target directory
-    // Step 6: Call writei() to write inode to disk
-    if(dir_add(parent_inode, inode.ino, path_basename, strlen(path_basename))
-    || dir_add(inode, inode.ino, "/", strlen("/"))
-    || dir_add(inode, inode.ino, ".", strlen("."))
-    || dir_add(inode, parent_inode.ino, "..", strlen(".."))
-    ) {
-        ERROR("Failed to create directory");
-        return -1;
-    }
+    // Step 3: Allocate the directory's inode and add its entry to the parent directory
+    int retstat = node_create(&parent_inode, path_basename, mode, directory, &inode);
+
 
-	
     free(path_CPY1);
     free(path_CPY2);
-	return 0;
+	return retstat;
 }
 
 static int tfs_rmdir(const char *path) {
 
-    struct inode inode = {0};
     struct inode parent_inode = {0};
     char *path_CPY1 = strdup(path);
     char *path_CPY2 = strdup(path);
@@ -1070,7 +5000,7 @@ static int tfs_rmdir(const char *path) {
         if(path_CPY1) free(path_CPY1);
         if(path_CPY2) free(path_CPY2);
         ERROR("Failed to allocate memory");
-        return -1;
+        return -ENOMEM;
     }
 
 
@@ -1079,20 +5009,21 @@ static int tfs_rmdir(const char *path) {
     char *path_dirname = dirname(path_CPY2);
 
 
-	// Step 2: Call get_node_by_path() to get inode of target directory
-    get_node_by_path(path, 0, &inode);
-
+	// Step 2: Call get_node_by_path() to get inode of parent directory
+    if(get_node_by_path(path_dirname, 0, &parent_inode) < 0) {
+        free(path_CPY1);
+        free(path_CPY2);
+        return -ENOENT;
+    }
 
-	// Step 3: Clear data block bitmap of target directory (skipped, handled in dir_remove())
-	// Step 4: Clear inode bitmap and its data block (skipped, handled in dir_remove())
 
-	// Step 5: Call get_node_by_path() to get inode of parent directory
-    get_node_by_path(path_dirname, 0, &parent_inode);
+	// Step 3: Remove the target directory's entry and orphan its inode
+    int retstat = node_remove(&parent_inode, path_basename, directory);
 
-	// Step 6: Call dir_remove() to remove directory entry of target directory in its parent directory
-    dir_remove(parent_inode, path_basename, strlen(path_basename));
 
-	return 0;
+    free(path_CPY1);
+    free(path_CPY2);
+	return retstat;
 }
 
 static int tfs_releasedir(const char *path, struct fuse_file_info *fi) {
@@ -1103,6 +5034,7 @@ static int tfs_releasedir(const char *path, struct fuse_file_info *fi) {
 
 static int tfs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
 
+    struct inode inode = {0};
     struct inode parent_inode = {0};
     char *path_CPY1 = strdup(path);
     char *path_CPY2 = strdup(path);
@@ -1111,7 +5043,7 @@ static int tfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
         if(path_CPY1) free(path_CPY1);
         if(path_CPY2) free(path_CPY2);
         ERROR("Failed to allocate memory");
-        return -1;
+        return -ENOMEM;
     }
 
 	// Step 1: Use dirname() and basename() to separate parent directory path and target file name
@@ -1120,54 +5052,21 @@ static int tfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 
 
 	// Step 2: Call get_node_by_path() to get inode of parent directory
-    get_node_by_path(path_dirname, 0, &parent_inode);
-
-
-	// Step 3: Call get_avail_ino() to get an available inode number
-    int ino = get_avail_ino();
-    // if we failed to get a new ino
-    if(ino < 0) {
+    if(get_node_by_path(path_dirname, 0, &parent_inode) < 0) {
         free(path_CPY1);
         free(path_CPY2);
-        return -1;
-    }
-    int dirent_blks = (3/dirents_per_blk) + ((3%dirents_per_blk) != 0);
-    struct inode inode = {
-            .ino = ino,
-            .valid = 1,
-            .size = 0,
-            .type = file,
-            .link = 0,
-            .vstat = {
-                    .st_ino = ino,
-                    .st_mode = mode,
-                    .st_nlink = 1,
-                    .st_blksize = 0,
-                    .st_blocks = dirent_blks,
-                    .st_size = 0,
-            }
-    };
-    time(&inode.vstat.st_atime);
-    time(&inode.vstat.st_mtime);
-    time(&inode.vstat.st_ctime);
-    for(int i = 0; i < 8; ++i) {
-        inode.direct_ptr[i] = -1;
-        inode.direct_ptr[15-i] = -1;
-        inode.indirect_ptr[i] = -1;
+        return -ENOENT;
     }
-    writei(inode.ino, &inode);
 
 
-	// Step 4: Call dir_add() to add directory entry of target file to parent directory
-	// Step 5: Update inode for target file
-	// Step 6: Call writei() to write inode to disk
-    if(dir_add(parent_inode, inode.ino, path_basename, strlen(path_basename))) {
-        ERROR("Failed to create directory");
-        return -1;
-    }
+	// Step 3: Allocate the file's inode and add its entry to the parent directory
+    int retstat = node_create(&parent_inode, path_basename, mode, file, &inode);
+    if(!retstat) fi->fh = FH_OPEN(inode.ino, fi->flags);
 
 
-	return 0;
+    free(path_CPY1);
+    free(path_CPY2);
+	return retstat;
 }
 
 static int tfs_open(const char *path, struct fuse_file_info *fi) {
@@ -1179,402 +5078,247 @@ static int tfs_open(const char *path, struct fuse_file_info *fi) {
 	// Step 2: If not find, return -1
     if(get_node_by_path(path, 0, &inode) < 0) return -1;
 
+    // flush and release find the inode without another path walk, and ioctl how the file was opened
+    fi->fh = FH_OPEN(inode.ino, fi->flags);
+
+    // the kernel keeps the file's cached pages if nothing was written since the last open
+    fi->keep_cache = inode_keep_cache(inode.ino);
+
 
 	return 0;
 }
 
 static int tfs_read(const char *path, char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
-    int DISK_ERROR = 0;
-    int END_OF_FILE = 0;
 
-    int bytes_to_read = size;
-    // if block and offset will reach max offset prematurely
-    // if block and offset will reach max offset prematurely
-    if((bytes_to_read + offset) > (BLOCK_SIZE*(9*16))) {
-        ERROR("Offset and size will reach max possible data offset");
-        return -1;
-    }
     struct inode inode = {0};
-    int buffer_offset = 0;
-    int first_blk_indx = offset/BLOCK_SIZE;
-    int blk_indx;
-    int blk_offset;
-    void *data_blk = malloc(BLOCK_SIZE);
-    int *ptr_blk = malloc(BLOCK_SIZE);
-    if(!data_blk
-       || !ptr_blk
-            ) {
-        if(data_blk) free(data_blk);
-        if(ptr_blk) free(ptr_blk);
-        ERROR("Failed to allocate memory");
-        return -1;
-    }
 
 
     // Step 1: You could call get_node_by_path() to get inode from path
-    get_node_by_path(path, 0, &inode);
+    if(get_node_by_path(path, 0, &inode) < 0) return -ENOENT;
 
 
 	// Step 2: Based on size and offset, read its data blocks from disk
-    // Step 3: copy the correct amount of data from offset to buffer
-    memcpy(ptr_blk, inode.direct_ptr, sizeof(inode.direct_ptr));
-    for(int i = -1; i < 8; ++i) {
-        for(int j = 0; j < 16; ++j) {
+    // Note: this function should return the amount of bytes you copied to buffer
+    int retstat = file_read(&inode, buffer, size, offset);
+    if(retstat >= 0) inode_accessed(inode.ino);
+	return retstat;
+}
 
-            // if the unset pointer array section is reached
-            if(ptr_blk[j] < 0) {
-                ERROR("reached end of file, no more bytes to read");
-                END_OF_FILE = 1;
-                break;
-            }
+static int tfs_write(const char *path, const char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
 
-            // get current block's index
-            blk_indx = ((i+1)*16) + j;
+    struct inode inode = {0};
 
-            // if we haven't reached the starting block
-            if(blk_indx < first_blk_indx) continue;
 
-            // read data block
-            if(bio_read(superblock.d_start_blk + ptr_blk[j], data_blk) < 0) {
-                DISK_ERROR = 1;
-                break;
-            }
+    // Step 1: You could call get_node_by_path() to get inode from path
+    if(get_node_by_path(path, 0, &inode) < 0) return -ENOENT;
 
-            // if the number of bits left to read is greater than the size of a block
-            if(bytes_to_read > BLOCK_SIZE) {
 
-                // if it's the starting block, calculate the block offset
-                // else block offset = 0
-                if(blk_indx == first_blk_indx) {
-                        blk_offset = offset%BLOCK_SIZE;
-                } else  blk_offset = 0;
+    // Step 2: Write the correct amount of data from offset to disk
+    // Note: this function should return the amount of bytes you write to disk
+    return file_write(inode.ino, buffer, size, offset);
+}
 
-                // copy bits to buffer
-                memcpy((buffer+buffer_offset),
-                       (data_blk+blk_offset),
-                       (BLOCK_SIZE-blk_offset)
-                );
+static int tfs_unlink(const char *path) {
 
-                // update buffer offset and bits to read
-                buffer_offset += (BLOCK_SIZE-blk_offset);
-                bytes_to_read -= (BLOCK_SIZE-blk_offset);
-                break;
-            }
+    struct inode parent_inode = {0};
+    char *path_CPY1 = strdup(path);
+    char *path_CPY2 = strdup(path);
+    if(!path_CPY1
+    || !path_CPY2) {
+        if(path_CPY1) free(path_CPY1);
+        if(path_CPY2) free(path_CPY2);
+        ERROR("Failed to allocate memory");
+        return -ENOMEM;
+    }
 
-            // copy all bits left to read to buffer
-            memcpy(buffer+buffer_offset, data_blk, bytes_to_read);
 
-            bytes_to_read = 0;
-            break;
-        }
+    // Step 1: Use dirname() and basename() to separate parent directory path and target file name
+    char *path_basename = basename(path_CPY1);
+    char *path_dirname = dirname(path_CPY2);
 
-        // if all bits are read or a disk error occurs, break out of outer loop
-        if(!bytes_to_read || END_OF_FILE || DISK_ERROR) break;
 
-        // if we haven't checked all indirect array entries
-        if((++i) < 8) {
+	// Step 2: Call get_node_by_path() to get inode of parent directory
+    if(get_node_by_path(path_dirname, 0, &parent_inode) < 0) {
+        free(path_CPY1);
+        free(path_CPY2);
+        return -ENOENT;
+    }
 
-            // if the unused pointer section of the indirect pointer array has been reached
-            if(inode.indirect_ptr[i] < 0) break;
 
-            // read array block from the indirect array entry
-            if(bio_read((superblock.d_start_blk + inode.indirect_ptr[i]), ptr_blk)) {
-                DISK_ERROR = 1;
-                break;
-            }
-        }
-    }
+	// Step 3: Remove the target file's entry and orphan its inode
+    int retstat = node_remove(&parent_inode, path_basename, file);
 
-    free(data_blk);
-    free(ptr_blk);
-    if(DISK_ERROR) return -1;
-    // Note: this function should return the amount of bytes you copied to buffer
-	return size-bytes_to_read;
+
+    free(path_CPY1);
+    free(path_CPY2);
+	return retstat;
 }
 
-static int tfs_write(const char *path, const char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
-    int DISK_ERROR = 0;
+static int tfs_rename(const char *from, const char *to) {
 
-    int bytes_to_write = size;
-    // if block and offset will reach max offset prematurely
-    if((bytes_to_write+offset) > (BLOCK_SIZE*(9*16))) {
-        ERROR("Offset and size will reach max possible data offset");
-        return -1;
-    }
-    struct inode inode = {0};
-    int buffer_offset = 0;
-    int first_blk_indx = offset/BLOCK_SIZE;
-    int blk_indx;
-    int blk_offset;
-    void *data_blk = malloc(BLOCK_SIZE);
-    int *ptr_blk = malloc(BLOCK_SIZE);
-    if(!data_blk
-    || !ptr_blk
-            ) {
-        if(data_blk) free(data_blk);
-        if(ptr_blk) free(ptr_blk);
+    struct inode parent_inode = {0};
+    struct inode new_parent_inode = {0};
+    char *from_CPY1 = strdup(from);
+    char *from_CPY2 = strdup(from);
+    char *to_CPY1 = strdup(to);
+    char *to_CPY2 = strdup(to);
+    if(!from_CPY1
+    || !from_CPY2
+    || !to_CPY1
+    || !to_CPY2) {
+        if(from_CPY1) free(from_CPY1);
+        if(from_CPY2) free(from_CPY2);
+        if(to_CPY1)   free(to_CPY1);
+        if(to_CPY2)   free(to_CPY2);
         ERROR("Failed to allocate memory");
-        return -1;
+        return -ENOMEM;
     }
 
 
+    // Step 1: Use dirname() and basename() to separate each path's parent directory and name
+    char *from_basename = basename(from_CPY1);
+    char *from_dirname = dirname(from_CPY2);
+    char *to_basename = basename(to_CPY1);
+    char *to_dirname = dirname(to_CPY2);
 
 
-    // Step 1: You could call get_node_by_path() to get inode from path
-    get_node_by_path(path, 0, &inode);
-
-
-    // Step 2: Based on size and offset, read its data blocks from disk
-    // Step 3: Write the correct amount of data from offset to disk
-    // Step 4: Update the inode info and write it to disk
-    memcpy(ptr_blk, inode.direct_ptr, sizeof(inode.direct_ptr));
-    for(int i = -1; i < 8; ++i) {
-        for(int j = 0; j < 16; ++j) {
+    // Step 2: Call get_node_by_path() to get the inodes of both parent directories
+    int retstat = 0;
+    if(get_node_by_path(from_dirname, 0, &parent_inode) < 0
+    || get_node_by_path(to_dirname, 0, &new_parent_inode) < 0
+    ) {
+        retstat = -ENOENT;
+    }
 
-            // if the unset pointer array section is reached
-            if(ptr_blk[j] < 0) {
 
-                // get available data block
-                ptr_blk[j] = get_avail_blkno();
-                if(ptr_blk[j] < 0) {
-                    DISK_ERROR = 1;
-                    break;
-                }
+    // Step 3: Move the entry, replacing the target if there is one
+    if(!retstat) retstat = node_rename(&parent_inode, from_basename, &new_parent_inode, to_basename);
 
-                //update inode
-                inode.link++;
-                inode.vstat.st_nlink++;
 
-                // clear data block
-                memset(data_blk, 0, BLOCK_SIZE);
-                if(bio_write(superblock.d_start_blk + ptr_blk[j], data_blk) < 0) {
-                    DISK_ERROR = 1;
-                    break;
-                }
-            }
+    free(from_CPY1);
+    free(from_CPY2);
+    free(to_CPY1);
+    free(to_CPY2);
+    return retstat;
+}
 
-            // get current block's index
-            blk_indx = ((i+1)*16) + j;
+static int tfs_truncate(const char *path, off_t size) {
 
-            // if we haven't reached the starting block
-            if(blk_indx < first_blk_indx) continue;
+    struct inode inode = {0};
 
-            // read data block
-            if(bio_read(superblock.d_start_blk + ptr_blk[j], data_blk) < 0) {
-                DISK_ERROR = 1;
-                break;
-            }
 
-            // if the number of bits left to read is greater than the size of a block
-            if(bytes_to_write > BLOCK_SIZE) {
+    // Step 1: Call get_node_by_path() to get inode from path
+    if(get_node_by_path(path, 0, &inode) < 0) return -ENOENT;
 
-                // if it's the starting block, calculate the block offset
-                // else block offset = 0
-                if(blk_indx == first_blk_indx) {
-                    blk_offset = offset%BLOCK_SIZE;
-                } else  blk_offset = 0;
 
-                // copy bits to block
-                memcpy((data_blk+blk_offset),
-                       (buffer+buffer_offset),
-                       (BLOCK_SIZE-blk_offset)
-                );
+    // Step 2: Free or add blocks past the new size and update mtime/ctime
+    return file_truncate(inode.ino, size);
+}
 
-                // write updated block back to disk
-                if(bio_write(superblock.d_start_blk + ptr_blk[j], data_blk) < 0) {
-                    DISK_ERROR = 1;
-                    break;
-                }
+// chattr and lsattr get and set the compression attribute; TFS_IOC_COPY_RANGE copies into the file,
+// TFS_IOC_DEFRAG defragments the file or the tree below the directory
+static int tfs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi, unsigned int flags, void *data) {
 
-                // update buffer offset and bits to read
-                buffer_offset += (BLOCK_SIZE-blk_offset);
-                bytes_to_write -= (BLOCK_SIZE-blk_offset);
-                break;
-            }
+    struct inode inode = {0};
+    struct inode src_inode = {0};
 
-            // copy all bits left to write to block
-            memcpy(data_blk,
-                   (buffer+buffer_offset),
-                   bytes_to_write
-            );
 
-            bytes_to_write = 0;
-            break;
-        }
+    // Step 1: Call get_node_by_path() to get inode from path
+    if(get_node_by_path(path, 0, &inode) < 0) return -ENOENT;
 
-        // if all bits are written or a disk error occurs, break out of outer loop
-        if(!bytes_to_write || DISK_ERROR) break;
 
-        // if we haven't checked all indirect array entries
-        if((++i) < 8) {
+    // Step 2: The kernel copies the attributes in and out through data; like write(), changing
+    // a file through a descriptor opened read-only fails
+    int read_only = (fi->fh & FH_READ_ONLY) != 0;
+    if((unsigned int)cmd == FS_IOC_GETFLAGS) return file_get_flags(inode.ino, (int *)data);
+    if((unsigned int)cmd == FS_IOC_SETFLAGS) return read_only ? -EBADF : file_set_flags(inode.ino, *(int *)data);
 
-            // if the unused pointer section of the indirect pointer array has been reached
-            if(inode.indirect_ptr[i] < 0) break;
 
-            // read array block from the indirect array entry
-            if(bio_read((superblock.d_start_blk + inode.indirect_ptr[i]), ptr_blk)) {
-                DISK_ERROR = 1;
-                break;
-            }
-        }
+    // Step 3: A copy names its source by path; the number of bytes copied is the ioctl's return value
+    if((unsigned int)cmd == TFS_IOC_COPY_RANGE) {
+        struct tfs_copy_range *range = data;
+        if(read_only) return -EBADF;
+        range->src_path[PATH_MAX - 1] = '\0';
+        if(get_node_by_path(range->src_path, 0, &src_inode) < 0) return -ENOENT;
+        return file_copy_range(src_inode.ino, range->src_offset, inode.ino, range->dst_offset, range->length,
+                               range->flags & TFS_COPY_CLONE);
     }
 
 
-    free(data_blk);
-    free(ptr_blk);
-    // Note: this function should return the amount of bytes you write to disk
-    return size-bytes_to_write;
+    // Step 4: A defrag takes its flags in and hands the counts back through data
+    if((unsigned int)cmd == TFS_IOC_DEFRAG) {
+        struct tfs_defrag *defrag = data;
+        *defrag = (struct tfs_defrag) { .flags = defrag->flags };
+        return fs_defrag(inode.ino, defrag);
+    }
+    return -ENOTTY;
 }
 
-static int tfs_unlink(const char *path) {
-    int DISK_ERROR = -1;
+static int tfs_fallocate(const char *path, int mode, off_t offset, off_t len, struct fuse_file_info *fi) {
 
     struct inode inode = {0};
-    struct inode clean_inode = {0};
-    struct inode parent_inode = {0};
-    int *ptr_blk = malloc(BLOCK_SIZE);
-    int *clean_blk = calloc(1, BLOCK_SIZE);
-    char *path_CPY1 = strdup(path);
-    char *path_CPY2 = strdup(path);
-    if(!ptr_blk
-    || !path_CPY1
-    || !path_CPY2) {
-        if(ptr_blk) free(ptr_blk);
-        if(clean_blk) free(clean_blk);
-        if(path_CPY1) free(path_CPY1);
-        if(path_CPY2) free(path_CPY2);
-        ERROR("Failed to allocate memory");
-        return -1;
-    }
-
-
-    // Step 1: Use dirname() and basename() to separate parent directory path and target file name
-    char *path_basename = basename(path_CPY1);
-    char *path_dirname = dirname(path_CPY2);
-
 
-	// Step 2: Call get_node_by_path() to get inode of target file
-    get_node_by_path(path, 0, &inode);
 
+    // Step 1: Call get_node_by_path() to get inode from path
+    if(get_node_by_path(path, 0, &inode) < 0) return -ENOENT;
 
-	// Step 3: Clear data block bitmap of target file
-    memcpy(ptr_blk, inode.direct_ptr, sizeof(inode.direct_ptr));
-    for(int i = -1; i < 8; ++i) {
-        for(int j = 0; j < 16; ++j) {
-
-            // if reached unset section of pointer array
-            if(ptr_blk[j] < 0) break;
 
-            // unset data block bitmap
-            unset_bitmap(d_bitmap, ptr_blk[j]);
+    // Step 2: Reserve the range, or punch a hole in it
+    return file_fallocate(inode.ino, mode, offset, len);
+}
 
-            // clear data block on disk
-            if(bio_write(superblock.d_start_blk + ptr_blk[j], clean_blk) < 0) {
-                DISK_ERROR = 1;
-                break;
-            }
-        }
+static int tfs_release(const char *path, struct fuse_file_info *fi) {
 
-        // if a disk error occurs
-        if(DISK_ERROR) break;
+    // write back what the last close left buffered
+    if(wb_flush(FH_INO(fi->fh)) < 0) return -EIO;
+	return 0;
+}
 
-        // if we haven't checked all indirect array entries
-        if((++i) < 8) {
+static int tfs_flush(const char * path, struct fuse_file_info * fi) {
 
-            // if the unused pointer section of the indirect pointer array has been reached
-            if(inode.indirect_ptr[i] < 0) break;
+    // close() writes back the file's buffered block
+    if(wb_flush(FH_INO(fi->fh)) < 0) return -EIO;
+    return 0;
+}
 
-            // read array block from the indirect array entry
-            if(bio_read((superblock.d_start_blk + inode.indirect_ptr[i]), ptr_blk)) {
-                DISK_ERROR = 1;
-                break;
-            }
-        }
-    }
+static int tfs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
 
-    if(DISK_ERROR) {
-        free(ptr_blk);
-        free(clean_blk);
-        free(path_CPY1);
-        free(path_CPY2);
-        return -1;
-    }
+    struct inode inode = {0};
 
-    // write data bitmap to disk
-    if(bio_write(superblock.d_bitmap_blk, d_bitmap) < 0) {
-        free(ptr_blk);
-        free(clean_blk);
-        free(path_CPY1);
-        free(path_CPY2);
-        return -1;
-    }
 
+    // Step 1: Call get_node_by_path() to get inode from path
+    if(get_node_by_path(path, 0, &inode) < 0) return -ENOENT;
 
-	// Step 4: Clear inode bitmap and its data block
 
-    // unset inode bitmap
-    unset_bitmap(i_bitmap, inode.ino);
+    // Step 2: Flush only this inode's data blocks, block map and inode block
+    if(inode_sync(inode.ino, datasync) < 0) return -EIO;
 
-    // clear inode entry
-    writei(inode.ino, &clean_inode);
 
-    // write inode bitmap to disk
-    if(bio_write(superblock.i_bitmap_blk, i_bitmap) < 0) {
-        free(ptr_blk);
-        free(clean_blk);
-        free(path_CPY1);
-        free(path_CPY2);
-        return -1;
-    }
+    return 0;
+}
 
-	// Step 5: Call get_node_by_path() to get inode of parent directory
-    if(get_node_by_path(path_dirname, 0, &parent_inode) < 0) {
-        free(ptr_blk);
-        free(clean_blk);
-        free(path_CPY1);
-        free(path_CPY2);
-        return -1;
-    }
+static int tfs_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi) {
 
+    // a directory's entries and inode are all journaled metadata, so this is the same flush
+    return tfs_fsync(path, datasync, fi);
+}
 
-	// Step 6: Call dir_remove() to remove directory entry of target file in its parent directory
-    if(dir_remove(parent_inode, path_basename, strlen(path_basename)) < 0) {
-        free(ptr_blk);
-        free(clean_blk);
-        free(path_CPY1);
-        free(path_CPY2);
-        return -1;
-    }
+static int tfs_utimens(const char *path, const struct timespec tv[2]) {
 
-    free(ptr_blk);
-    free(clean_blk);
-    free(path_CPY1);
-    free(path_CPY2);
-	return 0;
-}
+    struct inode inode = {0};
 
-static int tfs_truncate(const char *path, off_t size) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
-    return 0;
-}
 
-static int tfs_release(const char *path, struct fuse_file_info *fi) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
-	return 0;
-}
+    // Step 1: Call get_node_by_path() to get inode from path
+    if(get_node_by_path(path, 0, &inode) < 0) return -ENOENT;
 
-static int tfs_flush(const char * path, struct fuse_file_info * fi) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
-    return 0;
-}
 
-static int tfs_utimens(const char *path, const struct timespec tv[2]) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
-    return 0;
+    // Step 2: Store tv[0] as atime and tv[1] as mtime; no times means now,
+    // and UTIME_OMIT (passed through with flag_utime_omit_ok) leaves that time alone
+    static const struct timespec now[2] = { { 0, UTIME_NOW }, { 0, UTIME_NOW } };
+    if(!tv) tv = now;
+    return file_set_times(inode.ino,
+                          tv[0].tv_nsec == UTIME_OMIT ? NULL : &tv[0],
+                          tv[1].tv_nsec == UTIME_OMIT ? NULL : &tv[1]);
 }
 
 
@@ -1583,9 +5327,11 @@ static struct fuse_operations tfs_ope = {
 	.destroy	= tfs_destroy,
 
 	.getattr	= tfs_getattr,
+	.statfs		= tfs_statfs,
 	.readdir	= tfs_readdir,
 	.opendir	= tfs_opendir,
 	.releasedir	= tfs_releasedir,
+	.fsyncdir	= tfs_fsyncdir,
 	.mkdir		= tfs_mkdir,
 	.rmdir		= tfs_rmdir,
 
@@ -1594,22 +5340,39 @@ static struct fuse_operations tfs_ope = {
 	.read 		= tfs_read,
 	.write		= tfs_write,
 	.unlink		= tfs_unlink,
+	.rename		= tfs_rename,
 
 	.truncate   = tfs_truncate,
 	.flush      = tfs_flush,
+	.fsync      = tfs_fsync,
 	.utimens    = tfs_utimens,
-	.release	= tfs_release
+	.ioctl      = tfs_ioctl,
+	.fallocate  = tfs_fallocate,
+	.release	= tfs_release,
+
+	// UTIME_NOW and UTIME_OMIT reach tfs_utimens() instead of being resolved to times
+	.flag_utime_omit_ok = 1
 };
 
 
 int main(int argc, char *argv[]) {
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	char timeouts[128];
 	int fuse_stat;
 
 	getcwd(diskfile_path, PATH_MAX);
 	strcat(diskfile_path, "/DISKFILE");
 
-	fuse_stat = fuse_main(argc, argv, &tfs_ope, NULL);
+	// default cache timeouts go first so the same options given on the command line win
+	snprintf(timeouts, sizeof(timeouts), "-oentry_timeout=%d,attr_timeout=%d,negative_timeout=%d",
+			TFS_ENTRY_TIMEOUT, TFS_ATTR_TIMEOUT, TFS_NEGATIVE_TIMEOUT);
+	if (fuse_opt_insert_arg(&args, 1, timeouts) == -1
+	|| tfs_parse_opts(&args) == -1) return 1;
+
+	fuse_stat = fuse_main(args.argc, args.argv, &tfs_ope, NULL);
 
+	fuse_opt_free_args(&args);
 	return fuse_stat;
 }
 
+#endif
@@ -10,15 +10,136 @@
  */
 
 #include <linux/limits.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include "block.h"
+#include "journal.h"
+
 #ifndef _TFS_H
 #define _TFS_H
 
 #define MAGIC_NUM 0x5C3A
+// bumped whenever the on-disk layout changes
+#define TFS_VERSION 9
 #define MAX_INUM 1024
-#define MAX_DNUM (DISK_SIZE - (1 + 2 + MAX_INUM)*BLOCK_SIZE)/BLOCK_SIZE
+#define MAX_DNUM ((DISK_SIZE - (1 + 2 + MAX_INUM + JOURNAL_BLKS + CSUM_BLKS + REF_BLKS)*BLOCK_SIZE)/BLOCK_SIZE)
+
+// reference counts of data blocks shared by several files, one uint16_t per block of the disk
+#define REF_PER_BLK (BLOCK_SIZE/sizeof(uint16_t))
+#define REF_BLKS ((DISK_BLKS + REF_PER_BLK - 1)/REF_PER_BLK)
+
+// inodes and data blocks are split evenly into this many block groups, each owning a slice of both bitmaps
+#define BLOCK_GROUPS 8
+
+// buckets of the in-memory index of data blocks by content hash used by -o dedup
+#define DEDUP_BUCKETS 4096
+
+// pointers held by one indirect pointer array block
+#define PTRS_PER_BLK 16
+// largest file in blocks: the direct pointers plus every indirect pointer array
+#define MAX_FILE_BLKS (16 + 8*PTRS_PER_BLK)
+
+// on-disk inode size; the space left after the fixed fields holds a small file's data
+#define INODE_SIZE 512
+#define INLINE_MAX (INODE_SIZE - 5*sizeof(uint32_t) - sizeof(struct stat))
+
+// inode flags
+#define INODE_INLINE 1		/* the file's data or the directory's entries are held in inline_data instead of blocks */
+#define INODE_COMPRESSED 2	/* the file's data is written compressed; new files in a directory with it get it too */
+#define INODE_SNAPSHOT 4	/* the inode belongs to a snapshot, or is the directory holding them, and can't be changed */
+
+// chattr's ioctls and its compression attribute, as in <linux/fs.h>, which defines its own BLOCK_SIZE
+#ifndef FS_IOC_GETFLAGS
+#define FS_IOC_GETFLAGS _IOR('f', 1, long)
+#define FS_IOC_SETFLAGS _IOW('f', 2, long)
+#define FS_COMPR_FL 0x00000004
+#endif
+
+// an open file's handle: its inode number, with FH_READ_ONLY added if it was opened O_RDONLY, since
+// ioctl requests carry the handle but not the open flags
+#define FH_READ_ONLY (1ULL << 32)
+#define FH_INO(fh) ((uint16_t)(fh))
+#define FH_OPEN(ino, flags) ((ino) | (((flags) & O_ACCMODE) == O_RDONLY ? FH_READ_ONLY : 0))
+
+// copy_file_range for FUSE 2, which has no request for it: an ioctl on the destination file that names the
+// source by its path in the mount and returns the number of bytes copied. TFS_COPY_CLONE shares whole blocks
+// at block-aligned offsets instead of copying them.
+struct tfs_copy_range {
+	char		src_path[PATH_MAX];	/* source file, from the root of the mount, e.g. "/dir/file" */
+	uint64_t	src_offset;			/* where to start reading the source */
+	uint64_t	dst_offset;			/* where to start writing the destination */
+	uint64_t	length;				/* bytes to copy, cut short at the end of the source */
+	uint32_t	flags;				/* TFS_COPY_CLONE */
+};
+
+#define TFS_COPY_CLONE 1
+#define TFS_IOC_COPY_RANGE _IOW('T', 1, struct tfs_copy_range)
+
+// Online defragmentation: an ioctl on a file moves its blocks into one run of adjacent blocks, and on a directory
+// does so for every file below it and packs each directory's entries into as few blocks as hold them.
+// The counts are filled in on return; with TFS_DEFRAG_DRY_RUN nothing is moved and they only measure.
+struct tfs_defrag {
+	uint32_t	flags;				/* TFS_DEFRAG_DRY_RUN */
+	uint32_t	files;				/* files looked at */
+	uint32_t	frag_before;		/* files in more than one extent, before */
+	uint32_t	frag_after;			/* and after */
+	uint32_t	extents_before;		/* runs of adjacent blocks over all files, before */
+	uint32_t	extents_after;		/* and after */
+	uint32_t	blks_moved;			/* data blocks copied to a new place */
+	uint32_t	dirs_compacted;		/* directories whose entries were packed into fewer blocks */
+	uint32_t	dir_blks_freed;		/* directory blocks that freed */
+};
+
+#define TFS_DEFRAG_DRY_RUN 1
+#define TFS_IOC_DEFRAG _IOWR('T', 2, struct tfs_defrag)
+
+// a compressed file is compressed CLUSTER_SIZE bytes at a time; cluster c is file blocks
+// c*CLUSTER_BLKS on, which for c > 0 are exactly those of pointer array indirect_ptr[c-1]
+#define CLUSTER_BLKS 16
+#define CLUSTER_SIZE (CLUSTER_BLKS*BLOCK_SIZE)
+#define MAX_CLUSTERS (MAX_FILE_BLKS/CLUSTER_BLKS)
+
+// hidden directory in the root holding the snapshots; mkdir in it takes one, rmdir drops one
+#define SNAP_DIR_NAME ".snapshots"
+// most blocks copying one inode into a snapshot, or adding it to its directory, stages in a transaction
+#define SNAP_TX_BLKS 48
+// most blocks defragmenting one file stages in a transaction: its pointer arrays, the inode, the bitmap
+// and their checksum blocks; compacting a directory stages its dirent blocks on top
+#define DEFRAG_TX_BLKS 24
+
+// decompressed clusters kept in memory across all files
+#define CCACHE_CLUSTERS 64
+
+// largest read or write request negotiated with the kernel: the largest file
+#define TFS_MAX_IO (MAX_FILE_BLKS*BLOCK_SIZE)
+
+// default seconds the kernel may answer lookups, stats and failed lookups from its own caches;
+// tfs is the only writer to DISKFILE, so these only expire on changes it makes on its own.
+// -o entry_timeout=, attr_timeout= and negative_timeout= override them
+#define TFS_ENTRY_TIMEOUT 60
+#define TFS_ATTR_TIMEOUT 60
+#define TFS_NEGATIVE_TIMEOUT 60
+
+// most partially written blocks held in memory across all inodes before one is written back
+#define WB_MAX_PAGES 256
+
+// timestamps inode_touch() sets to the current time
+#define TOUCH_ATIME 1
+#define TOUCH_MTIME 2
+#define TOUCH_CTIME 4
+
+// with relatime, seconds after which a read updates atime even if the file hasn't changed since
+#define RELATIME_INTERVAL (24*60*60)
+
+// number of orphaned inodes the reclaim thread frees before releasing the allocator lock; a batch is one
+// journal handle, so its inode table blocks, with the bitmaps, superblock, reference count and checksum
+// blocks, must fit in JOURNAL_HANDLE_BLKS
+#define RECLAIM_BATCH 16
+// seconds the reclaim thread sleeps before re-checking the orphan list
+#define RECLAIM_INTERVAL 1
 
 
 #define DEBUG 0
@@ -34,6 +155,22 @@
 
 enum type { file, directory };
 
+// when reads and directory listings update atime
+enum atime_mode { ATIME_RELATIME, ATIME_NOATIME, ATIME_STRICT };
+
+// superblock states: the free counters and group hints are only trusted after a clean unmount
+#define SB_DIRTY 0
+#define SB_CLEAN 1
+
+struct group_desc {
+	uint32_t	first_ino;			/* first inode of the group */
+	uint32_t	inodes;				/* number of inodes in the group */
+	uint32_t	first_blk;			/* first data block of the group */
+	uint32_t	blks;				/* number of data blocks in the group */
+	uint32_t	ino_hint;			/* lowest inode of the group that may be free; those below it are in use */
+	uint32_t	blk_hint;			/* lowest data block of the group that may be free; those below it are in use */
+};
+
 struct superblock {
 	uint32_t	magic_num;			/* magic number */
 	uint16_t	max_inum;			/* maximum inode number */
@@ -42,6 +179,22 @@ struct superblock {
 	uint32_t	d_bitmap_blk;		/* start address of data block bitmap */
 	uint32_t	i_start_blk;		/* start address of inode region */
 	uint32_t	d_start_blk;		/* start address of data block region */
+	uint32_t	orphan_cnt;			/* number of inodes waiting to be reclaimed */
+	uint16_t	orphans[MAX_INUM];	/* unlinked inodes whose blocks haven't been freed yet */
+	uint32_t	version;			/* on-disk layout version */
+	uint32_t	j_start_blk;		/* start address of journal region */
+	uint32_t	j_blks;				/* size of journal region in blocks */
+	uint32_t	csum_start_blk;		/* start address of checksum region */
+	uint32_t	csum_blks;			/* size of checksum region in blocks */
+	uint32_t	ref_start_blk;		/* start address of data block reference count region */
+	uint32_t	ref_blks;			/* size of reference count region in blocks */
+	uint32_t	snap_ino;			/* inode of the snapshot directory */
+	uint32_t	groups;				/* number of block groups */
+	struct group_desc	group[BLOCK_GROUPS];	/* inode range and data block range of each block group */
+	uint32_t	free_inodes;		/* inodes free in the inode bitmap, kept up to date by the allocators */
+	uint32_t	free_blks;			/* data blocks free in the data block bitmap, kept up to date by the allocators */
+	uint32_t	state;				/* SB_CLEAN once unmounted with everything written back, SB_DIRTY while mounted */
+	uint32_t	snap_pending;		/* root of the snapshot being copied, dropped at mount if a crash left it; 0 for none */
 };
 
 struct inode {
@@ -50,33 +203,184 @@ struct inode {
 	uint32_t	size;				/* size of the file */
 	uint32_t	type;				/* type of the file */
 	uint32_t	link;				/* link count */
-	int			direct_ptr[16];		/* direct pointer to data block */
-	int			indirect_ptr[8];	/* indirect pointer to data block */
+	uint32_t	flags;				/* INODE_INLINE, INODE_COMPRESSED, INODE_SNAPSHOT */
+	union {
+		struct {
+			int		direct_ptr[16];		/* direct pointer to data block */
+			int		indirect_ptr[8];	/* indirect pointer to data block */
+			uint32_t	cluster_len[MAX_CLUSTERS];	/* compressed size of each cluster of a compressed file, 0 if stored as is */
+			unsigned char	unwritten[MAX_FILE_BLKS/8];	/* bitmap of blocks fallocate() allocated that haven't been written, which read as zeros */
+		};
+		char	inline_data[INLINE_MAX];	/* contents of a file no larger than INLINE_MAX, zero past size */
+	};
 	struct stat	vstat;				/* inode stat */
 };
 
+_Static_assert(sizeof(struct inode) == INODE_SIZE, "struct inode must fill INODE_SIZE");
+_Static_assert(CLUSTER_BLKS == 16 && PTRS_PER_BLK == CLUSTER_BLKS, "a cluster must be the direct pointers or one pointer array");
+
 struct dirent {
 	uint16_t ino;					/* inode number of the directory entry */
 	uint16_t valid;					/* validity of the directory entry */
 	char name[252];					/* name of the directory entry */
 };
 
+/*
+ * A directory held inline starts with the inode number of its parent, for "..", followed by its
+ * entries packed back to back; "." is implied. Its size is the number of bytes in use.
+ */
+struct inline_dirent {
+	uint16_t	ino;				/* inode number of the entry */
+	uint8_t		name_len;			/* length of the name that follows, which isn't NUL-terminated */
+	char		name[];
+} __attribute__((packed));
+
+#define INLINE_DIR_HDR sizeof(uint16_t)
+
+/* in-memory only: what fsync still has to flush for an inode */
+struct inode_state {
+	uint32_t	sync_tid;			/* journal transaction holding the inode's latest metadata change */
+	uint32_t	datasync_tid;		/* journal transaction holding the inode's latest size/block map change */
+	int			ndirty;				/* number of data blocks written since the last fsync */
+	int			cap;				/* capacity of dirty_blks */
+	int			*dirty_blks;		/* those data blocks, possibly repeated */
+	char		*wb_data;			/* buffered contents of one block not yet written, or NULL */
+	int			wb_indx;			/* file block index of the buffered block */
+	int			wb_blkno;			/* data block the buffered block is written back to */
+	int			wb_new;				/* the data block was allocated for this write and holds stale data on disk */
+	uint64_t	nlookup;			/* references the low-level daemon's kernel holds; an orphan waits for 0 */
+	uint32_t	data_gen;			/* bumped whenever the file's contents change */
+	uint32_t	cache_gen;			/* data_gen + 1 as of the last open, 0 if not opened since mount */
+};
+
+/* in-memory only: a decompressed cluster of a compressed file */
+struct ccache_entry {
+	uint16_t	ino;				/* inode number of the file */
+	int			cluster;			/* index of the cluster in the file */
+	uint64_t	last_use;			/* ccache_tick as of the last hit */
+	char		*data;				/* CLUSTER_SIZE bytes, or NULL if the entry is free */
+};
+
 
 /*
  * bitmap operations
  */
 typedef unsigned char* bitmap_t;
 
-void set_bitmap(bitmap_t b, int i) {
+static inline void set_bitmap(bitmap_t b, int i) {
     b[i / 8] |= 1 << (i & 7);
 }
 
-void unset_bitmap(bitmap_t b, int i) {
+static inline void unset_bitmap(bitmap_t b, int i) {
     b[i / 8] &= ~(1 << (i & 7));
 }
 
-uint8_t get_bitmap(bitmap_t b, int i) {
+static inline uint8_t get_bitmap(bitmap_t b, int i) {
     return b[i / 8] & (1 << (i & 7)) ? 1 : 0;
 }
 
+
+/*
+ * Superblock of a newly formatted disk, with the inodes and data blocks split evenly into groups block groups
+ * (1 to BLOCK_GROUPS). The region sizes are compiled in, since the daemon sizes its tables by them; the group
+ * ranges are read from the superblock. Shared by tfs_mkfs(), mkfs.tfs and fsck.tfs.
+ */
+static inline void mkfs_layout(struct superblock *sb, uint32_t groups) {
+
+    int i_per_blk = BLOCK_SIZE/INODE_SIZE;
+    uint32_t j_start_blk = (2 + ((MAX_INUM/i_per_blk) + (!(MAX_INUM%i_per_blk)))) + 1;
+
+    *sb = (struct superblock) {
+        .magic_num = MAGIC_NUM,
+        .max_inum = MAX_INUM,
+        .max_dnum = MAX_DNUM,
+        .i_bitmap_blk = 1,
+        .d_bitmap_blk = 2,
+        .i_start_blk = 3,
+        .version = TFS_VERSION,
+        .j_start_blk = j_start_blk,
+        .j_blks = JOURNAL_BLKS,
+        .csum_start_blk = j_start_blk + JOURNAL_BLKS,
+        .csum_blks = CSUM_BLKS,
+        .ref_start_blk = j_start_blk + JOURNAL_BLKS + CSUM_BLKS,
+        .ref_blks = REF_BLKS,
+        .d_start_blk = j_start_blk + JOURNAL_BLKS + CSUM_BLKS + REF_BLKS,
+        .snap_ino = 1,
+        .groups = groups,
+        .free_inodes = MAX_INUM - 2,
+        .free_blks = MAX_DNUM,
+        .state = SB_CLEAN
+    };
+    for(uint32_t g = 0; g < groups; ++g) {
+        sb->group[g] = (struct group_desc) {
+            .first_ino = g*MAX_INUM/groups,
+            .inodes = (g + 1)*MAX_INUM/groups - g*MAX_INUM/groups,
+            .first_blk = g*MAX_DNUM/groups,
+            .blks = (g + 1)*MAX_DNUM/groups - g*MAX_DNUM/groups,
+        };
+        sb->group[g].ino_hint = sb->group[g].first_ino;
+        sb->group[g].blk_hint = sb->group[g].first_blk;
+    }
+}
+
+
+/*
+ * inode-based operations in tfs.c, shared by the path-based daemon and the low-level one in tfs_ll.c
+ */
+struct fuse_conn_info;
+struct fuse_args;
+struct statvfs;
+
+extern char diskfile_path[PATH_MAX];
+
+void tfs_mount(struct fuse_conn_info *conn);
+void tfs_unmount();
+void fs_statfs(struct statvfs *stbuf);
+
+int readi(uint16_t ino, struct inode *inode);
+int get_node_by_path(const char *path, uint16_t ino, struct inode *inode);
+int dir_find(uint16_t ino, const char *fname, size_t name_len, struct dirent *dirent);
+int dir_iterate(struct inode *dir_inode, int (*fn)(const struct dirent *dirent, void *arg), void *arg);
+int dir_hidden(const struct dirent *dirent);
+
+int node_create(struct inode *parent_inode, const char *name, mode_t mode, enum type type, struct inode *inode);
+int node_remove(struct inode *parent_inode, const char *name, enum type type);
+int node_rename(struct inode *parent_inode, const char *name, struct inode *new_parent_inode, const char *new_name);
+int file_read(struct inode *inode, char *buffer, size_t size, off_t offset);
+int file_write(uint16_t ino, const char *buffer, size_t size, off_t offset);
+int file_truncate(uint16_t ino, off_t size);
+int file_set_times(uint16_t ino, const struct timespec *atime, const struct timespec *mtime);
+int file_get_flags(uint16_t ino, int *fsflags);
+int file_set_flags(uint16_t ino, int fsflags);
+int file_fallocate(uint16_t ino, int mode, off_t offset, off_t len);
+int file_copy_range(uint16_t src_ino, off_t src_off, uint16_t dst_ino, off_t dst_off, size_t len, int clone);
+int fs_defrag(uint16_t ino, struct tfs_defrag *defrag);
+void inode_accessed(uint16_t ino);
+
+// set by the low-level daemon: drop the attributes and pages the kernel caches for an inode changed by
+// an ioctl or by the file system itself, which the kernel can't tell changed
+extern void (*notify_inval_inode)(uint16_t ino);
+
+// options given with -o, see tfs_parse_opts()
+struct tfs_config {
+	int			writeback_cache;	/* writeback_cache: let the kernel buffer writes and send them back later, where supported */
+	int			atime;				/* relatime (default), noatime or strictatime */
+	int			csum;				/* csum (default): verify metadata checksums on read; nocsum only skips the check */
+	int			compress;			/* compress: compress every new file, not only those in a directory marked with chattr +c */
+	int			dedup;				/* dedup: share a data block between files instead of writing a copy of its contents */
+	int			lazy;				/* lazy: read the bitmaps and reference counts when first needed instead of at mount */
+	int			warmup;				/* warmup: with lazy, read them in a background thread right after mount */
+};
+
+extern struct tfs_config tfs_config;
+int tfs_parse_opts(struct fuse_args *args);
+
+void inode_lock(uint16_t ino, int exclusive);
+void inode_unlock(uint16_t ino);
+void inode_ref(uint16_t ino);
+void inode_unref(uint16_t ino, uint64_t nlookup);
+int inode_keep_cache(uint16_t ino);
+int inode_sync(uint16_t ino, int datasync);
+int wb_flush(uint16_t ino);
+
 #endif
@@ -0,0 +1,593 @@
+/*
+ *  Copyright (C) 2019 CS416 Spring 2019
+ *
+ *	Tiny File System
+ *
+ *	File:	tfs_ll.c
+ *
+ */
+
+#define FUSE_USE_VERSION 26
+
+#include <fuse_lowlevel.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <stddef.h>
+#include <sys/statvfs.h>
+
+#include "block.h"
+#include "journal.h"
+#include "tfs.h"
+
+// the kernel numbers the root FUSE_ROOT_ID (1), tfs numbers it 0
+#define TO_FUSE_INO(ino) ((fuse_ino_t)(ino) + 1)
+#define TO_TFS_INO(ino) ((uint16_t)((ino) - 1))
+
+// seconds the kernel may answer lookups, stats and failed lookups from its own caches
+struct tfs_ll_config {
+	double		entry_timeout;
+	double		attr_timeout;
+	double		negative_timeout;
+};
+
+static struct tfs_ll_config config = {
+    .entry_timeout = TFS_ENTRY_TIMEOUT,
+    .attr_timeout = TFS_ATTR_TIMEOUT,
+    .negative_timeout = TFS_NEGATIVE_TIMEOUT,
+};
+
+#define TFS_LL_OPT(t, p) { t, offsetof(struct tfs_ll_config, p), 0 }
+
+static const struct fuse_opt tfs_ll_opts[] = {
+    TFS_LL_OPT("entry_timeout=%lf", entry_timeout),
+    TFS_LL_OPT("attr_timeout=%lf", attr_timeout),
+    TFS_LL_OPT("negative_timeout=%lf", negative_timeout),
+    FUSE_OPT_END
+};
+
+// the mounted channel, for cache invalidations the file system sends on its own
+static struct fuse_chan *tfs_ll_chan = NULL;
+
+// inodes whose invalidation hasn't been sent yet, guarded by inval_lock. A thread of their own sends them:
+// the kernel may wait on pages locked by a read queued behind the request that changed the inode.
+static unsigned char inval_pending[MAX_INUM/8];
+static int inval_stop = 0;
+static pthread_mutex_t inval_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t inval_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t inval_thread;
+static int inval_running = 0;
+
+
+static void fill_stat(const struct inode *inode, struct stat *stbuf) {
+
+    memcpy(stbuf, &inode->vstat, sizeof(struct stat));
+    stbuf->st_ino = TO_FUSE_INO(inode->ino);
+}
+
+static void fill_entry(const struct inode *inode, struct fuse_entry_param *e) {
+
+    memset(e, 0, sizeof(struct fuse_entry_param));
+    e->ino = TO_FUSE_INO(inode->ino);
+    e->attr_timeout = config.attr_timeout;
+    e->entry_timeout = config.entry_timeout;
+    fill_stat(inode, &e->attr);
+}
+
+// Reply with an entry, taking the kernel reference it hands out unless the reply didn't arrive
+static void reply_entry(fuse_req_t req, const struct inode *inode) {
+
+    struct fuse_entry_param e;
+
+    fill_entry(inode, &e);
+    inode_ref(inode->ino);
+    if(fuse_reply_entry(req, &e)) inode_unref(inode->ino, 1);
+}
+
+static void inval_inode(uint16_t ino) {
+
+    pthread_mutex_lock(&inval_lock);
+    set_bitmap(inval_pending, ino);
+    pthread_cond_signal(&inval_cond);
+    pthread_mutex_unlock(&inval_lock);
+}
+
+static void *inval_worker(void *arg) {
+
+    pthread_mutex_lock(&inval_lock);
+    while(!inval_stop) {
+
+        int sent = 0;
+        for(int ino = 0; ino < MAX_INUM; ++ino) {
+            if(!get_bitmap(inval_pending, ino)) continue;
+            unset_bitmap(inval_pending, ino);
+            pthread_mutex_unlock(&inval_lock);
+
+            // the kernel drops the inode's attributes and cached pages and asks again
+            if(tfs_ll_chan) fuse_lowlevel_notify_inval_inode(tfs_ll_chan, TO_FUSE_INO(ino), 0, 0);
+            pthread_mutex_lock(&inval_lock);
+            sent = 1;
+        }
+        if(!sent) pthread_cond_wait(&inval_cond, &inval_lock);
+    }
+    pthread_mutex_unlock(&inval_lock);
+    return NULL;
+}
+
+static int read_dir(fuse_ino_t ino, struct inode *inode) {
+
+    if(readi(TO_TFS_INO(ino), inode) < 0) return -EIO;
+    if(inode->type != directory) return -ENOTDIR;
+    return 0;
+}
+
+
+/*
+ * FUSE low-level operations
+ */
+static void tfs_ll_init(void *userdata, struct fuse_conn_info *conn) {
+
+    tfs_mount(conn);
+    inval_stop = 0;
+    if(pthread_create(&inval_thread, NULL, inval_worker, NULL)) {
+        ERROR("Failed to start the invalidation thread");
+        return;
+    }
+    inval_running = 1;
+    notify_inval_inode = inval_inode;
+}
+
+static void tfs_ll_destroy(void *userdata) {
+
+    notify_inval_inode = NULL;
+    if(inval_running) {
+        pthread_mutex_lock(&inval_lock);
+        inval_stop = 1;
+        pthread_cond_signal(&inval_cond);
+        pthread_mutex_unlock(&inval_lock);
+        pthread_join(inval_thread, NULL);
+        inval_running = 0;
+    }
+    tfs_unmount();
+}
+
+static void tfs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+
+    struct inode parent_inode = {0};
+    struct inode inode = {0};
+    struct dirent dirent = {0};
+
+
+    // Step 1: Search the parent directory's entries for name
+    int retstat = read_dir(parent, &parent_inode);
+    if(retstat < 0) {
+        fuse_reply_err(req, -retstat);
+        return;
+    }
+    // the parent stays locked until the entry is referenced, so an unlink can't free it in between
+    inode_lock(parent_inode.ino, 0);
+    if(dir_find(parent_inode.ino, name, strlen(name), &dirent) < 0) {
+        inode_unlock(parent_inode.ino);
+
+        // an entry with inode 0 lets the kernel cache the miss for negative_timeout
+        if(config.negative_timeout > 0) {
+            struct fuse_entry_param e = { .ino = 0, .entry_timeout = config.negative_timeout };
+            fuse_reply_entry(req, &e);
+        }
+        else fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+
+    // Step 2: Answer with its inode; the kernel keeps the dentry and asks again only when it expires
+    if(readi(dirent.ino, &inode) < 0) fuse_reply_err(req, EIO);
+    else reply_entry(req, &inode);
+    inode_unlock(parent_inode.ino);
+}
+
+static void tfs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+
+    inode_unref(TO_TFS_INO(ino), nlookup);
+    fuse_reply_none(req);
+}
+
+static void tfs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+
+    struct inode inode = {0};
+    struct stat stbuf;
+
+    if(readi(TO_TFS_INO(ino), &inode) < 0) {
+        fuse_reply_err(req, EIO);
+        return;
+    }
+    fill_stat(&inode, &stbuf);
+    fuse_reply_attr(req, &stbuf, config.attr_timeout);
+}
+
+static void tfs_ll_statfs(fuse_req_t req, fuse_ino_t ino) {
+
+    struct statvfs stbuf;
+
+    fs_statfs(&stbuf);
+    fuse_reply_statfs(req, &stbuf);
+}
+
+static void tfs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi) {
+
+    static const struct timespec now = { 0, UTIME_NOW };
+    int retstat = 0;
+
+
+    // Step 1: Resize the file; mode and owner changes are not stored
+    if(to_set & FUSE_SET_ATTR_SIZE) retstat = file_truncate(TO_TFS_INO(ino), attr->st_size);
+
+
+    // Step 2: Set atime and mtime, to the given times or the current one
+    if(!retstat && (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME))) {
+        const struct timespec *atime = NULL;
+        const struct timespec *mtime = NULL;
+        if(to_set & FUSE_SET_ATTR_ATIME) atime = to_set & FUSE_SET_ATTR_ATIME_NOW ? &now : &attr->st_atim;
+        if(to_set & FUSE_SET_ATTR_MTIME) mtime = to_set & FUSE_SET_ATTR_MTIME_NOW ? &now : &attr->st_mtim;
+        retstat = file_set_times(TO_TFS_INO(ino), atime, mtime);
+    }
+    if(retstat < 0) {
+        fuse_reply_err(req, -retstat);
+        return;
+    }
+
+
+    // Step 3: Answer with the attributes as they are now
+    tfs_ll_getattr(req, ino, fi);
+}
+
+static void tfs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+
+    struct inode parent_inode = {0};
+    struct inode inode = {0};
+
+    int retstat = read_dir(parent, &parent_inode);
+    if(!retstat) retstat = node_create(&parent_inode, name, mode, directory, &inode);
+    if(retstat < 0) {
+        fuse_reply_err(req, -retstat);
+        return;
+    }
+    reply_entry(req, &inode);
+}
+
+static void tfs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+
+    struct inode parent_inode = {0};
+
+    int retstat = read_dir(parent, &parent_inode);
+    if(!retstat) retstat = node_remove(&parent_inode, name, directory);
+    fuse_reply_err(req, -retstat);
+}
+
+static void tfs_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi) {
+
+    struct inode parent_inode = {0};
+    struct inode inode = {0};
+    struct fuse_entry_param e;
+
+    int retstat = read_dir(parent, &parent_inode);
+    if(!retstat) retstat = node_create(&parent_inode, name, mode, file, &inode);
+    if(retstat < 0) {
+        fuse_reply_err(req, -retstat);
+        return;
+    }
+
+    fi->fh = FH_OPEN(inode.ino, fi->flags);
+    fill_entry(&inode, &e);
+    inode_ref(inode.ino);
+    if(fuse_reply_create(req, &e, fi)) inode_unref(inode.ino, 1);
+}
+
+static void tfs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+
+    struct inode parent_inode = {0};
+
+    // an open file stays readable until the kernel forgets it, see orphans_ready()
+    int retstat = read_dir(parent, &parent_inode);
+    if(!retstat) retstat = node_remove(&parent_inode, name, file);
+    fuse_reply_err(req, -retstat);
+}
+
+static void tfs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname) {
+
+    struct inode parent_inode = {0};
+    struct inode new_parent_inode = {0};
+
+    int retstat = read_dir(parent, &parent_inode);
+    if(!retstat) retstat = read_dir(newparent, &new_parent_inode);
+    if(!retstat) retstat = node_rename(&parent_inode, name, &new_parent_inode, newname);
+    fuse_reply_err(req, -retstat);
+}
+
+static void tfs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+
+    struct inode inode = {0};
+
+    if(readi(TO_TFS_INO(ino), &inode) < 0) {
+        fuse_reply_err(req, EIO);
+        return;
+    }
+    if(inode.type == directory) {
+        fuse_reply_err(req, EISDIR);
+        return;
+    }
+    fi->fh = FH_OPEN(inode.ino, fi->flags);
+    fi->keep_cache = inode_keep_cache(inode.ino);
+    fuse_reply_open(req, fi);
+}
+
+static void tfs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+
+    struct inode inode = {0};
+    char *buffer = malloc(size ? size : 1);
+    if(!buffer) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    int retstat = readi(TO_TFS_INO(ino), &inode) < 0 ? -EIO : file_read(&inode, buffer, size, off);
+    if(retstat < 0) fuse_reply_err(req, -retstat);
+    else {
+        fuse_reply_buf(req, buffer, retstat);
+        inode_accessed(inode.ino);
+    }
+
+    free(buffer);
+}
+
+static void tfs_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off, struct fuse_file_info *fi) {
+
+    int retstat = file_write(TO_TFS_INO(ino), buf, size, off);
+    if(retstat < 0) fuse_reply_err(req, -retstat);
+    else fuse_reply_write(req, retstat);
+}
+
+static void tfs_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+
+    fuse_reply_err(req, wb_flush(TO_TFS_INO(ino)) < 0 ? EIO : 0);
+}
+
+static void tfs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+
+    fuse_reply_err(req, wb_flush(TO_TFS_INO(ino)) < 0 ? EIO : 0);
+}
+
+static void tfs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+
+    fuse_reply_err(req, inode_sync(TO_TFS_INO(ino), datasync) < 0 ? EIO : 0);
+}
+
+// chattr and lsattr get and set the compression attribute; TFS_IOC_COPY_RANGE copies into the file,
+// TFS_IOC_DEFRAG defragments the file or the tree below the directory
+static void tfs_ll_ioctl(fuse_req_t req, fuse_ino_t ino, int cmd, void *arg, struct fuse_file_info *fi,
+                         unsigned flags, const void *in_buf, size_t in_bufsz, size_t out_bufsz) {
+
+    int fsflags = 0;
+    int retstat;
+
+    // like write(), changing a file through a descriptor opened read-only fails; a directory's handle is its listing
+    if(((unsigned int)cmd == FS_IOC_SETFLAGS || (unsigned int)cmd == TFS_IOC_COPY_RANGE)
+    && !(flags & FUSE_IOCTL_DIR) && (fi->fh & FH_READ_ONLY)) {
+        fuse_reply_err(req, EBADF);
+    }
+    else if((unsigned int)cmd == FS_IOC_GETFLAGS && out_bufsz >= sizeof(int)) {
+        retstat = file_get_flags(TO_TFS_INO(ino), &fsflags);
+        if(retstat < 0) fuse_reply_err(req, -retstat);
+        else fuse_reply_ioctl(req, 0, &fsflags, sizeof(int));
+    }
+    else if((unsigned int)cmd == FS_IOC_SETFLAGS && in_bufsz >= sizeof(int)) {
+        retstat = file_set_flags(TO_TFS_INO(ino), *(const int *)in_buf);
+        if(retstat < 0) fuse_reply_err(req, -retstat);
+        else fuse_reply_ioctl(req, 0, NULL, 0);
+    }
+    else if((unsigned int)cmd == TFS_IOC_COPY_RANGE && in_bufsz >= sizeof(struct tfs_copy_range)) {
+        struct tfs_copy_range range;
+        struct inode src_inode = {0};
+        memcpy(&range, in_buf, sizeof(range));
+        range.src_path[PATH_MAX - 1] = '\0';
+        retstat = get_node_by_path(range.src_path, 0, &src_inode) < 0 ? -ENOENT
+                : file_copy_range(src_inode.ino, range.src_offset, TO_TFS_INO(ino), range.dst_offset, range.length,
+                                  range.flags & TFS_COPY_CLONE);
+        if(retstat < 0) fuse_reply_err(req, -retstat);
+        else fuse_reply_ioctl(req, retstat, NULL, 0);
+    }
+    else if((unsigned int)cmd == TFS_IOC_DEFRAG
+         && in_bufsz >= sizeof(struct tfs_defrag) && out_bufsz >= sizeof(struct tfs_defrag)) {
+        struct tfs_defrag defrag = { .flags = ((const struct tfs_defrag *)in_buf)->flags };
+        retstat = fs_defrag(TO_TFS_INO(ino), &defrag);
+        if(retstat < 0) fuse_reply_err(req, -retstat);
+        else fuse_reply_ioctl(req, 0, &defrag, sizeof(defrag));
+    }
+    else fuse_reply_err(req, ENOTTY);
+}
+
+static void tfs_ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length,
+                             struct fuse_file_info *fi) {
+
+    fuse_reply_err(req, -file_fallocate(TO_TFS_INO(ino), mode, offset, length));
+}
+
+// A directory's entries as they were when it was opened, kept in fi->fh and handed out in slices. An offset is
+// where an entry starts in buf, so entries added or removed after opendir can't make a later call skip any.
+struct dir_listing {
+    fuse_req_t req;				/* the opendir request, while the listing is built */
+    char *buf;
+    size_t len;					/* bytes of buf filled */
+    size_t *ends;				/* where each entry ends, which is the next one's offset */
+    size_t n;
+    int error;					/* set if memory ran out, which stops the walk */
+};
+
+static void listing_free(struct dir_listing *list) {
+
+    free(list->buf);
+    free(list->ends);
+    free(list);
+}
+
+static int listing_add(const struct dirent *dirent, void *arg) {
+
+    struct dir_listing *list = arg;
+    struct inode inode = {0};
+    struct stat stbuf = {0};
+
+    if(dir_hidden(dirent)) return 0;
+
+    // only the inode number and file type go into a directory entry
+    readi(dirent->ino, &inode);
+    stbuf.st_ino = TO_FUSE_INO(dirent->ino);
+    stbuf.st_mode = inode.vstat.st_mode;
+
+    size_t entsize = fuse_add_direntry(list->req, NULL, 0, dirent->name, NULL, 0);
+    char *buf = realloc(list->buf, list->len + entsize);
+    if(buf) list->buf = buf;
+    size_t *ends = realloc(list->ends, (list->n + 1)*sizeof(size_t));
+    if(ends) list->ends = ends;
+    if(!buf || !ends) {
+        list->error = 1;
+        return 1;
+    }
+
+    fuse_add_direntry(list->req, list->buf + list->len, entsize, dirent->name, &stbuf, list->len + entsize);
+    list->len += entsize;
+    list->ends[list->n++] = list->len;
+    return 0;
+}
+
+static void tfs_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+
+    struct inode inode = {0};
+
+    int retstat = read_dir(ino, &inode);
+    if(retstat < 0) {
+        fuse_reply_err(req, -retstat);
+        return;
+    }
+
+    struct dir_listing *list = calloc(1, sizeof(struct dir_listing));
+    if(!list) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    list->req = req;
+
+    // the directory is locked shared while it is listed, so the listing is one state of it
+    inode_lock(inode.ino, 0);
+    retstat = readi(inode.ino, &inode) < 0 ? -1 : dir_iterate(&inode, listing_add, list);
+    inode_unlock(inode.ino);
+    if(retstat < 0 || list->error) {
+        fuse_reply_err(req, retstat < 0 ? EIO : ENOMEM);
+        listing_free(list);
+        return;
+    }
+
+    // the kernel sends releasedir only for a handle it got
+    fi->fh = (uintptr_t)list;
+    if(fuse_reply_open(req, fi)) listing_free(list);
+}
+
+static void tfs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+
+    struct dir_listing *list = (struct dir_listing *)(uintptr_t)fi->fh;
+    size_t i = 0;
+
+    if(off < 0 || (size_t)off > list->len) {
+        fuse_reply_buf(req, NULL, 0);
+        return;
+    }
+
+    // off is where an entry starts; send the whole entries from there that fit in size
+    size_t end = off;
+    while(i < list->n && list->ends[i] <= (size_t)off) ++i;
+    while(i < list->n && list->ends[i] - off <= size) end = list->ends[i++];
+    fuse_reply_buf(req, list->buf + off, end - off);
+    inode_accessed(TO_TFS_INO(ino));
+}
+
+static void tfs_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+
+    listing_free((struct dir_listing *)(uintptr_t)fi->fh);
+    fuse_reply_err(req, 0);
+}
+
+static void tfs_ll_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+
+    // a directory's entries and inode are all journaled metadata, so this is the same flush
+    tfs_ll_fsync(req, ino, datasync, fi);
+}
+
+
+static struct fuse_lowlevel_ops tfs_ll_ope = {
+	.init		= tfs_ll_init,
+	.destroy	= tfs_ll_destroy,
+
+	.lookup		= tfs_ll_lookup,
+	.forget		= tfs_ll_forget,
+	.getattr	= tfs_ll_getattr,
+	.setattr	= tfs_ll_setattr,
+	.statfs		= tfs_ll_statfs,
+
+	.readdir	= tfs_ll_readdir,
+	.opendir	= tfs_ll_opendir,
+	.releasedir	= tfs_ll_releasedir,
+	.fsyncdir	= tfs_ll_fsyncdir,
+	.mkdir		= tfs_ll_mkdir,
+	.rmdir		= tfs_ll_rmdir,
+
+	.create		= tfs_ll_create,
+	.open		= tfs_ll_open,
+	.read		= tfs_ll_read,
+	.write		= tfs_ll_write,
+	.unlink		= tfs_ll_unlink,
+	.rename		= tfs_ll_rename,
+
+	.flush		= tfs_ll_flush,
+	.fsync		= tfs_ll_fsync,
+	.release	= tfs_ll_release,
+	.ioctl		= tfs_ll_ioctl,
+	.fallocate	= tfs_ll_fallocate
+};
+
+
+int main(int argc, char *argv[]) {
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	struct fuse_chan *ch;
+	char *mountpoint;
+	int multithreaded, foreground;
+	int err = -1;
+
+	getcwd(diskfile_path, PATH_MAX);
+	strcat(diskfile_path, "/DISKFILE");
+
+	if (fuse_opt_parse(&args, &config, tfs_ll_opts, NULL) != -1
+	&& tfs_parse_opts(&args) != -1
+	&& fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) != -1
+	&& (ch = fuse_mount(mountpoint, &args)) != NULL) {
+		struct fuse_session *se = fuse_lowlevel_new(&args, &tfs_ll_ope, sizeof(tfs_ll_ope), NULL);
+		if (se != NULL) {
+			if (fuse_set_signal_handlers(se) != -1) {
+				fuse_session_add_chan(se, ch);
+				tfs_ll_chan = ch;
+				fuse_daemonize(foreground);
+				err = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+				fuse_remove_signal_handlers(se);
+				tfs_ll_chan = NULL;
+				fuse_session_remove_chan(ch);
+			}
+			fuse_session_destroy(se);
+		}
+		fuse_unmount(mountpoint, ch);
+		free(mountpoint);
+	}
+	fuse_opt_free_args(&args);
+
+	return err ? 1 : 0;
+}